@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "camera.h"
+#include "cardMaker.h"
+
+#include "krender/core/compound_pass.h"
+
+
+CompoundPass::CompoundPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        bool has_srgb, bool has_alpha, float sx, float sy):
+        RenderPass(name, index, win, cam, has_srgb, has_alpha, sx, sy) {
+}
+
+/*
+ * Deletes the subpasses, the camera belongs to the first one.
+ */
+CompoundPass::~CompoundPass() {
+    for (unsigned int i = 0; i < _subpasses.size(); i++) {
+        delete _subpasses[i];
+    }
+    _cam = NodePath();
+}
+
+unsigned int CompoundPass::get_num_subpasses() {
+    return _subpasses.size();
+}
+
+PostPass* CompoundPass::get_subpass(unsigned int i) {
+    return _subpasses[i];
+}
+
+/*
+ * Passes the input to the cards of all subpasses.
+ */
+void CompoundPass::set_shader_input(const ShaderInput &input) {
+    for (unsigned int i = 0; i < _subpasses.size(); i++) {
+        _subpasses[i]->get_source_card().set_shader_input(input);
+    }
+}
+
+/*
+ * Scales all subpasses relative to their own initial sizes.
+ */
+void CompoundPass::set_resolution_scale(float scale) {
+    _scale_x = _base_scale_x * scale;
+    _scale_y = _base_scale_y * scale;
+    for (unsigned int i = 0; i < _subpasses.size(); i++) {
+        _subpasses[i]->set_resolution_scale(scale);
+    }
+}
+
+/*
+ * Activates the FBOs of all subpasses.
+ */
+void CompoundPass::_set_active(bool active) {
+    for (unsigned int i = 0; i < _subpasses.size(); i++) {
+        PointerTo<GraphicsOutput> fbo = _subpasses[i]->get_fbo();
+        if (fbo->is_active() != active)
+            fbo->set_active(active);
+    }
+}
+
+/*
+ * Makes a new subpass, which renders a full-screen card with the given shader.
+ */
+PostPass* CompoundPass::_make_subpass(
+        const char* suffix, GraphicsWindow* win, NodePath cam,
+        bool has_srgb, bool has_alpha, float sx, float sy,
+        Shader* shader) {
+    char* subpass_name = (char*) malloc((strlen(_name) + strlen(suffix) + 2) * sizeof(char));
+    sprintf(subpass_name, "%s_%s", _name, suffix);
+
+    CardMaker cm(subpass_name);
+    cm.set_frame_fullscreen_quad();
+    NodePath card = NodePath(cm.generate());
+
+    PostPass* subpass = new PostPass(
+        subpass_name, _index + _subpasses.size(), win, cam,
+        has_srgb, has_alpha, sx, sy, card);
+    free(subpass_name);
+    return _add_subpass(subpass, card, shader);
+}
+
+/*
+ * Makes a new subpass with the given color target.
+ */
+PostPass* CompoundPass::_make_subpass(
+        const char* suffix, GraphicsWindow* win, NodePath cam,
+        FrameBufferProperties* fbp, Texture::Format format,
+        float sx, float sy, Shader* shader) {
+    char* subpass_name = (char*) malloc((strlen(_name) + strlen(suffix) + 2) * sizeof(char));
+    sprintf(subpass_name, "%s_%s", _name, suffix);
+
+    CardMaker cm(subpass_name);
+    cm.set_frame_fullscreen_quad();
+    NodePath card = NodePath(cm.generate());
+
+    PostPass* subpass = new PostPass(
+        subpass_name, _index + _subpasses.size(), win, cam,
+        fbp, format, sx, sy, card);
+    free(subpass_name);
+    return _add_subpass(subpass, card, shader);
+}
+
+PostPass* CompoundPass::_add_subpass(PostPass* subpass, NodePath card, Shader* shader) {
+    if (shader != nullptr)
+        card.set_shader(shader, 100);
+
+    // setup projection camera which captures the card of this subpass
+    ((Camera*) subpass->get_camera().node())->set_scene(card);
+
+    _subpasses.push_back(subpass);
+    return subpass;
+}
+
+/*
+ * Exposes the first subpass as the source and the last one as the result.
+ */
+void CompoundPass::_finish(char* tex_name) {
+    _cam = _subpasses.front()->get_camera();
+    _source_card = _subpasses.front()->get_source_card();
+    _result_card = _subpasses.back()->get_result_card();
+    _tex.push_back(_subpasses.back()->get_texture(0));
+    _tex.back()->set_name(tex_name);
+}
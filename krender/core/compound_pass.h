@@ -0,0 +1,40 @@
+#ifndef CORE_COMPOUND_PASS_H
+#define CORE_COMPOUND_PASS_H
+
+#include "krender/core/post_pass.h"
+#include "krender/core/render_pass.h"
+
+
+/*
+ * Render pass made of several full-screen subpasses,
+ * each one renders a card of its own into its own FBO.
+ */
+class CompoundPass: public RenderPass {
+public:
+    CompoundPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        bool has_srgb=false, bool has_alpha=false,
+        float sx=1, float sy=1);
+    virtual ~CompoundPass();
+    unsigned int get_num_subpasses();
+    PostPass* get_subpass(unsigned int i);
+    virtual void set_shader_input(const ShaderInput &input);
+    virtual void set_resolution_scale(float scale);
+
+protected:
+    pvector<PostPass*> _subpasses;
+
+    virtual void _set_active(bool active);
+    PostPass* _make_subpass(
+        const char* suffix, GraphicsWindow* win, NodePath cam,
+        bool has_srgb, bool has_alpha, float sx, float sy,
+        Shader* shader);
+    PostPass* _make_subpass(
+        const char* suffix, GraphicsWindow* win, NodePath cam,
+        FrameBufferProperties* fbp, Texture::Format format,
+        float sx, float sy, Shader* shader);
+    PostPass* _add_subpass(PostPass* subpass, NodePath card, Shader* shader);
+    void _finish(char* tex_name);
+};
+
+#endif
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <string.h>
+
+#include "cardMaker.h"
+#include "computeNode.h"
+#include "frameBufferProperties.h"
+#include "omniBoundingVolume.h"
+#include "orthographicLens.h"
+
+#include "krender/core/compute_pass.h"
+
+
+ComputePass::ComputePass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        float sx, float sy):
+        RenderPass(name, index, win, cam, false, false, sx, sy) {
+    _type = COMPUTE_PASS;
+
+    // the compute node is dispatched, when it is drawn by a camera,
+    // so the pass owns a tiny buffer ordered with the other passes
+    FrameBufferProperties* fbp = new FrameBufferProperties();
+    fbp->set_rgba_bits(1, 1, 1, 1);
+    _fbo = win->make_texture_buffer(_name, 1, 1, nullptr, false, fbp);
+    delete fbp;
+    _fbo->clear_render_textures();
+    _fbo->set_sort(_index);
+    _fbo->set_clear_color_active(false);
+
+    char* node_name = (char*) malloc((strlen(name) + strlen("_compute") + 1) * sizeof(char));
+    sprintf(node_name, "%s_compute", name);
+    PointerTo<ComputeNode> compute_node = new ComputeNode(node_name);
+    free(node_name);
+    _dispatch_index = compute_node->add_dispatch(1, 1, 1);
+    compute_node->set_bounds(new OmniBoundingVolume());
+    compute_node->set_final(true);
+    _source_card = NodePath(compute_node);
+
+    // float image, sRGB formats can't be written by image stores
+    char* tex_name = (char*) malloc((strlen(name) + strlen("_color") + 1) * sizeof(char));
+    sprintf(tex_name, "%s_color", name);
+    PointerTo<Texture> t = new Texture(tex_name);
+    free(tex_name);
+    t->set_wrap_u(SamplerState::WM_clamp);
+    t->set_wrap_v(SamplerState::WM_clamp);
+    t->set_magfilter(SamplerState::FilterType::FT_linear);
+    t->set_minfilter(SamplerState::FilterType::FT_linear);
+    _tex.push_back(t);
+    _resize();
+    _source_card.set_shader_input(ShaderInput(std::string("output_image"), t, false, true, -1, 0));
+
+    // card showing the output, which is captured by the following post pass
+    char* card_name = (char*) malloc((strlen(name) + strlen("_card") + 1) * sizeof(char));
+    sprintf(card_name, "%s_card", name);
+    CardMaker cm(card_name);
+    free(card_name);
+    cm.set_frame_fullscreen_quad();
+    _result_card = NodePath(cm.generate());
+    _result_card.set_texture(t);
+
+    char* cam_name = (char*) malloc((strlen(name) + strlen("_camera") + 1) * sizeof(char));
+    sprintf(cam_name, "%s_camera", name);
+    _cam = _make_camera(_fbo, cam_name, cam);
+    free(cam_name);
+    ((Camera*) _cam.node())->set_scene(_source_card);
+}
+
+/*
+ * Resizes the output image instead of the buffer, which stays tiny.
+ */
+void ComputePass::set_resolution_scale(float scale) {
+    _scale_x = _base_scale_x * scale;
+    _scale_y = _base_scale_y * scale;
+    _resize();
+}
+
+/*
+ * Fits the output image to the window size and dispatches a work group
+ * per 8x8 texels, the shader skips texels outside of the image.
+ */
+void ComputePass::_resize() {
+    int width = std::max((int) (_win->get_x_size() * _scale_x), 1);
+    int height = std::max((int) (_win->get_y_size() * _scale_y), 1);
+    PointerTo<Texture> t = _tex[0];
+    if (t->get_x_size() == width && t->get_y_size() == height)
+        return;
+
+    t->setup_2d_texture(width, height, Texture::T_float, Texture::F_rgba16);
+    t->set_clear_color(LColor(0, 0, 0, 1));
+
+    ComputeNode* compute_node = (ComputeNode*) _source_card.node();
+    compute_node->set_dispatch(_dispatch_index, LVecBase3i(
+        (width + COMPUTE_GROUP_SIZE - 1) / COMPUTE_GROUP_SIZE,
+        (height + COMPUTE_GROUP_SIZE - 1) / COMPUTE_GROUP_SIZE,
+        1));
+}
+
+/*
+ * Makes a new camera, which only draws the compute node.
+ */
+NodePath ComputePass::_make_camera(PointerTo<GraphicsOutput> fbo, char* name, NodePath camera2d) {
+    NodePath cam = camera2d.attach_new_node(new Camera(name));
+
+    Lens* lens = new OrthographicLens();
+    lens->set_film_size(2, 2);
+    lens->set_near_far(-1000, 1000);
+    ((Camera*) cam.node())->set_lens(lens);
+
+    DisplayRegion* dr = fbo->make_mono_display_region();
+    dr->set_clear_color_active(false);
+    dr->set_clear_depth_active(false);
+    dr->set_sort(_index);
+    dr->set_camera(cam);
+    _region = dr;
+
+    return cam;
+}
@@ -0,0 +1,29 @@
+#ifndef CORE_COMPUTE_PASS_H
+#define CORE_COMPUTE_PASS_H
+
+#include "krender/core/render_pass.h"
+
+#define COMPUTE_GROUP_SIZE 8
+
+
+/*
+ * Render pass which dispatches a compute shader over its output image,
+ * one invocation per texel in 8x8 work groups.
+ * The shader writes "output_image", the following passes
+ * receive it as the color of this pass.
+ */
+class ComputePass: public RenderPass {
+public:
+    ComputePass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        float sx=1, float sy=1);
+    virtual void set_resolution_scale(float scale);
+
+private:
+    int _dispatch_index;
+
+    NodePath _make_camera(PointerTo<GraphicsOutput> fbo, char* name, NodePath camera);
+    void _resize();
+};
+
+#endif
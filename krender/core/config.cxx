@@ -1,16 +1,25 @@
+#include "configVariableBool.h"
 #include "dconfig.h"
 
 #include "krender/core/config.h"
+#include "krender/core/cull_bin_krender.h"
 #include "krender/core/lighting_pipeline.h"
+#include "krender/core/occlusion_culler.h"
 #include "krender/core/progress_bar.h"
 #include "krender/core/render_pass.h"
 #include "krender/core/render_pipeline.h"
+#include "krender/core/resolution_controller.h"
+#include "krender/core/transform_history.h"
 #include "krender/core/instance.h"
 
 
 Configure(config_core);
 NotifyCategoryDef(core, "");
 
+ConfigVariableBool krender_state_sort(
+    "krender-state-sort", true,
+    PRC_DESC("Sort opaque geometry by shader, textures, material and depth."));
+
 ConfigureFn(config_core) {
     init_libcore();
 }
@@ -25,6 +34,13 @@ void init_libcore() {
     LightingPipeline::init_type();
     ProgressBar::init_type();
     InstanceNode::init_type();
+    ResolutionController::init_type();
+    CullBinKRender::init_type();
+    OcclusionCuller::init_type();
+    TransformHistory::init_type();
+
+    if (krender_state_sort)
+        CullBinKRender::register_bin();
 
     return;
 }
@@ -0,0 +1,144 @@
+#include <algorithm>
+
+#include "boundingVolume.h"
+#include "clockObject.h"
+#include "cullBinManager.h"
+#include "cullHandler.h"
+#include "geometricBoundingVolume.h"
+#include "graphicsStateGuardianBase.h"
+#include "materialAttrib.h"
+#include "pStatTimer.h"
+#include "shaderAttrib.h"
+
+#include "krender/core/cull_bin_krender.h"
+
+
+TypeHandle CullBinKRender::_type_handle;
+int CullBinKRender::_frame = -1;
+unsigned int CullBinKRender::_num_state_changes = 0;
+unsigned int CullBinKRender::_last_num_state_changes = 0;
+
+CullBinKRender::CullBinKRender(
+        const std::string &name, GraphicsStateGuardianBase* gsg,
+        const PStatCollector &draw_region_pcollector):
+        CullBin(name, BT_KRENDER, gsg, draw_region_pcollector) {
+}
+
+CullBinKRender::~CullBinKRender() {
+    for (unsigned int i = 0; i < _objects.size(); i++) {
+        delete _objects[i]._object;
+    }
+}
+
+CullBin* CullBinKRender::make_bin(
+        const std::string &name, GraphicsStateGuardianBase* gsg,
+        const PStatCollector &draw_region_pcollector) {
+    return new CullBinKRender(name, gsg, draw_region_pcollector);
+}
+
+/*
+ * Registers the bin type and makes the default "opaque" bin use it,
+ * objects with transparency still go to the "transparent" bin.
+ */
+void CullBinKRender::register_bin() {
+    CullBinManager* bin_manager = CullBinManager::get_global_ptr();
+    bin_manager->register_bin_type(BT_KRENDER, make_bin);
+
+    int bin_index = bin_manager->find_bin("opaque");
+    if (bin_index >= 0)
+        bin_manager->set_bin_type(bin_index, BT_KRENDER);
+}
+
+/*
+ * Returns the number of shader, texture and material changes
+ * between the consecutive objects of the previous frame.
+ */
+unsigned int CullBinKRender::get_num_state_changes() {
+    return _last_num_state_changes;
+}
+
+void CullBinKRender::add_object(CullableObject* object, Thread* current_thread) {
+    CPT(BoundingVolume) volume = object->_geom->get_bounds();
+    if (volume->is_empty()) {
+        delete object;
+        return;
+    }
+
+    // distance to the camera, same as in CullBinFrontToBack
+    const GeometricBoundingVolume* gbv = volume->as_geometric_bounding_volume();
+    LPoint3 center = gbv->get_approx_center();
+    center = center * object->_internal_transform->get_mat();
+
+    ObjectData data;
+    data._object = object;
+    data._dist = _gsg->compute_distance_to(center);
+
+    const ShaderAttrib* shader_attrib;
+    data._shader = object->_state->get_attrib(shader_attrib) ? shader_attrib->get_shader() : nullptr;
+
+    const TextureAttrib* texture_attrib;
+    data._textures = object->_state->get_attrib(texture_attrib) ? texture_attrib : nullptr;
+
+    const MaterialAttrib* material_attrib;
+    data._material = object->_state->get_attrib(material_attrib) ? material_attrib->get_material() : nullptr;
+
+    _objects.push_back(data);
+}
+
+void CullBinKRender::finish_cull(SceneSetup* scene_setup, Thread* current_thread) {
+    PStatTimer timer(_cull_this_pcollector, current_thread);
+    std::sort(_objects.begin(), _objects.end());
+}
+
+void CullBinKRender::draw(bool force, Thread* current_thread) {
+    PStatTimer timer(_draw_this_pcollector, current_thread);
+
+    int frame = ClockObject::get_global_clock()->get_frame_count();
+    if (frame != _frame) {
+        _frame = frame;
+        _last_num_state_changes = _num_state_changes;
+        _num_state_changes = 0;
+    }
+
+    _num_state_changes += count_state_changes(_objects);
+    for (unsigned int i = 0; i < _objects.size(); i++) {
+        _objects[i]._object->draw(_gsg, force, current_thread);
+    }
+}
+
+/*
+ * Returns the number of shader, texture and material changes
+ * between the consecutive objects.
+ */
+unsigned int CullBinKRender::count_state_changes(const pvector<ObjectData> &objects) {
+    unsigned int num_changes = 0;
+    for (unsigned int i = 1; i < objects.size(); i++) {
+        const ObjectData &prev = objects[i - 1];
+        const ObjectData &cur = objects[i];
+        num_changes += (
+            (prev._shader != cur._shader) +
+            (prev._textures != cur._textures) +
+            (prev._material != cur._material));
+    }
+    return num_changes;
+}
+
+void CullBinKRender::fill_result_graph(CullBin::ResultGraphBuilder &builder) {
+    for (unsigned int i = 0; i < _objects.size(); i++) {
+        builder.add_object(_objects[i]._object);
+    }
+}
+
+/*
+ * Shader, then texture set, then material, then front to back.
+ * Texture attribs are unique, so the same set of textures has the same pointer.
+ */
+bool CullBinKRender::ObjectData::operator < (const ObjectData &other) const {
+    if (_shader != other._shader)
+        return _shader < other._shader;
+    if (_textures != other._textures)
+        return _textures < other._textures;
+    if (_material != other._material)
+        return _material < other._material;
+    return _dist < other._dist;
+}
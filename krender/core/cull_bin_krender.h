@@ -0,0 +1,81 @@
+#ifndef CORE_CULL_BIN_KRENDER_H
+#define CORE_CULL_BIN_KRENDER_H
+
+#include "cullBin.h"
+#include "cullBinEnums.h"
+#include "cullableObject.h"
+#include "material.h"
+#include "pvector.h"
+#include "shader.h"
+#include "textureAttrib.h"
+
+// bin type, which is not used by Panda3D
+#define BT_KRENDER ((CullBinEnums::BinType) 100)
+
+
+/*
+ * Opaque geometry sorted by shader, then texture set, then material,
+ * then front to back.
+ */
+class CullBinKRender: public CullBin {
+public:
+    CullBinKRender(
+        const std::string &name, GraphicsStateGuardianBase* gsg,
+        const PStatCollector &draw_region_pcollector);
+    virtual ~CullBinKRender();
+
+    static CullBin* make_bin(
+        const std::string &name, GraphicsStateGuardianBase* gsg,
+        const PStatCollector &draw_region_pcollector);
+    static void register_bin();
+    static unsigned int get_num_state_changes();
+
+    virtual void add_object(CullableObject* object, Thread* current_thread);
+    virtual void finish_cull(SceneSetup* scene_setup, Thread* current_thread);
+    virtual void draw(bool force, Thread* current_thread);
+
+    class ObjectData {
+    public:
+        CullableObject* _object;
+        const Shader* _shader;
+        const TextureAttrib* _textures;
+        const Material* _material;
+        PN_stdfloat _dist;
+
+        bool operator < (const ObjectData &other) const;
+    };
+
+    static unsigned int count_state_changes(const pvector<ObjectData> &objects);
+
+protected:
+    virtual void fill_result_graph(ResultGraphBuilder &builder);
+
+private:
+    pvector<ObjectData> _objects;
+
+    static int _frame;
+    static unsigned int _num_state_changes;
+    static unsigned int _last_num_state_changes;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        CullBin::init_type();
+        register_type(
+            _type_handle, "CullBinKRender",
+            CullBin::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
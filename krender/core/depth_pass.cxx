@@ -5,11 +5,13 @@ DepthPass::DepthPass(
         char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
         bool has_srgb, bool has_alpha, float sx, float sy, NodePath card):
         RenderPass(name, index, win, cam, has_srgb, has_alpha, sx, sy, card) {
+    _type = DEPTH_PASS;
     _fbo = _make_fbo(win, has_srgb, has_alpha, false, true, 0, _index);
     _make_textures(false, true, 0);
     char* cam_name = (char*) malloc((strlen(name) + strlen("_camera") + 1) * sizeof(char));
     sprintf(cam_name, "%s_camera", name);
     _cam = _make_camera(_fbo, cam_name, cam);
+    free(cam_name);
 }
 
 /*
@@ -23,6 +25,7 @@ NodePath DepthPass::_make_camera(PointerTo<GraphicsOutput> fbo, char* name, Node
     DisplayRegion* dr = fbo->make_display_region();
     dr->set_sort(_index);
     dr->set_camera(cam);
+    _region = dr;
 
     return cam;
 }
@@ -0,0 +1,39 @@
+#include <string.h>
+
+#include "krender/core/dof_pass.h"
+
+
+DofPass::DofPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        bool has_srgb, bool has_alpha, float sx, float sy):
+        CompoundPass(name, index, win, cam, has_srgb, has_alpha, sx, sy) {
+    _type = DOF_PASS;
+
+    PostPass* coc = _make_subpass(
+        "coc", win, cam, has_srgb, has_alpha, sx, sy,
+        Shader::load(
+            Shader::SL_GLSL,
+            Filename("krender/shader/post.vert.glsl"),
+            Filename("krender/shader/dof_coc.frag.glsl")));
+
+    PostPass* gather = _make_subpass(
+        "gather", win, cam, has_srgb, has_alpha, sx, sy,
+        Shader::load(
+            Shader::SL_GLSL,
+            Filename("krender/shader/post.vert.glsl"),
+            Filename("krender/shader/dof_gather.frag.glsl")));
+    gather->get_source_card().set_shader_input("dof_coc", coc->get_texture(0));
+
+    PostPass* composite = _make_subpass(
+        "composite", win, cam, has_srgb, has_alpha, 1, 1,
+        Shader::load(
+            Shader::SL_GLSL,
+            Filename("krender/shader/post.vert.glsl"),
+            Filename("krender/shader/dof_composite.frag.glsl")));
+    composite->get_source_card().set_shader_input("dof_gather", gather->get_texture(0));
+
+    char* tex_name = (char*) malloc((strlen(_name) + strlen("_color") + 1) * sizeof(char));
+    sprintf(tex_name, "%s_color", _name);
+    _finish(tex_name);
+    free(tex_name);
+}
@@ -0,0 +1,19 @@
+#ifndef CORE_DOF_PASS_H
+#define CORE_DOF_PASS_H
+
+#include "krender/core/compound_pass.h"
+
+
+/*
+ * Depth of field, made of the circle of confusion and the blur gather passes
+ * at reduced resolution, and the full resolution bilateral upsample pass.
+ */
+class DofPass: public CompoundPass {
+public:
+    DofPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        bool has_srgb=false, bool has_alpha=false,
+        float sx=0.5, float sy=0.5);
+};
+
+#endif
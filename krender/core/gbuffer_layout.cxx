@@ -0,0 +1,208 @@
+#include <sstream>
+
+#include "krender/core/gbuffer_layout.h"
+
+
+GBufferLayout::GBufferLayout() {
+    _color_format = GBUFFER_SRGB_ALPHA;
+    _emissive_format = GBUFFER_RGBA8;
+    _normal_format = GBUFFER_RGBA8;
+    _selector_format = GBUFFER_RGBA8;
+    _velocity_format = GBUFFER_NONE;
+    _depth_bits = 32;
+}
+
+/*
+ * Color target can't be dropped.
+ */
+void GBufferLayout::set_color_format(unsigned short format) {
+    if (format == GBUFFER_NONE)
+        return;
+    _color_format = format;
+}
+
+unsigned short GBufferLayout::get_color_format() {
+    return _color_format;
+}
+
+/*
+ * Aux targets are 8-bit (GBUFFER_RGBA8), half float (GBUFFER_RGBA16F)
+ * or dropped (GBUFFER_NONE), their attachments can't hold other formats.
+ * The getters return the format the target is created with.
+ */
+void GBufferLayout::set_emissive_format(unsigned short format) {
+    if (format != GBUFFER_NONE && format != GBUFFER_RGBA8 && format != GBUFFER_RGBA16F)
+        return;
+    _emissive_format = format;
+}
+
+unsigned short GBufferLayout::get_emissive_format() {
+    return _get_aux_format(_emissive_format);
+}
+
+void GBufferLayout::set_normal_format(unsigned short format) {
+    if (format != GBUFFER_NONE && format != GBUFFER_RGBA8 && format != GBUFFER_RGBA16F)
+        return;
+    _normal_format = format;
+}
+
+unsigned short GBufferLayout::get_normal_format() {
+    return _get_aux_format(_normal_format);
+}
+
+void GBufferLayout::set_selector_format(unsigned short format) {
+    if (format != GBUFFER_NONE && format != GBUFFER_RGBA8 && format != GBUFFER_RGBA16F)
+        return;
+    _selector_format = format;
+}
+
+unsigned short GBufferLayout::get_selector_format() {
+    return _get_aux_format(_selector_format);
+}
+
+/*
+ * Screen-space motion of the pixels since the previous frame,
+ * signed sub-pixel values need a half float target.
+ */
+void GBufferLayout::set_velocity_format(unsigned short format) {
+    if (format != GBUFFER_NONE && format != GBUFFER_RGBA16F)
+        return;
+    _velocity_format = format;
+}
+
+unsigned short GBufferLayout::get_velocity_format() {
+    return _velocity_format;
+}
+
+/*
+ * Supported depth sizes are 16, 24 and 32 (float) bits.
+ */
+void GBufferLayout::set_depth_bits(unsigned short bits) {
+    if (bits != 16 && bits != 24 && bits != 32)
+        return;
+    _depth_bits = bits;
+}
+
+unsigned short GBufferLayout::get_depth_bits() {
+    return _depth_bits;
+}
+
+unsigned short GBufferLayout::get_num_aux_textures() {
+    return (
+        (_emissive_format != GBUFFER_NONE) +
+        (_normal_format != GBUFFER_NONE) +
+        (_selector_format != GBUFFER_NONE) +
+        (_velocity_format != GBUFFER_NONE));
+}
+
+/*
+ * Returns GLSL defines for the G-buffer include of a pipeline.
+ * They are guarded, so the include of the pipeline, which comes first
+ * in its shaders, wins over the default one of base.inc.frag.glsl.
+ */
+std::string GBufferLayout::get_defines() {
+    std::ostringstream defines;
+    defines << "#ifndef GBUFFER_LAYOUT\n";
+    defines << "#define GBUFFER_LAYOUT 1\n";
+    defines << "#define GBUFFER_NONE " << GBUFFER_NONE << "\n";
+    defines << "#define GBUFFER_SRGB_ALPHA " << GBUFFER_SRGB_ALPHA << "\n";
+    defines << "#define GBUFFER_RGBA8 " << GBUFFER_RGBA8 << "\n";
+    defines << "#define GBUFFER_R11G11B10F " << GBUFFER_R11G11B10F << "\n";
+    defines << "#define GBUFFER_RGBA16F " << GBUFFER_RGBA16F << "\n";
+    defines << "#define GBUFFER_COLOR_FORMAT " << _color_format << "\n";
+    defines << "#define GBUFFER_EMISSIVE_FORMAT " << get_emissive_format() << "\n";
+    defines << "#define GBUFFER_NORMAL_FORMAT " << get_normal_format() << "\n";
+    defines << "#define GBUFFER_SELECTOR_FORMAT " << get_selector_format() << "\n";
+    defines << "#define GBUFFER_VELOCITY_FORMAT " << get_velocity_format() << "\n";
+    defines << "#define GBUFFER_DEPTH_BITS " << _depth_bits << "\n";
+    defines << "#endif\n";
+    return defines.str();
+}
+
+/*
+ * Makes FBO properties for the scene pass.
+ * All aux targets use the same kind of FBO attachment,
+ * so the order of shader outputs doesn't depend on the formats.
+ * Half float aux attachments are always RGBA16F, the 8-bit ones
+ * take the format of the color attachment.
+ */
+FrameBufferProperties* GBufferLayout::make_fb_properties(bool has_srgb) {
+    FrameBufferProperties* fbp = new FrameBufferProperties();
+
+    if (is_hdr_format(_color_format)) {
+        fbp->set_float_color(true);
+        if (_color_format == GBUFFER_R11G11B10F)
+            fbp->set_rgba_bits(11, 11, 10, 0);
+        else
+            fbp->set_rgba_bits(16, 16, 16, 16);
+    } else {
+        fbp->set_rgba_bits(1, 1, 1, 1);
+        if (has_srgb && _color_format == GBUFFER_SRGB_ALPHA)
+            fbp->set_srgb_color(true);
+    }
+
+    fbp->set_depth_bits(_depth_bits);
+    if (_depth_bits == 32)
+        fbp->set_float_depth(true);
+
+    if (has_hdr_aux())
+        fbp->set_aux_hrgba(get_num_aux_textures());
+    else
+        fbp->set_aux_rgba(get_num_aux_textures());
+
+    return fbp;
+}
+
+Texture::Format GBufferLayout::get_depth_texture_format() {
+    switch (_depth_bits) {
+    case 16:
+        return Texture::F_depth_component16;
+    case 24:
+        return Texture::F_depth_component24;
+    default:
+        return Texture::F_depth_component;
+    }
+}
+
+Texture::Format GBufferLayout::get_texture_format(unsigned short format) {
+    switch (format) {
+    case GBUFFER_RGBA8:
+        return Texture::F_rgba8;
+    case GBUFFER_R11G11B10F:
+        return Texture::F_r11_g11_b10;
+    case GBUFFER_RGBA16F:
+        return Texture::F_rgba16;
+    default:
+        return Texture::F_srgb_alpha;
+    }
+}
+
+/*
+ * Returns true for the formats, which need a half float attachment.
+ */
+bool GBufferLayout::is_hdr_format(unsigned short format) {
+    return format == GBUFFER_R11G11B10F || format == GBUFFER_RGBA16F;
+}
+
+/*
+ * Returns true if the aux targets use half float attachments.
+ * 8-bit aux attachments of an HDR color attachment would be HDR as well,
+ * so they are half float too, which keeps their alpha.
+ */
+bool GBufferLayout::has_hdr_aux() {
+    return (
+        is_hdr_format(_color_format) ||
+        is_hdr_format(_emissive_format) ||
+        is_hdr_format(_normal_format) ||
+        is_hdr_format(_selector_format) ||
+        is_hdr_format(_velocity_format));
+}
+
+/*
+ * Returns the format an aux target is created with.
+ */
+unsigned short GBufferLayout::_get_aux_format(unsigned short format) {
+    if (format == GBUFFER_NONE)
+        return GBUFFER_NONE;
+    return has_hdr_aux() ? GBUFFER_RGBA16F : GBUFFER_RGBA8;
+}
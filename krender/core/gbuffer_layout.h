@@ -0,0 +1,67 @@
+#ifndef CORE_GBUFFER_LAYOUT_H
+#define CORE_GBUFFER_LAYOUT_H
+
+#include <string>
+
+#include "frameBufferProperties.h"
+#include "pandabase.h"
+#include "texture.h"
+
+#define GBUFFER_INC_GLSL ".krender_gbuffer.inc.glsl"  // default layout
+#define GBUFFER_INC_PREFIX ".krender_gbuffer_"  // layouts of the pipelines
+
+BEGIN_PUBLISH
+enum GBufferFormat {
+    GBUFFER_NONE = 0,  // target is not created
+    GBUFFER_SRGB_ALPHA = 1,
+    GBUFFER_RGBA8 = 2,
+    GBUFFER_R11G11B10F = 3,
+    GBUFFER_RGBA16F = 4
+};
+END_PUBLISH
+
+
+/*
+ * Formats of the targets of the scene passes.
+ * Defaults match the original layout: sRGB color, 8-bit aux targets
+ * and 32-bit float depth, the velocity target is not created.
+ * All aux targets share one kind of FBO attachment, which decides their format,
+ * so they are all promoted to half float, when one of them or the color is HDR.
+ */
+class EXPORT_CLASS GBufferLayout {
+PUBLISHED:
+    GBufferLayout();
+    void set_color_format(unsigned short format);
+    unsigned short get_color_format();
+    void set_emissive_format(unsigned short format);
+    unsigned short get_emissive_format();
+    void set_normal_format(unsigned short format);
+    unsigned short get_normal_format();
+    void set_selector_format(unsigned short format);
+    unsigned short get_selector_format();
+    void set_velocity_format(unsigned short format);
+    unsigned short get_velocity_format();
+    void set_depth_bits(unsigned short bits);
+    unsigned short get_depth_bits();
+    unsigned short get_num_aux_textures();
+    std::string get_defines();
+
+public:
+    FrameBufferProperties* make_fb_properties(bool has_srgb);
+    Texture::Format get_depth_texture_format();
+    static Texture::Format get_texture_format(unsigned short format);
+    static bool is_hdr_format(unsigned short format);
+    bool has_hdr_aux();
+
+private:
+    unsigned short _get_aux_format(unsigned short format);
+
+    unsigned short _color_format;
+    unsigned short _emissive_format;
+    unsigned short _normal_format;
+    unsigned short _selector_format;
+    unsigned short _velocity_format;
+    unsigned short _depth_bits;
+};
+
+#endif
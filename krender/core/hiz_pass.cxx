@@ -0,0 +1,107 @@
+#include <string.h>
+
+#include "frameBufferProperties.h"
+
+#include "krender/core/hiz_pass.h"
+
+
+HiZPass::HiZPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        PointerTo<Texture> source, unsigned int num_levels, float sx, float sy):
+        CompoundPass(name, index, win, cam, false, false, sx, sy) {
+    _type = HIZ_PASS;
+    _source = source;
+    _readback_view_proj = LMatrix4::ident_mat();
+    _readback_requested = false;
+    if (num_levels < 1)
+        num_levels = 1;
+
+    Shader* shader = Shader::load(
+        Shader::SL_GLSL,
+        Filename("krender/shader/post.vert.glsl"),
+        Filename("krender/shader/hiz.frag.glsl"));
+
+    // single float channel, depth doesn't fit into 8 bits
+    FrameBufferProperties* fbp = new FrameBufferProperties();
+    fbp->set_rgba_bits(32, 0, 0, 0);
+    fbp->set_float_color(true);
+
+    char suffix[32];
+
+    // each level is half the size of the previous one
+    PointerTo<Texture> level_tex = source;
+    for (unsigned int i = 0; i < num_levels; i++) {
+        float level_scale = 1.0 / (1 << i);
+        sprintf(suffix, "level%u", i);
+        PostPass* subpass = _make_subpass(
+            suffix, win, cam, fbp, Texture::F_r32,
+            sx * level_scale, sy * level_scale, shader);
+        subpass->get_source_card().set_shader_input("source_tex", level_tex);
+
+        // texels are fetched, never filtered
+        level_tex = subpass->get_texture(0);
+        level_tex->set_magfilter(SamplerState::FilterType::FT_nearest);
+        level_tex->set_minfilter(SamplerState::FilterType::FT_nearest);
+    }
+    delete fbp;
+
+    // copied only when requested, see request_readback
+    char* readback_name = (char*) malloc((strlen(_name) + strlen("_readback") + 1) * sizeof(char));
+    sprintf(readback_name, "%s_readback", _name);
+    _readback = new Texture(readback_name);
+    free(readback_name);
+    _readback->set_format(Texture::F_r32);
+    _subpasses.back()->get_fbo()->add_render_texture(
+        _readback, GraphicsOutput::RTM_triggered_copy_ram, GraphicsOutput::RTP_color);
+
+    char* tex_name = (char*) malloc((strlen(_name) + strlen("_depth") + 1) * sizeof(char));
+    sprintf(tex_name, "%s_depth", _name);
+    _finish(tex_name);
+    free(tex_name);
+}
+
+PointerTo<Texture> HiZPass::get_source() {
+    return _source;
+}
+
+unsigned int HiZPass::get_num_levels() {
+    return _subpasses.size();
+}
+
+PointerTo<Texture> HiZPass::get_level(unsigned int i) {
+    return _subpasses[i]->get_texture(0);
+}
+
+/*
+ * Copies the coarsest level to RAM after it is rendered in this frame,
+ * the view projection matrix is kept to test bounds against it later.
+ */
+void HiZPass::request_readback(const LMatrix4 &view_proj_mat) {
+    _subpasses.back()->get_fbo()->trigger_copy();
+    _readback_view_proj = view_proj_mat;
+    _readback_requested = true;
+}
+
+/*
+ * Returns true if the requested copy has arrived.
+ */
+bool HiZPass::has_readback() {
+    return _readback_requested && _readback->has_ram_image();
+}
+
+PointerTo<Texture> HiZPass::get_readback() {
+    return _readback;
+}
+
+LMatrix4 HiZPass::get_readback_view_proj() {
+    return _readback_view_proj;
+}
+
+/*
+ * Drops the consumed copy, so a frame which wasn't rendered
+ * is not mistaken for a new one.
+ */
+void HiZPass::clear_readback() {
+    _readback->clear_ram_image();
+    _readback_requested = false;
+}
@@ -0,0 +1,36 @@
+#ifndef CORE_HIZ_PASS_H
+#define CORE_HIZ_PASS_H
+
+#include "lmatrix.h"
+
+#include "krender/core/compound_pass.h"
+
+
+/*
+ * Hierarchical depth, made of a chain of the farthest depth
+ * of the source depth texture. The coarsest level is copied to RAM
+ * for the occlusion culling of the next frame.
+ */
+class HiZPass: public CompoundPass {
+public:
+    HiZPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        PointerTo<Texture> source, unsigned int num_levels=4,
+        float sx=0.5, float sy=0.5);
+    PointerTo<Texture> get_source();
+    unsigned int get_num_levels();
+    PointerTo<Texture> get_level(unsigned int i);
+    void request_readback(const LMatrix4 &view_proj_mat);
+    bool has_readback();
+    PointerTo<Texture> get_readback();
+    LMatrix4 get_readback_view_proj();
+    void clear_readback();
+
+private:
+    PointerTo<Texture> _source;
+    PointerTo<Texture> _readback;
+    LMatrix4 _readback_view_proj;
+    bool _readback_requested;
+};
+
+#endif
@@ -1,61 +1,1090 @@
+// defines HAVE_PYTHON, py_panda.h includes Python.h before the std headers
+#include "pandabase.h"
+#ifdef HAVE_PYTHON
+#include "py_panda.h"
+#endif
+
+#include <algorithm>
+#include <functional>
+#include <limits.h>
+#include <sstream>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define INSTANCE_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define INSTANCE_NEON 1
+#endif
+
+#include "camera.h"
+#include "clockObject.h"
+#include "config_putil.h"
+#include "lens.h"
 #include "nodePath.h"
 #include "omniBoundingVolume.h"
+#include "renderState.h"
+#include "shaderAttrib.h"
+#include "virtualFileSystem.h"
 
+#include "krender/core/gbuffer_layout.h"
 #include "krender/core/instance.h"
 
 
 TypeHandle InstanceNode::_type_handle;
 
+// component pointers and strides of the transform composer inputs
+struct ComposeSource {
+    const float* pos[POS_COMPONENTS];
+    const float* quat[QUAT_COMPONENTS];
+    const float* scale[SCALE_COMPONENTS];
+    size_t pos_stride;
+    size_t quat_stride;
+    size_t scale_stride;
+    size_t dst_stride;  // floats between the matrices
+};
+
+// instance matrices and frustum planes of the cull cameras
+struct CullSource {
+    const float* matrices;
+    size_t stride;  // floats between the matrices
+    float center[3];
+    float radius2;
+    const float* planes;
+    unsigned int num_planes;
+};
+
+// instance centers, camera and distances of the LOD sorting
+struct LODSource {
+    float* data;  // crossfades are written to the lod channel
+    size_t stride;  // floats between the instances
+    float center[3];
+    float camera[3];
+    const float* distances2;  // squared, increasing
+    unsigned int num_lods;
+    int fade_offset;  // floats of the lod channel in the instance, -1 without crossfades
+    float time;
+    float fade;  // duration of the crossfades
+    unsigned char* lods;  // per instance, LOD of the last sort
+};
+
+
+#if defined(INSTANCE_SSE)
+typedef __m128 vfloat;
+
+static inline vfloat v_load(const float* p, size_t stride) {
+    if (stride == 1)
+        return _mm_loadu_ps(p);
+    return _mm_set_ps(p[stride * 3], p[stride * 2], p[stride], p[0]);
+}
+
+static inline vfloat v_set(float f) {
+    return _mm_set1_ps(f);
+}
+
+static inline vfloat v_add(vfloat a, vfloat b) {
+    return _mm_add_ps(a, b);
+}
+
+static inline vfloat v_sub(vfloat a, vfloat b) {
+    return _mm_sub_ps(a, b);
+}
+
+static inline vfloat v_mul(vfloat a, vfloat b) {
+    return _mm_mul_ps(a, b);
+}
+
+static inline vfloat v_max(vfloat a, vfloat b) {
+    return _mm_max_ps(a, b);
+}
+
+typedef __m128 vmask;
+
+static inline vmask v_ge(vfloat a, vfloat b) {
+    return _mm_cmpge_ps(a, b);
+}
+
+static inline vmask v_le(vfloat a, vfloat b) {
+    return _mm_cmple_ps(a, b);
+}
+
+static inline vmask v_and(vmask a, vmask b) {
+    return _mm_and_ps(a, b);
+}
+
+static inline vmask v_or(vmask a, vmask b) {
+    return _mm_or_ps(a, b);
+}
+
+static inline vmask v_true() {
+    return _mm_castsi128_ps(_mm_set1_epi32(-1));
+}
+
+static inline vmask v_false() {
+    return _mm_setzero_ps();
+}
+
+static inline int v_bits(vmask m) {
+    return _mm_movemask_ps(m);
+}
+
+/*
+ * Stores the row (a, b, c, d) of 4 matrices which are stride floats apart.
+ */
+static inline void v_store_row(float* dst, size_t stride, vfloat a, vfloat b, vfloat c, vfloat d) {
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    _mm_storeu_ps(dst, a);
+    _mm_storeu_ps(dst + stride, b);
+    _mm_storeu_ps(dst + stride * 2, c);
+    _mm_storeu_ps(dst + stride * 3, d);
+}
+#elif defined(INSTANCE_NEON)
+typedef float32x4_t vfloat;
+
+static inline vfloat v_load(const float* p, size_t stride) {
+    if (stride == 1)
+        return vld1q_f32(p);
+    float lanes[4] = {p[0], p[stride], p[stride * 2], p[stride * 3]};
+    return vld1q_f32(lanes);
+}
+
+static inline vfloat v_set(float f) {
+    return vdupq_n_f32(f);
+}
+
+static inline vfloat v_add(vfloat a, vfloat b) {
+    return vaddq_f32(a, b);
+}
+
+static inline vfloat v_sub(vfloat a, vfloat b) {
+    return vsubq_f32(a, b);
+}
+
+static inline vfloat v_mul(vfloat a, vfloat b) {
+    return vmulq_f32(a, b);
+}
+
+static inline vfloat v_max(vfloat a, vfloat b) {
+    return vmaxq_f32(a, b);
+}
+
+typedef uint32x4_t vmask;
+
+static inline vmask v_ge(vfloat a, vfloat b) {
+    return vcgeq_f32(a, b);
+}
+
+static inline vmask v_le(vfloat a, vfloat b) {
+    return vcleq_f32(a, b);
+}
+
+static inline vmask v_and(vmask a, vmask b) {
+    return vandq_u32(a, b);
+}
+
+static inline vmask v_or(vmask a, vmask b) {
+    return vorrq_u32(a, b);
+}
+
+static inline vmask v_true() {
+    return vdupq_n_u32(0xffffffff);
+}
+
+static inline vmask v_false() {
+    return vdupq_n_u32(0);
+}
+
+static inline int v_bits(vmask m) {
+    return (vgetq_lane_u32(m, 0) & 1) | (vgetq_lane_u32(m, 1) & 2) |
+        (vgetq_lane_u32(m, 2) & 4) | (vgetq_lane_u32(m, 3) & 8);
+}
+
+static inline void v_store_row(float* dst, size_t stride, vfloat a, vfloat b, vfloat c, vfloat d) {
+    float32x4x4_t rows = {{a, b, c, d}};
+    float interleaved[16];
+    vst4q_f32(interleaved, rows);
+    for (int i = 0; i < 4; i++)
+        memcpy(dst + stride * i, interleaved + i * 4, FLOAT_SIZE * 4);
+}
+#endif
+
+/*
+ * Builds the matrices of instances begin..end into dst,
+ * 4 instances at once when SIMD is available.
+ */
+static void compose_range(const ComposeSource &src, float* dst, unsigned int begin, unsigned int end) {
+    const size_t stride = src.dst_stride;
+    unsigned int i = begin;
+
+#if defined(INSTANCE_SSE) || defined(INSTANCE_NEON)
+    vfloat zero = v_set(0), one = v_set(1), two = v_set(2);
+    for (; i + 4 <= end; i += 4) {
+        vfloat w = v_load(src.quat[0] + i * src.quat_stride, src.quat_stride);
+        vfloat x = v_load(src.quat[1] + i * src.quat_stride, src.quat_stride);
+        vfloat y = v_load(src.quat[2] + i * src.quat_stride, src.quat_stride);
+        vfloat z = v_load(src.quat[3] + i * src.quat_stride, src.quat_stride);
+        vfloat sx = v_load(src.scale[0] + i * src.scale_stride, src.scale_stride);
+        vfloat sy = v_load(src.scale[1] + i * src.scale_stride, src.scale_stride);
+        vfloat sz = v_load(src.scale[2] + i * src.scale_stride, src.scale_stride);
+
+        vfloat x2 = v_mul(x, two), y2 = v_mul(y, two), z2 = v_mul(z, two);
+        vfloat xx = v_mul(x, x2), yy = v_mul(y, y2), zz = v_mul(z, z2);
+        vfloat xy = v_mul(x, y2), xz = v_mul(x, z2), yz = v_mul(y, z2);
+        vfloat wx = v_mul(w, x2), wy = v_mul(w, y2), wz = v_mul(w, z2);
+
+        float* m = dst + i * stride;
+        v_store_row(m, stride,
+            v_mul(v_sub(one, v_add(yy, zz)), sx),
+            v_mul(v_add(xy, wz), sx),
+            v_mul(v_sub(xz, wy), sx),
+            zero);
+        v_store_row(m + 4, stride,
+            v_mul(v_sub(xy, wz), sy),
+            v_mul(v_sub(one, v_add(xx, zz)), sy),
+            v_mul(v_add(yz, wx), sy),
+            zero);
+        v_store_row(m + 8, stride,
+            v_mul(v_add(xz, wy), sz),
+            v_mul(v_sub(yz, wx), sz),
+            v_mul(v_sub(one, v_add(xx, yy)), sz),
+            zero);
+        v_store_row(m + 12, stride,
+            v_load(src.pos[0] + i * src.pos_stride, src.pos_stride),
+            v_load(src.pos[1] + i * src.pos_stride, src.pos_stride),
+            v_load(src.pos[2] + i * src.pos_stride, src.pos_stride),
+            one);
+    }
+#endif
+
+    // scalar fallback and the remainder
+    for (; i < end; i++) {
+        float w = src.quat[0][i * src.quat_stride];
+        float x = src.quat[1][i * src.quat_stride];
+        float y = src.quat[2][i * src.quat_stride];
+        float z = src.quat[3][i * src.quat_stride];
+        float sx = src.scale[0][i * src.scale_stride];
+        float sy = src.scale[1][i * src.scale_stride];
+        float sz = src.scale[2][i * src.scale_stride];
+
+        float* m = dst + i * stride;
+        m[0] = (1 - 2 * (y * y + z * z)) * sx;
+        m[1] = 2 * (x * y + w * z) * sx;
+        m[2] = 2 * (x * z - w * y) * sx;
+        m[3] = 0;
+        m[4] = 2 * (x * y - w * z) * sy;
+        m[5] = (1 - 2 * (x * x + z * z)) * sy;
+        m[6] = 2 * (y * z + w * x) * sy;
+        m[7] = 0;
+        m[8] = 2 * (x * z + w * y) * sz;
+        m[9] = 2 * (y * z - w * x) * sz;
+        m[10] = (1 - 2 * (x * x + y * y)) * sz;
+        m[11] = 0;
+        m[12] = src.pos[0][i * src.pos_stride];
+        m[13] = src.pos[1][i * src.pos_stride];
+        m[14] = src.pos[2][i * src.pos_stride];
+        m[15] = 1;
+    }
+}
+
+/*
+ * Tests the bounding spheres of instances begin..end against the planes,
+ * an instance is visible if it is inside of all planes of any camera.
+ * Writes the ids of the visible instances to dst and returns their count.
+ */
+static unsigned int cull_range(const CullSource &src, int* dst, unsigned int begin, unsigned int end) {
+    const size_t stride = src.stride;
+    const unsigned int num_cameras = src.num_planes / FRUSTUM_PLANES;
+    unsigned int count = 0;
+    unsigned int i = begin;
+
+#if defined(INSTANCE_SSE) || defined(INSTANCE_NEON)
+    vfloat zero = v_set(0);
+    vfloat cx = v_set(src.center[0]), cy = v_set(src.center[1]), cz = v_set(src.center[2]);
+    for (; i + 4 <= end; i += 4) {
+        const float* m = src.matrices + i * stride;
+        vfloat m00 = v_load(m + 0, stride), m01 = v_load(m + 1, stride), m02 = v_load(m + 2, stride);
+        vfloat m10 = v_load(m + 4, stride), m11 = v_load(m + 5, stride), m12 = v_load(m + 6, stride);
+        vfloat m20 = v_load(m + 8, stride), m21 = v_load(m + 9, stride), m22 = v_load(m + 10, stride);
+
+        // center and squared radius of the transformed sphere
+        vfloat x = v_add(v_add(v_add(v_mul(cx, m00), v_mul(cy, m10)), v_mul(cz, m20)), v_load(m + 12, stride));
+        vfloat y = v_add(v_add(v_add(v_mul(cx, m01), v_mul(cy, m11)), v_mul(cz, m21)), v_load(m + 13, stride));
+        vfloat z = v_add(v_add(v_add(v_mul(cx, m02), v_mul(cy, m12)), v_mul(cz, m22)), v_load(m + 14, stride));
+        vfloat scale2 = v_max(
+            v_max(v_add(v_add(v_mul(m00, m00), v_mul(m01, m01)), v_mul(m02, m02)),
+                  v_add(v_add(v_mul(m10, m10), v_mul(m11, m11)), v_mul(m12, m12))),
+            v_add(v_add(v_mul(m20, m20), v_mul(m21, m21)), v_mul(m22, m22)));
+        vfloat r2 = v_mul(scale2, v_set(src.radius2));
+
+        vmask visible = v_false();
+        for (unsigned int c = 0; c < num_cameras; c++) {
+            vmask inside = v_true();
+            for (unsigned int p = 0; p < FRUSTUM_PLANES; p++) {
+                const float* plane = src.planes + (c * FRUSTUM_PLANES + p) * 4;
+                vfloat d = v_add(v_add(v_add(
+                    v_mul(x, v_set(plane[0])), v_mul(y, v_set(plane[1]))),
+                    v_mul(z, v_set(plane[2]))), v_set(plane[3]));
+                // in front of the plane or closer than the radius
+                inside = v_and(inside, v_or(v_ge(d, zero), v_le(v_mul(d, d), r2)));
+            }
+            visible = v_or(visible, inside);
+        }
+
+        int bits = v_bits(visible);
+        for (int j = 0; j < 4; j++) {
+            if (bits & (1 << j))
+                dst[count++] = i + j;
+        }
+    }
+#endif
+
+    // scalar fallback and the remainder
+    for (; i < end; i++) {
+        const float* m = src.matrices + i * stride;
+        float x = src.center[0] * m[0] + src.center[1] * m[4] + src.center[2] * m[8] + m[12];
+        float y = src.center[0] * m[1] + src.center[1] * m[5] + src.center[2] * m[9] + m[13];
+        float z = src.center[0] * m[2] + src.center[1] * m[6] + src.center[2] * m[10] + m[14];
+        float scale2 = std::max(std::max(
+            m[0] * m[0] + m[1] * m[1] + m[2] * m[2],
+            m[4] * m[4] + m[5] * m[5] + m[6] * m[6]),
+            m[8] * m[8] + m[9] * m[9] + m[10] * m[10]);
+        float r2 = scale2 * src.radius2;
+
+        bool visible = false;
+        for (unsigned int c = 0; c < num_cameras && !visible; c++) {
+            bool inside = true;
+            for (unsigned int p = 0; p < FRUSTUM_PLANES && inside; p++) {
+                const float* plane = src.planes + (c * FRUSTUM_PLANES + p) * 4;
+                float d = x * plane[0] + y * plane[1] + z * plane[2] + plane[3];
+                inside = d >= 0 || d * d <= r2;
+            }
+            visible = inside;
+        }
+        if (visible)
+            dst[count++] = i;
+    }
+
+    return count;
+}
+
+/*
+ * Picks the LODs of the instances ids[begin..end] by their distance to the camera,
+ * writes the LOD and the LOD faded out to codes and counts the instances per LOD.
+ * An instance which changed its LOD is drawn by both LODs during the crossfade.
+ * Returns the range of instance ids with changed lod channels in changed.
+ */
+static void lod_range(
+        const LODSource &src, const int* ids, unsigned char* codes, unsigned int* counts,
+        unsigned int* changed, unsigned int begin, unsigned int end) {
+    for (unsigned int k = begin; k < end; k++) {
+        int id = ids[k];
+        float* m = src.data + id * src.stride;
+        float x = src.center[0] * m[0] + src.center[1] * m[4] + src.center[2] * m[8] + m[12] - src.camera[0];
+        float y = src.center[0] * m[1] + src.center[1] * m[5] + src.center[2] * m[9] + m[13] - src.camera[1];
+        float z = src.center[0] * m[2] + src.center[1] * m[6] + src.center[2] * m[10] + m[14] - src.camera[2];
+        float d2 = x * x + y * y + z * z;
+
+        unsigned int lod = 0;
+        while (lod < src.num_lods && d2 >= src.distances2[lod])
+            lod++;
+        if (lod == src.num_lods)
+            lod = NO_LOD;
+
+        unsigned int fade_lod = NO_LOD;
+        if (src.fade_offset >= 0) {
+            float* fade = m + src.fade_offset;
+            if (lod != src.lods[id]) {
+                // from the LOD drawn now, also in the middle of a crossfade,
+                // new instances appear without one
+                bool is_new = src.lods[id] == NEW_LOD;
+                fade[0] = is_new ? 0 : src.time;
+                fade[1] = is_new ? lod : src.lods[id];
+                fade[2] = lod;
+                changed[0] = std::min(changed[0], (unsigned int) id);
+                changed[1] = std::max(changed[1], (unsigned int) id + 1);
+            }
+            if (src.time < fade[0] + src.fade && fade[1] != fade[2])
+                fade_lod = (unsigned int) fade[1];
+        }
+        src.lods[id] = lod;
+
+        codes[k * 2] = lod;
+        codes[k * 2 + 1] = fade_lod;
+        if (lod != NO_LOD)
+            counts[lod]++;
+        if (fade_lod != NO_LOD)
+            counts[fade_lod]++;
+    }
+}
+
+/*
+ * Writes the instances ids[begin..end] to the index lists of their LODs,
+ * offsets are advanced past the written entries.
+ */
+static void scatter_range(
+        const int* ids, const unsigned char* codes, unsigned int* offsets, int* dst,
+        unsigned int begin, unsigned int end) {
+    for (unsigned int k = begin; k < end; k++) {
+        for (int j = 0; j < 2; j++) {
+            unsigned int lod = codes[k * 2 + j];
+            if (lod != NO_LOD)
+                dst[offsets[lod]++] = ids[k];
+        }
+    }
+}
+
+/*
+ * Runs job for each batch, in threads if there are more batches.
+ */
+static void run_batches(unsigned int num_batches, const std::function<void(unsigned int)> &job) {
+    if (num_batches == 1) {
+        job(0);
+        return;
+    }
+
+    pvector<std::thread> threads;
+    for (unsigned int i = 0; i < num_batches; i++) {
+        threads.push_back(std::thread(job, i));
+    }
+    for (unsigned int i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
 InstanceNode::InstanceNode(const char* name, unsigned int num_instances): PandaNode(name) {
-    _num_instances = num_instances <= MAX_INSTANCES ? num_instances : MAX_INSTANCES;
+    _num_instances = 0;
+    _capacity = 0;
+    _instance_data = NULL;
+    _instance_prev_data = NULL;
+    _instance_index = NULL;
 
-    _instance_transform = (LMatrix4Array*) malloc(sizeof(LMatrix4Array));
-    _instance_prev_transform = (LMatrix4Array*) malloc(sizeof(LMatrix4Array));
+    _instance_data_tex = new Texture();
+    _instance_prev_data_tex = new Texture();
+    _instance_index_tex = new Texture();
+    _front_data_tex = _instance_data_tex;
+    _front_prev_data_tex = _instance_prev_data_tex;
 
-    _instance_transform_tex = new Texture();
-    _instance_transform_tex->setup_buffer_texture(
-        RGBA_MAT4_SIZE * MAX_INSTANCES, Texture::T_float,
-        Texture::F_rgba32, GeomEnums::UH_static);
+    // built-in channels, matrices are aligned to whole texels
+    _stride = 0;
+    _add_channel("transform", MAT4_SIZE / FLOAT_SIZE);
+    _add_channel("time", 1);
 
-    _instance_prev_transform_tex = new Texture();
-    _instance_prev_transform_tex->setup_buffer_texture(
-        RGBA_MAT4_SIZE * MAX_INSTANCES, Texture::T_float,
-        Texture::F_rgba32, GeomEnums::UH_static);
+    for (unsigned short i = 0; i < NUM_INSTANCE_BUFFERS; i++) {
+        _dirty_begin[i] = UINT_MAX;
+        _dirty_end[i] = 0;
+    }
+    _upload_frame = -1;
+    _is_bound = false;
+    _uploaded_bytes = 0;
+    _total_uploaded_bytes = 0;
+    _num_threads = 0;
 
-    _instance_time_tex = new Texture();
-    _instance_time_tex->setup_buffer_texture(
-        MAX_INSTANCES * FLOAT_SIZE, Texture::T_float,
-        Texture::F_rgba32, GeomEnums::UH_static);
+    _instance_center = LPoint3(0);
+    _instance_radius = 0;
+    _has_instance_bounds = false;
+    _is_index_identity = true;
+    _num_visible = 0;
+    _is_hidden = false;
+    _lod_fade = 0;
 
-    _instance_prev_time_tex = new Texture();
-    _instance_prev_time_tex->setup_buffer_texture(
-        MAX_INSTANCES * FLOAT_SIZE, Texture::T_float,
-        Texture::F_rgba32, GeomEnums::UH_static);
+    set_num_instances(num_instances);
+}
+
+InstanceNode::~InstanceNode() {
+    free(_instance_data);
+    free(_instance_prev_data);
+    free(_instance_index);
 }
 
 void InstanceNode::set_transform(unsigned int instance_id, LMatrix4 mat) {
-    _instance_transform->matrices[instance_id] = mat;
+    _set_matrix(_instance_data, IC_TRANSFORM, instance_id, mat);
 }
 
+LMatrix4 InstanceNode::get_transform(unsigned int instance_id) {
+    return _get_matrix(_instance_data, IC_TRANSFORM, instance_id);
+}
+
+/*
+ * Overrides the transform of the previous frame, e.g. to avoid motion
+ * after a teleport. Without it the previous transform is the one
+ * of the last upload.
+ */
 void InstanceNode::set_prev_transform(unsigned int instance_id, LMatrix4 mat) {
-    _instance_prev_transform->matrices[instance_id] = mat;
+    _set_matrix(_instance_prev_data, IC_TRANSFORM, instance_id, mat);
+    _mark_dirty(IB_PREV_DATA, instance_id, instance_id + 1);
+}
+
+LMatrix4 InstanceNode::get_prev_transform(unsigned int instance_id) {
+    return _get_matrix(_instance_prev_data, IC_TRANSFORM, instance_id);
 }
 
 void InstanceNode::set_time(unsigned int instance_id, float time) {
-    _instance_time[instance_id] = time;
+    nassertv(instance_id < _num_instances);
+    _instance_data[instance_id * _stride + _channels[IC_TIME].offset] = time;
+    _mark_dirty(IB_DATA, instance_id, instance_id + 1);
 }
 
 void InstanceNode::set_prev_time(unsigned int instance_id, float time) {
-    _instance_prev_time[instance_id] = time;
+    nassertv(instance_id < _num_instances);
+    _instance_prev_data[instance_id * _stride + _channels[IC_TIME].offset] = time;
+    _mark_dirty(IB_DATA, instance_id, instance_id + 1);
+    _mark_dirty(IB_PREV_DATA, instance_id, instance_id + 1);
+}
+
+/*
+ * Adds a per-instance channel of 1-4 floats or a matrix of 16 floats,
+ * e.g. color or animation frame. Returns its index for set_channel().
+ * Channels are packed into the texels of the instance data buffer,
+ * the existing data is kept.
+ */
+int InstanceNode::add_channel(const std::string &name, unsigned short num_components) {
+    nassertr(num_components >= 1 && (num_components <= RGBA_CHANNEL_COUNT ||
+             num_components == MAT4_SIZE / FLOAT_SIZE), -1);
+    nassertr(get_channel(name) < 0, -1);
+
+    unsigned int old_stride = _stride;
+    int channel = _add_channel(name, num_components);
+    float** buffers[] = {&_instance_data, &_instance_prev_data};
+    if (_stride != old_stride && _capacity > 0) {
+        // repack into the wider rows
+        for (int b = 0; b < 2; b++) {
+            float* data = (float*) calloc(_capacity * _stride, FLOAT_SIZE);
+            for (unsigned int i = 0; i < _num_instances; i++)
+                memcpy(data + i * _stride, *buffers[b] + i * old_stride, old_stride * FLOAT_SIZE);
+            free(*buffers[b]);
+            *buffers[b] = data;
+        }
+
+        _setup_data_textures();
+        if (_is_bound)
+            _bind(NodePath::any_path(this));
+        for (unsigned int i = 0; i < _bound_paths.size(); i++)
+            _bind(_bound_paths[i]);
+    } else {
+        for (int b = 0; b < 2; b++) {
+            for (unsigned int i = 0; i < _num_instances; i++)
+                memset(*buffers[b] + i * _stride + _channels[channel].offset, 0, num_components * FLOAT_SIZE);
+        }
+        _mark_dirty(IB_DATA, 0, _num_instances);
+        _mark_dirty(IB_PREV_DATA, 0, _num_instances);
+    }
+    return channel;
+}
+
+/*
+ * Returns the index of the channel or -1.
+ */
+int InstanceNode::get_channel(const std::string &name) {
+    for (unsigned int i = 0; i < _channels.size(); i++) {
+        if (_channels[i].name == name)
+            return i;
+    }
+    return -1;
+}
+
+unsigned int InstanceNode::get_num_channels() {
+    return _channels.size();
+}
+
+std::string InstanceNode::get_channel_name(unsigned int channel) {
+    nassertr(channel < _channels.size(), "");
+    return _channels[channel].name;
+}
+
+unsigned short InstanceNode::get_channel_size(unsigned int channel) {
+    nassertr(channel < _channels.size(), 0);
+    return _channels[channel].num_components;
+}
+
+/*
+ * Returns the offset of the channel in floats from the start of the instance.
+ */
+unsigned int InstanceNode::get_channel_offset(unsigned int channel) {
+    nassertr(channel < _channels.size(), 0);
+    return _channels[channel].offset;
+}
+
+/*
+ * Returns the size of one instance in floats, a multiple of a texel.
+ */
+unsigned int InstanceNode::get_stride() {
+    return _stride;
 }
 
+void InstanceNode::set_channel(unsigned int instance_id, unsigned int channel, LVecBase4 value) {
+    nassertv(instance_id < _num_instances && channel < _channels.size());
+    nassertv(_channels[channel].num_components <= RGBA_CHANNEL_COUNT);
+
+    float* dst = _instance_data + instance_id * _stride + _channels[channel].offset;
+    for (unsigned short i = 0; i < _channels[channel].num_components; i++)
+        dst[i] = value[i];
+    _mark_dirty(IB_DATA, instance_id, instance_id + 1);
+}
+
+LVecBase4 InstanceNode::get_channel_value(unsigned int instance_id, unsigned int channel) {
+    LVecBase4 value(0);
+    nassertr(instance_id < _num_instances && channel < _channels.size(), value);
+    nassertr(_channels[channel].num_components <= RGBA_CHANNEL_COUNT, value);
+
+    const float* src = _instance_data + instance_id * _stride + _channels[channel].offset;
+    for (unsigned short i = 0; i < _channels[channel].num_components; i++)
+        value[i] = src[i];
+    return value;
+}
+
+/*
+ * Returns GLSL accessors for the layout of the instance data,
+ * e.g. get_instance_transform(get_instance_id()) or get_instance_color(id),
+ * and get_instance_prev_color(id) for the previous frame.
+ */
+std::string InstanceNode::get_glsl() {
+    static const char* swizzle = "xyzw";
+    static const char* prefixes[] = {"", "prev_"};
+    std::ostringstream glsl;
+    glsl << "#pragma include \"krender/shader/instance.inc.glsl\"\n\n";
+
+    for (unsigned int i = NUM_BUILTIN_CHANNELS; i < _channels.size(); i++) {
+        const Channel &channel = _channels[i];
+        unsigned int texel = channel.offset / RGBA_CHANNEL_COUNT;
+
+        for (int p = 0; p < 2; p++) {
+            std::string tex = std::string("instance_") + prefixes[p] + "data_tex";
+            if (channel.num_components == MAT4_SIZE / FLOAT_SIZE) {
+                glsl << "mat4 get_instance_" << prefixes[p] << channel.name << "(int id) {\n";
+                glsl << "    return get_instance_mat4(" << tex << ", id, " << texel << ");\n";
+            } else {
+                if (channel.num_components == 1)
+                    glsl << "float";
+                else
+                    glsl << "vec" << channel.num_components;
+                glsl << " get_instance_" << prefixes[p] << channel.name << "(int id) {\n";
+                glsl << "    return texelFetch(" << tex << ", id * instance_stride + " << texel << ").";
+                glsl << std::string(swizzle + channel.offset % RGBA_CHANNEL_COUNT, channel.num_components) << ";\n";
+            }
+            glsl << "}\n\n";
+        }
+    }
+
+    if (get_channel("lod") >= 0) {
+        glsl << "uniform float osg_FrameTime;\n";
+        glsl << "uniform float instance_lod_fade;\n\n";
+        glsl << "// positive while fading into the LOD drawn, negative while fading out of it\n";
+        glsl << "float get_instance_lod_fade(int id) {\n";
+        glsl << "    vec3 lod = get_instance_lod(id);\n";
+        glsl << "    float fade = clamp((osg_FrameTime - lod.x) / max(instance_lod_fade, 0.0001), 0.0, 1.0);\n";
+        glsl << "    return int(lod.z) == instance_lod ? fade : fade - 1.0;\n";
+        glsl << "}\n\n";
+    }
+    return glsl.str();
+}
+
+/*
+ * Writes the GLSL accessors to be included by the shaders.
+ */
+void InstanceNode::write_glsl(const std::string &filename) {
+    VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+    if (vfs->exists(filename))
+        vfs->delete_file(filename);
+    vfs->write_file(filename, get_glsl(), false);
+}
+
+/*
+ * Loads the instanced variant of a vertex shader with INSTANCED defined,
+ * e.g. of default.vert.glsl, which reads the model matrix of the instance
+ * from the buffers bound by this node. The variant needs GLSL 1.40.
+ */
+Shader* InstanceNode::load_shader(const Filename &vert_path, const Filename &frag_path) {
+    VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+    Filename path = vert_path;
+    if (!vfs->resolve_filename(path, get_model_path()))
+        return nullptr;
+
+    std::string source = vfs->read_file(path, true);
+    size_t begin = 0;
+    if (source.compare(0, strlen("#version"), "#version") == 0)
+        begin = source.find('\n') + 1;
+
+    std::string variant = std::string(INSTANCED_GLSL_PREFIX) + vert_path.get_basename();
+    if (vfs->exists(variant))
+        vfs->delete_file(variant);
+    vfs->write_file(variant, "#version 140\n#define INSTANCED 1\n" + source.substr(begin), false);
+    return Shader::load(Shader::SL_GLSL, Filename(variant), frag_path);
+}
+
+/*
+ * Copies the transforms of count instances starting at offset,
+ * as 16 floats per instance in the row-major LMatrix4 order.
+ */
+void InstanceNode::set_transforms(const float* data, unsigned int count, unsigned int offset) {
+    set_channel_data(IC_TRANSFORM, data, count, offset);
+}
+
+void InstanceNode::set_prev_transforms(const float* data, unsigned int count, unsigned int offset) {
+    set_prev_channel_data(IC_TRANSFORM, data, count, offset);
+}
+
+void InstanceNode::set_times(const float* data, unsigned int count, unsigned int offset) {
+    set_channel_data(IC_TIME, data, count, offset);
+}
+
+void InstanceNode::set_prev_times(const float* data, unsigned int count, unsigned int offset) {
+    set_prev_channel_data(IC_TIME, data, count, offset);
+}
+
+/*
+ * Copies the values of the channel for count instances starting at offset,
+ * the values are tightly packed in data.
+ */
+void InstanceNode::set_channel_data(unsigned int channel, const float* data, unsigned int count, unsigned int offset) {
+    nassertv(channel < _channels.size());
+    nassertv(offset + count <= _num_instances);
+    _copy_channel_data(_instance_data, channel, data, count, offset);
+    _mark_dirty(IB_DATA, offset, offset + count);
+}
+
+/*
+ * Same as above, but overrides the values of the previous frame.
+ */
+void InstanceNode::set_prev_channel_data(unsigned int channel, const float* data, unsigned int count, unsigned int offset) {
+    nassertv(channel < _channels.size());
+    nassertv(offset + count <= _num_instances);
+
+    _copy_channel_data(_instance_prev_data, channel, data, count, offset);
+    // the current values are restored into the previous buffer at the swap
+    _mark_dirty(IB_DATA, offset, offset + count);
+    _mark_dirty(IB_PREV_DATA, offset, offset + count);
+}
+
+/*
+ * Builds the transforms of count instances starting at offset
+ * from positions (x, y, z), quaternions (r, i, j, k) and scales (x, y, z),
+ * interleaved per instance.
+ * Same as scale_mat(scale) * quat matrix * translate_mat(pos).
+ */
+void InstanceNode::set_transforms(
+        const float* pos, const float* quat, const float* scale,
+        unsigned int count, unsigned int offset) {
+    ComposeSource src;
+    for (int c = 0; c < POS_COMPONENTS; c++)
+        src.pos[c] = pos + c;
+    for (int c = 0; c < QUAT_COMPONENTS; c++)
+        src.quat[c] = quat + c;
+    for (int c = 0; c < SCALE_COMPONENTS; c++)
+        src.scale[c] = scale + c;
+    src.pos_stride = POS_COMPONENTS;
+    src.quat_stride = QUAT_COMPONENTS;
+    src.scale_stride = SCALE_COMPONENTS;
+    _compose(src, count, offset);
+}
+
+/*
+ * Same as above, but each component is a separate array of count floats,
+ * e.g. all x positions followed by all y positions.
+ * This is the fastest layout for the SIMD composer.
+ */
+void InstanceNode::set_transforms_soa(
+        const float* pos, const float* quat, const float* scale,
+        unsigned int count, unsigned int offset) {
+    ComposeSource src;
+    for (int c = 0; c < POS_COMPONENTS; c++)
+        src.pos[c] = pos + c * count;
+    for (int c = 0; c < QUAT_COMPONENTS; c++)
+        src.quat[c] = quat + c * count;
+    for (int c = 0; c < SCALE_COMPONENTS; c++)
+        src.scale[c] = scale + c * count;
+    src.pos_stride = 1;
+    src.quat_stride = 1;
+    src.scale_stride = 1;
+    _compose(src, count, offset);
+}
+
+/*
+ * Sets the number of threads used by the composer, 0 for all cores.
+ */
+void InstanceNode::set_num_threads(unsigned int num_threads) {
+    _num_threads = num_threads;
+}
+
+#ifdef HAVE_PYTHON
+/*
+ * Copies the transforms from a C-contiguous float32 buffer,
+ * e.g. a numpy array of shape (n, 4, 4) or (n, 16).
+ * The GIL is released while copying.
+ */
+void InstanceNode::set_transforms(PyObject* buffer, unsigned int offset) {
+    set_channel_data(IC_TRANSFORM, buffer, offset);
+}
+
+void InstanceNode::set_prev_transforms(PyObject* buffer, unsigned int offset) {
+    set_prev_channel_data(IC_TRANSFORM, buffer, offset);
+}
+
+void InstanceNode::set_times(PyObject* buffer, unsigned int offset) {
+    set_channel_data(IC_TIME, buffer, offset);
+}
+
+void InstanceNode::set_prev_times(PyObject* buffer, unsigned int offset) {
+    set_prev_channel_data(IC_TIME, buffer, offset);
+}
+
+/*
+ * Copies the values of a channel from a float32 buffer of shape (n, size).
+ */
+void InstanceNode::set_channel_data(unsigned int channel, PyObject* buffer, unsigned int offset) {
+    _set_channel_buffer(channel, buffer, offset, false);
+}
+
+void InstanceNode::set_prev_channel_data(unsigned int channel, PyObject* buffer, unsigned int offset) {
+    _set_channel_buffer(channel, buffer, offset, true);
+}
+
+/*
+ * Builds the transforms from float32 buffers of positions (n, 3),
+ * quaternions (n, 4) and scales (n, 3).
+ */
+void InstanceNode::set_transforms(PyObject* pos, PyObject* quat, PyObject* scale, unsigned int offset) {
+    _set_transform_buffers(pos, quat, scale, offset, false);
+}
+
+/*
+ * Builds the transforms from float32 buffers of positions (3, n),
+ * quaternions (4, n) and scales (3, n).
+ */
+void InstanceNode::set_transforms_soa(PyObject* pos, PyObject* quat, PyObject* scale, unsigned int offset) {
+    _set_transform_buffers(pos, quat, scale, offset, true);
+}
+#endif
+
+/*
+ * Adds a camera for the frustum culling, e.g. the main camera.
+ * Instances are drawn if they are inside of the frustum of any camera,
+ * so shadow cameras should be added for the shadows of culled instances.
+ */
+void InstanceNode::add_cull_camera(NodePath camera) {
+    nassertv(camera.node()->is_of_type(Camera::get_class_type()));
+    _cull_cameras.push_back(camera);
+}
+
+/*
+ * Disables the frustum culling, all instances are drawn.
+ */
+void InstanceNode::clear_cull_cameras() {
+    _cull_cameras.clear();
+}
+
+/*
+ * Sets the bounding sphere of one instance in the space of this node.
+ */
+void InstanceNode::set_instance_bounds(LPoint3 center, PN_stdfloat radius) {
+    _instance_center = center;
+    _instance_radius = radius;
+    _has_instance_bounds = true;
+}
+
+/*
+ * Collects the instances inside of the cull camera frustums
+ * into the index buffer and draws only them.
+ * With LODs the instances are sorted into the index lists of their LODs.
+ */
+void InstanceNode::cull() {
+    if (_cull_cameras.empty() && _lods.empty()) {
+        if (!_is_index_identity) {
+            _reset_index(0, _num_instances);
+            _set_instance_count(_num_instances);
+        }
+        return;
+    }
+
+    unsigned int num_visible;
+    if (_lods.empty()) {
+        num_visible = _cull_frustums(_instance_index);
+    } else {
+        _visible_ids.resize(_num_instances);
+        int* ids = _visible_ids.data();
+        if (_cull_cameras.empty()) {
+            for (unsigned int i = 0; i < _num_instances; i++)
+                ids[i] = i;
+            num_visible = _num_instances;
+        } else {
+            num_visible = _cull_frustums(ids);
+        }
+        num_visible = _sort_lods(ids, num_visible);
+    }
+
+    _is_index_identity = false;
+    _mark_dirty(IB_INDEX, 0, num_visible);
+    if (num_visible != _num_visible || (num_visible == 0 && !_is_hidden)) {
+        _num_visible = num_visible;
+        if (_lods.empty())
+            _set_instance_count(num_visible);
+    }
+}
+
+/*
+ * Adds a LOD below this node, which draws the instances closer to the LOD camera
+ * than distance and not closer than the distance of the LOD before.
+ * Instances beyond the last LOD aren't drawn. Returns the index of the LOD.
+ */
+int InstanceNode::add_lod(NodePath np, PN_stdfloat distance) {
+    nassertr(!np.is_empty() && _lods.size() < NEW_LOD, -1);
+    nassertr(_lods.empty() || distance > _lods.back().distance, -1);
+
+    LOD lod;
+    lod.np = np;
+    lod.distance = distance;
+    lod.offset = 0;
+    lod.count = UINT_MAX;
+    _find_finals(np, lod.finals);
+    _lods.push_back(lod);
+    np.set_shader_input("instance_lod", LVecBase4i(_lods.size() - 1, 0, 0, 0));
+    np.set_shader_input("instance_index_offset", LVecBase4i(0, 0, 0, 0));
+    _set_lod_count(_lods.size() - 1, 0, _lods.size() == 1 ? _num_visible : 0);
+    return _lods.size() - 1;
+}
+
+unsigned int InstanceNode::get_num_lods() {
+    return _lods.size();
+}
+
+/*
+ * Returns the number of instances drawn by the LOD,
+ * including the ones fading in or out.
+ */
+unsigned int InstanceNode::get_num_lod_instances(unsigned int lod) {
+    nassertr(lod < _lods.size(), 0);
+    return _lods[lod].count == UINT_MAX ? 0 : _lods[lod].count;
+}
+
+/*
+ * Sets the camera the LOD distances are measured from,
+ * the first cull camera by default.
+ */
+void InstanceNode::set_lod_camera(NodePath camera) {
+    _lod_camera = camera;
+}
+
+/*
+ * Enables crossfades of duration seconds between the LODs, 0 disables them.
+ * The switch time and the LODs are kept in the lod channel,
+ * fragment shaders dither with get_instance_lod_fade() of get_glsl().
+ */
+void InstanceNode::set_lod_fade(PN_stdfloat duration) {
+    _lod_fade = duration;
+    if (duration > 0 && get_channel("lod") < 0) {
+        add_channel("lod", LOD_CHANNEL_SIZE);
+        std::fill(_instance_lods.begin(), _instance_lods.end(), NEW_LOD);
+    }
+    if (_is_bound)
+        NodePath::any_path(this).set_shader_input("instance_lod_fade", LVecBase4(_lod_fade, 0, 0, 0));
+    for (unsigned int i = 0; i < _bound_paths.size(); i++)
+        _bound_paths[i].set_shader_input("instance_lod_fade", LVecBase4(_lod_fade, 0, 0, 0));
+}
+
+/*
+ * Returns the number of instances drawn.
+ */
+unsigned int InstanceNode::get_num_visible() {
+    return _num_visible;
+}
+
+/*
+ * Returns the id of the i-th instance drawn.
+ */
+unsigned int InstanceNode::get_visible_instance(unsigned int i) {
+    nassertr(i < _num_visible, 0);
+    return _instance_index[i];
+}
+
+/*
+ * Changes the number of instances, new instances get
+ * an identity transform and zero time.
+ * The buffers grow by doubling and shrink when less than
+ * a quarter is used, so that resizing every frame is cheap.
+ */
+void InstanceNode::set_num_instances(unsigned int num_instances) {
+    unsigned int old_num_instances = _num_instances;
+
+    if (num_instances > _capacity) {
+        unsigned int capacity = _capacity * 2;
+        if (capacity < num_instances)
+            capacity = num_instances;
+        if (capacity < MIN_INSTANCE_CAPACITY)
+            capacity = MIN_INSTANCE_CAPACITY;
+        _set_capacity(capacity);
+    } else if (num_instances < _capacity / 4 && _capacity > MIN_INSTANCE_CAPACITY) {
+        unsigned int capacity = num_instances * 2;
+        if (capacity < MIN_INSTANCE_CAPACITY)
+            capacity = MIN_INSTANCE_CAPACITY;
+        _set_capacity(capacity);
+    }
+
+    if (num_instances > old_num_instances) {
+        _init_instances(_instance_data, old_num_instances, num_instances);
+        _init_instances(_instance_prev_data, old_num_instances, num_instances);
+    }
+    _num_instances = num_instances;
+    _instance_lods.resize(num_instances, NEW_LOD);
+
+    // culled instances are drawn until the next cull
+    if (!_is_index_identity)
+        _reset_index(0, num_instances);
+    else if (num_instances > old_num_instances)
+        _reset_index(old_num_instances, num_instances);
+    _num_visible = num_instances;
+
+    if (num_instances > old_num_instances) {
+        for (unsigned short i = 0; i < NUM_INSTANCE_BUFFERS; i++)
+            _mark_dirty(i, old_num_instances, num_instances);
+    }
+    for (unsigned short i = 0; i < NUM_INSTANCE_BUFFERS; i++) {
+        if (_dirty_end[i] > num_instances)
+            _dirty_end[i] = num_instances;
+    }
+
+    _set_instance_count(num_instances);
+}
+
+unsigned int InstanceNode::get_num_instances() {
+    return _num_instances;
+}
+
+/*
+ * Returns the number of instances the buffers have room for.
+ */
+unsigned int InstanceNode::get_capacity() {
+    return _capacity;
+}
+
+/*
+ * Sets the instance count of all nodes below this one,
+ * the buffers are bound once to this node and inherited.
+ * The bounding sphere of one instance is computed from the geometry,
+ * unless it was set before.
+ */
 void InstanceNode::setup() {
     NodePath np = NodePath::any_path(this);
+    if (!_has_instance_bounds) {
+        LPoint3 min_point, max_point;
+        if (np.calc_tight_bounds(min_point, max_point)) {
+            _instance_center = (min_point + max_point) * 0.5;
+            _instance_radius = (max_point - min_point).length() * 0.5;
+        }
+    }
+
     NodePathCollection nps = np.find_all_matches("**/**");
     for (int i = 0; i < nps.get_num_paths(); i++) {
         NodePath child_np = nps.get_path(i);
         setup(child_np);
     }
+    // the LODs draw the index buffer from the next cull on
+    _find_finals(np, _finals);
+    for (unsigned int i = 0; i < _lods.size(); i++) {
+        _lods[i].count = UINT_MAX;
+        _find_finals(_lods[i].np, _lods[i].finals);
+    }
+    _bind(np);
+    _setup_shaders(np);
 }
 
 void InstanceNode::setup(NodePath np) {
@@ -64,29 +1093,638 @@ void InstanceNode::setup(NodePath np) {
     np.node()->set_final(true);
 }
 
+/*
+ * Culls and uploads the changed instances, meant to be called once per frame
+ * after all instances were updated.
+ */
 void InstanceNode::update_shader_inputs() {
-    NodePath np = NodePath::any_path(this);
+    cull();
+    upload();
+    if (!_is_bound)
+        _bind(NodePath::any_path(this));
+}
+
+/*
+ * Culls and uploads the changed instances and binds the buffers to the given node,
+ * e.g. a node which isn't below this one.
+ */
+void InstanceNode::update_shader_inputs(NodePath np) {
+    cull();
+    upload();
+    _bind(np);
+}
+
+/*
+ * Copies the changed ranges of the instances into the buffer textures,
+ * at most once per frame. Returns false if already uploaded in this frame.
+ * Panda3D uploads a modified buffer texture to the GPU as a whole,
+ * buffers without changes are not touched, so they aren't uploaded.
+ * Afterwards the current and the previous buffers are swapped,
+ * so the next changes go to the buffer of the frame before.
+ */
+bool InstanceNode::upload() {
+    int frame = ClockObject::get_global_clock()->get_frame_count();
+    if (frame == _upload_frame)
+        return false;
+    _upload_frame = frame;
+
+    // rows changed in the last frame are a frame behind in this texture
+    _uploaded_bytes = 0;
+    _upload_range(
+        _instance_data_tex, (unsigned char*) _instance_data, _stride * FLOAT_SIZE,
+        std::min(_dirty_begin[IB_DATA], _dirty_begin[IB_HISTORY]),
+        std::max(_dirty_end[IB_DATA], _dirty_end[IB_HISTORY]));
+    _upload_range(
+        _instance_prev_data_tex, (unsigned char*) _instance_prev_data, _stride * FLOAT_SIZE,
+        _dirty_begin[IB_PREV_DATA], _dirty_end[IB_PREV_DATA]);
+    _upload_range(
+        _instance_index_tex, (unsigned char*) _instance_index, sizeof(int),
+        _dirty_begin[IB_INDEX], _dirty_end[IB_INDEX]);
+    _dirty_begin[IB_INDEX] = UINT_MAX;
+    _dirty_end[IB_INDEX] = 0;
+    _total_uploaded_bytes += _uploaded_bytes;
+
+    if (_front_data_tex != _instance_data_tex) {
+        _front_data_tex = _instance_data_tex;
+        _front_prev_data_tex = _instance_prev_data_tex;
+        if (_is_bound)
+            _bind_data(NodePath::any_path(this));
+        for (unsigned int i = 0; i < _bound_paths.size(); i++)
+            _bind_data(_bound_paths[i]);
+    }
+    _swap_data();
+    return true;
+}
+
+/*
+ * Returns the number of bytes copied by the last upload.
+ */
+size_t InstanceNode::get_uploaded_bytes() {
+    return _uploaded_bytes;
+}
+
+size_t InstanceNode::get_total_uploaded_bytes() {
+    return _total_uploaded_bytes;
+}
+
+/*
+ * Reallocates the arrays and the buffer textures,
+ * the textures lose their contents, so everything is uploaded again.
+ */
+void InstanceNode::_set_capacity(unsigned int capacity) {
+    _instance_data = (float*) realloc(_instance_data, _stride * FLOAT_SIZE * capacity);
+    _instance_prev_data = (float*) realloc(_instance_prev_data, _stride * FLOAT_SIZE * capacity);
+    // room for the instances drawn by two LODs while fading
+    _instance_index = (int*) realloc(_instance_index, sizeof(int) * capacity * 2);
+    _capacity = capacity;
+
+    _setup_data_textures();
+    _instance_index_tex->setup_buffer_texture(
+        capacity * 2, Texture::T_int,
+        Texture::F_r32i, GeomEnums::UH_dynamic);
+    _dirty_begin[IB_INDEX] = UINT_MAX;
+    _dirty_end[IB_INDEX] = 0;
+    _mark_dirty(IB_INDEX, 0, _num_instances);
+}
+
+/*
+ * Sizes the instance data textures for the capacity and the stride,
+ * one instance takes stride / 4 RGBA texels.
+ */
+void InstanceNode::_setup_data_textures() {
+    _instance_data_tex->setup_buffer_texture(
+        _capacity * _stride / RGBA_CHANNEL_COUNT, Texture::T_float,
+        Texture::F_rgba32, GeomEnums::UH_static);
+    _instance_prev_data_tex->setup_buffer_texture(
+        _capacity * _stride / RGBA_CHANNEL_COUNT, Texture::T_float,
+        Texture::F_rgba32, GeomEnums::UH_static);
+    _dirty_begin[IB_HISTORY] = UINT_MAX;
+    _dirty_end[IB_HISTORY] = 0;
+    _mark_dirty(IB_DATA, 0, _num_instances);
+    _mark_dirty(IB_PREV_DATA, 0, _num_instances);
+}
+
+/*
+ * Appends a channel to the layout without a vec4 crossing a texel,
+ * matrices start at a texel.
+ */
+int InstanceNode::_add_channel(const std::string &name, unsigned short num_components) {
+    unsigned int offset = 0;
+    for (unsigned int i = 0; i < _channels.size(); i++)
+        offset = std::max(offset, _channels[i].offset + _channels[i].num_components);
+
+    unsigned int texel_offset = offset % RGBA_CHANNEL_COUNT;
+    if (texel_offset != 0 && texel_offset + std::min(num_components, (unsigned short) RGBA_CHANNEL_COUNT) > RGBA_CHANNEL_COUNT)
+        offset += RGBA_CHANNEL_COUNT - texel_offset;
+
+    Channel channel;
+    channel.name = name;
+    channel.num_components = num_components;
+    channel.offset = offset;
+    _channels.push_back(channel);
+
+    offset += num_components;
+    _stride = (offset + RGBA_CHANNEL_COUNT - 1) / RGBA_CHANNEL_COUNT * RGBA_CHANNEL_COUNT;
+    return _channels.size() - 1;
+}
+
+void InstanceNode::_set_matrix(float* data, unsigned int channel, unsigned int instance_id, const LMatrix4 &mat) {
+    nassertv(instance_id < _num_instances);
+    float* dst = data + instance_id * _stride + _channels[channel].offset;
+    for (int i = 0; i < MAT4_SIZE / FLOAT_SIZE; i++)
+        dst[i] = mat.get_data()[i];
+    _mark_dirty(IB_DATA, instance_id, instance_id + 1);
+}
+
+LMatrix4 InstanceNode::_get_matrix(const float* data, unsigned int channel, unsigned int instance_id) {
+    nassertr(instance_id < _num_instances, LMatrix4::ident_mat());
+    const float* src = data + instance_id * _stride + _channels[channel].offset;
+    return LMatrix4(
+        src[0], src[1], src[2], src[3],
+        src[4], src[5], src[6], src[7],
+        src[8], src[9], src[10], src[11],
+        src[12], src[13], src[14], src[15]);
+}
+
+void InstanceNode::_copy_channel_data(
+        float* buffer, unsigned int channel,
+        const float* data, unsigned int count, unsigned int offset) {
+    size_t size = _channels[channel].num_components * FLOAT_SIZE;
+    float* dst = buffer + offset * _stride + _channels[channel].offset;
+    if (size == _stride * FLOAT_SIZE) {
+        memcpy(dst, data, count * size);
+    } else {
+        for (unsigned int i = 0; i < count; i++) {
+            memcpy(dst, data, size);
+            dst += _stride;
+            data += _channels[channel].num_components;
+        }
+    }
+}
+
+/*
+ * New instances get an identity transform and zero for everything else.
+ */
+void InstanceNode::_init_instances(float* buffer, unsigned int begin, unsigned int end) {
+    memset(buffer + begin * _stride, 0, (end - begin) * _stride * FLOAT_SIZE);
+    for (unsigned int i = begin; i < end; i++) {
+        for (int j = 0; j < MAT4_WIDTH; j++)
+            buffer[i * _stride + _channels[IC_TRANSFORM].offset + j * (MAT4_WIDTH + 1)] = 1;
+    }
+}
+
+/*
+ * Updates the instance count of the nodes set up below this one,
+ * with LODs the first one draws the index buffer until the next cull.
+ * The nodes are hidden without instances, an instance count of 0
+ * would draw them once without instancing.
+ */
+void InstanceNode::_set_instance_count(unsigned int count) {
+    if (!_lods.empty()) {
+        for (unsigned int i = 0; i < _lods.size(); i++)
+            _set_lod_count(i, 0, i == 0 ? count : 0);
+        return;
+    }
+
+    for (unsigned int i = 0; i < _finals.size(); i++) {
+        NodePath child_np(_finals[i]);
+        if (count == 0) {
+            child_np.hide();
+        } else {
+            if (_is_hidden)
+                child_np.show();
+            child_np.set_instance_count(count);
+        }
+    }
+    _is_hidden = count == 0;
+}
+
+/*
+ * Draws count instances of the LOD starting at offset of the index buffer,
+ * the LOD is hidden without instances.
+ */
+void InstanceNode::_set_lod_count(unsigned int lod, unsigned int offset, unsigned int count) {
+    LOD &l = _lods[lod];
+    if (offset != l.offset) {
+        l.np.set_shader_input("instance_index_offset", LVecBase4i(offset, 0, 0, 0));
+        l.offset = offset;
+    }
+    if (count == l.count)
+        return;
+
+    if (count == 0) {
+        l.np.hide();
+    } else {
+        if (l.count == 0 || l.count == UINT_MAX)
+            l.np.show();
+        l.np.set_instance_count(count);
+        for (unsigned int i = 0; i < l.finals.size(); i++)
+            NodePath(l.finals[i]).set_instance_count(count);
+    }
+    l.count = count;
+}
+
+/*
+ * Collects the final nodes below np, whose instance count follows
+ * the visible instances. Searched once on setup instead of on each count change,
+ * the nodes are kept instead of paths, which would hold a reference to this node.
+ */
+void InstanceNode::_find_finals(NodePath np, pvector<PointerTo<PandaNode>> &finals) {
+    finals.clear();
     NodePathCollection nps = np.find_all_matches("**/**");
     for (int i = 0; i < nps.get_num_paths(); i++) {
-        NodePath child_np = nps.get_path(i);
-        update_shader_inputs(child_np);
+        PandaNode* node = nps.get_path(i).node();
+        if (node->is_final())
+            finals.push_back(node);
     }
 }
 
-void InstanceNode::update_shader_inputs(NodePath np) {
-    PTA_uchar data = _instance_transform_tex->modify_ram_image();
-    memcpy(data.p(), _instance_transform->data, sizeof(_instance_transform->data));
-    np.set_shader_input("instance_transform_tex", _instance_transform_tex);
+/*
+ * Writes the ids of the instances inside of the cull camera frustums to ids,
+ * returns their count.
+ */
+unsigned int InstanceNode::_cull_frustums(int* ids) {
+    // planes in the space of this node, (a, b, c, d) of the row vector matrix
+    NodePath np = NodePath::any_path(this);
+    pvector<float> planes;
+    for (unsigned int i = 0; i < _cull_cameras.size(); i++) {
+        Lens* lens = ((Camera*) _cull_cameras[i].node())->get_lens();
+        LMatrix4 mat = np.get_mat(_cull_cameras[i]) * lens->get_projection_mat();
+        for (int axis = 0; axis < 3; axis++) {
+            for (int side = -1; side <= 1; side += 2) {
+                LVecBase4 plane = mat.get_col(3) + mat.get_col(axis) * side;
+                PN_stdfloat length = plane.get_xyz().length();
+                for (int j = 0; j < 4; j++)
+                    planes.push_back(length > 0 ? plane[j] / length : 0);
+            }
+        }
+    }
+
+    CullSource src;
+    src.matrices = _instance_data + _channels[IC_TRANSFORM].offset;
+    src.stride = _stride;
+    src.center[0] = _instance_center[0];
+    src.center[1] = _instance_center[1];
+    src.center[2] = _instance_center[2];
+    src.radius2 = _instance_radius * _instance_radius;
+    src.planes = &planes[0];
+    src.num_planes = planes.size() / 4;
+
+    // each thread writes its visible ids at the start of its batch,
+    // then the batches are compacted in order
+    unsigned int num_visible;
+    unsigned int num_threads = _num_threads ? _num_threads : std::max(std::thread::hardware_concurrency(), 1u);
+    if (num_threads <= 1 || _num_instances < CULL_BATCH_SIZE * 2) {
+        num_visible = cull_range(src, ids, 0, _num_instances);
+    } else {
+        unsigned int batch = std::max((_num_instances / num_threads + 3) & ~3u, (unsigned int) CULL_BATCH_SIZE);
+        pvector<unsigned int> counts((_num_instances + batch - 1) / batch);
+        pvector<std::thread> threads;
+        for (unsigned int i = 0; i < counts.size(); i++) {
+            unsigned int begin = i * batch;
+            threads.push_back(std::thread([&src, &counts, ids, this, i, begin, batch]() {
+                counts[i] = cull_range(src, ids + begin, begin, std::min(begin + batch, _num_instances));
+            }));
+        }
+        num_visible = 0;
+        for (unsigned int i = 0; i < threads.size(); i++) {
+            threads[i].join();
+            memmove(ids + num_visible, ids + i * batch, counts[i] * sizeof(int));
+            num_visible += counts[i];
+        }
+    }
+
+    return num_visible;
+}
+
+/*
+ * Sorts the visible instances into consecutive index lists of their LODs
+ * by the distance to the LOD camera in the space of this node,
+ * returns the number of the entries. Batches are counted in parallel,
+ * then each one writes its entries to its place in the lists in parallel.
+ */
+unsigned int InstanceNode::_sort_lods(const int* ids, unsigned int count) {
+    NodePath np = NodePath::any_path(this);
+    NodePath camera = _lod_camera;
+    if (camera.is_empty() && !_cull_cameras.empty())
+        camera = _cull_cameras[0];
+    LPoint3 camera_pos = camera.is_empty() ? LPoint3(0) : camera.get_pos(np);
+
+    unsigned int num_lods = _lods.size();
+    pvector<float> distances2;
+    for (unsigned int i = 0; i < num_lods; i++)
+        distances2.push_back(_lods[i].distance * _lods[i].distance);
+
+    int fade_channel = get_channel("lod");
+    LODSource src;
+    src.data = _instance_data;
+    src.stride = _stride;
+    for (int i = 0; i < 3; i++) {
+        src.center[i] = _instance_center[i];
+        src.camera[i] = camera_pos[i];
+    }
+    src.distances2 = distances2.data();
+    src.num_lods = num_lods;
+    src.fade_offset = _lod_fade > 0 && fade_channel >= 0 ? _channels[fade_channel].offset : -1;
+    src.time = ClockObject::get_global_clock()->get_frame_time();
+    src.fade = _lod_fade;
+    src.lods = _instance_lods.data();
+
+    unsigned int batch;
+    unsigned int num_batches = _get_num_batches(count, &batch);
+    pvector<unsigned int> counts(num_batches * num_lods, 0);
+    pvector<unsigned int> changed(num_batches * 2, 0);
+    for (unsigned int i = 0; i < num_batches; i++)
+        changed[i * 2] = UINT_MAX;
+    _lod_codes.resize(count * 2);
+    unsigned char* codes = _lod_codes.data();
+
+    run_batches(num_batches, [&](unsigned int i) {
+        lod_range(
+            src, ids, codes, &counts[i * num_lods], &changed[i * 2],
+            i * batch, std::min(i * batch + batch, count));
+    });
+
+    // LOD lists one after another, the batches in order inside of them,
+    // counts become the offsets of the batches
+    unsigned int num_entries = 0;
+    pvector<unsigned int> lod_offsets(num_lods);
+    for (unsigned int l = 0; l < num_lods; l++) {
+        lod_offsets[l] = num_entries;
+        for (unsigned int i = 0; i < num_batches; i++) {
+            unsigned int lod_count = counts[i * num_lods + l];
+            counts[i * num_lods + l] = num_entries;
+            num_entries += lod_count;
+        }
+    }
+
+    run_batches(num_batches, [&](unsigned int i) {
+        scatter_range(
+            ids, codes, &counts[i * num_lods], _instance_index,
+            i * batch, std::min(i * batch + batch, count));
+    });
+
+    for (unsigned int i = 0; i < num_batches; i++) {
+        if (changed[i * 2] < changed[i * 2 + 1])
+            _mark_dirty(IB_DATA, changed[i * 2], changed[i * 2 + 1]);
+    }
+    for (unsigned int l = 0; l < num_lods; l++) {
+        unsigned int end = l + 1 < num_lods ? lod_offsets[l + 1] : num_entries;
+        _set_lod_count(l, lod_offsets[l], end - lod_offsets[l]);
+    }
+    return num_entries;
+}
+
+/*
+ * Splits count items into batches for the threads, aligned to the SIMD width,
+ * returns the number of the batches.
+ */
+unsigned int InstanceNode::_get_num_batches(unsigned int count, unsigned int* batch) {
+    unsigned int num_threads = _num_threads ? _num_threads : std::max(std::thread::hardware_concurrency(), 1u);
+    if (num_threads <= 1 || count < CULL_BATCH_SIZE * 2) {
+        *batch = count;
+        return 1;
+    }
+    *batch = std::max((count / num_threads + 3) & ~3u, (unsigned int) CULL_BATCH_SIZE);
+    return (count + *batch - 1) / *batch;
+}
+
+/*
+ * Draws the instances in order.
+ */
+void InstanceNode::_reset_index(unsigned int begin, unsigned int end) {
+    for (unsigned int i = begin; i < end; i++)
+        _instance_index[i] = i;
+    _mark_dirty(IB_INDEX, begin, end);
+    _num_visible = _num_instances;
+    _is_index_identity = true;
+}
+
+void InstanceNode::_mark_dirty(unsigned short buffer, unsigned int begin, unsigned int end) {
+    if (begin < _dirty_begin[buffer])
+        _dirty_begin[buffer] = begin;
+    if (end > _dirty_end[buffer])
+        _dirty_end[buffer] = end;
+}
+
+void InstanceNode::_upload_range(
+        PointerTo<Texture> tex, const unsigned char* data,
+        size_t instance_size, unsigned int begin, unsigned int end) {
+    if (begin >= end)
+        return;
+
+    size_t offset = begin * instance_size;
+    size_t size = (end - begin) * instance_size;
+    PTA_uchar image = tex->modify_ram_image();
+    memcpy(image.p() + offset, data + offset, size);
+    _uploaded_bytes += size;
+}
+
+/*
+ * Makes the uploaded buffer the previous one by swapping the pointers.
+ * The other buffer only misses the rows changed in this frame,
+ * they are copied over and its texture gets them with the next upload.
+ */
+void InstanceNode::_swap_data() {
+    unsigned int begin = _dirty_begin[IB_DATA];
+    unsigned int end = _dirty_end[IB_DATA];
+    for (unsigned short i = 0; i < NUM_INSTANCE_BUFFERS; i++) {
+        if (i != IB_INDEX) {
+            _dirty_begin[i] = UINT_MAX;
+            _dirty_end[i] = 0;
+        }
+    }
+    // both buffers are the same without changes
+    if (begin >= end)
+        return;
 
-    data = _instance_prev_transform_tex->modify_ram_image();
-    memcpy(data.p(), _instance_prev_transform->data, sizeof(_instance_prev_transform->data));
-    np.set_shader_input("instance_prev_transform_tex", _instance_prev_transform_tex);
+    memcpy(_instance_prev_data + begin * _stride, _instance_data + begin * _stride,
+           (end - begin) * _stride * FLOAT_SIZE);
+    std::swap(_instance_data, _instance_prev_data);
+    std::swap(_instance_data_tex, _instance_prev_data_tex);
+    _mark_dirty(IB_HISTORY, begin, end);
+}
+
+/*
+ * Builds the matrices of count instances starting at offset,
+ * large batches are split between threads.
+ */
+void InstanceNode::_compose(const ComposeSource &src, unsigned int count, unsigned int offset) {
+    nassertv(offset + count <= _num_instances);
+    float* dst = _instance_data + offset * _stride + _channels[IC_TRANSFORM].offset;
+    ComposeSource compose_src = src;
+    compose_src.dst_stride = _stride;
+
+    unsigned int num_threads = _num_threads ? _num_threads : std::max(std::thread::hardware_concurrency(), 1u);
+    if (num_threads <= 1 || count < COMPOSE_BATCH_SIZE * 2) {
+        compose_range(compose_src, dst, 0, count);
+    } else {
+        // batches are aligned to the SIMD width
+        unsigned int batch = std::max((count / num_threads + 3) & ~3u, (unsigned int) COMPOSE_BATCH_SIZE);
+        pvector<std::thread> threads;
+        for (unsigned int begin = 0; begin < count; begin += batch) {
+            threads.push_back(std::thread(
+                compose_range, std::cref(compose_src), dst, begin, std::min(begin + batch, count)));
+        }
+        for (unsigned int i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+    }
+
+    _mark_dirty(IB_DATA, offset, offset + count);
+}
 
-    data = _instance_time_tex->modify_ram_image();
-    memcpy(data.p(), _instance_time, sizeof(_instance_time));
-    np.set_shader_input("instance_time_tex", _instance_time_tex);
+#ifdef HAVE_PYTHON
+/*
+ * Copies the values of a channel from a Python buffer
+ * into the current or the previous frame.
+ */
+void InstanceNode::_set_channel_buffer(unsigned int channel, PyObject* buffer, unsigned int offset, bool prev) {
+    if (channel >= _channels.size()) {
+        PyErr_SetString(PyExc_IndexError, "channel out of range");
+        return;
+    }
+
+    Py_buffer view;
+    unsigned int count;
+    if (!_get_buffer(buffer, &view, _channels[channel].num_components, &count))
+        return;
+
+    if (offset + count > _num_instances) {
+        PyErr_SetString(PyExc_IndexError, "instance range out of bounds");
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        if (prev)
+            set_prev_channel_data(channel, (const float*) view.buf, count, offset);
+        else
+            set_channel_data(channel, (const float*) view.buf, count, offset);
+        Py_END_ALLOW_THREADS
+    }
+    PyBuffer_Release(&view);
+}
+
+/*
+ * Gets a C-contiguous float32 view of obj,
+ * sets a Python exception and returns false if it isn't one.
+ */
+bool InstanceNode::_get_buffer(PyObject* obj, Py_buffer* view, size_t components, unsigned int* count) {
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0)
+        return false;
+
+    if (view->itemsize != FLOAT_SIZE || view->format == NULL ||
+            (strcmp(view->format, "f") != 0 && strcmp(view->format, "<f") != 0 &&
+             strcmp(view->format, "=f") != 0)) {
+        PyErr_SetString(PyExc_TypeError, "expected a float32 buffer");
+        PyBuffer_Release(view);
+        return false;
+    }
+    if (view->len % (components * FLOAT_SIZE) != 0) {
+        PyErr_Format(PyExc_ValueError, "buffer size is not a multiple of %d floats", (int) components);
+        PyBuffer_Release(view);
+        return false;
+    }
+
+    *count = (unsigned int) (view->len / (components * FLOAT_SIZE));
+    return true;
+}
+
+/*
+ * Builds the transforms from position, quaternion and scale buffers,
+ * interleaved per instance or one array per component.
+ */
+void InstanceNode::_set_transform_buffers(
+        PyObject* pos, PyObject* quat, PyObject* scale,
+        unsigned int offset, bool soa) {
+    Py_buffer pos_view, quat_view, scale_view;
+    unsigned int count, quat_count, scale_count;
+
+    if (!_get_buffer(pos, &pos_view, POS_COMPONENTS, &count))
+        return;
+    if (!_get_buffer(quat, &quat_view, QUAT_COMPONENTS, &quat_count)) {
+        PyBuffer_Release(&pos_view);
+        return;
+    }
+    if (!_get_buffer(scale, &scale_view, SCALE_COMPONENTS, &scale_count)) {
+        PyBuffer_Release(&pos_view);
+        PyBuffer_Release(&quat_view);
+        return;
+    }
+
+    if (quat_count != count || scale_count != count) {
+        PyErr_SetString(PyExc_ValueError, "pos, quat and scale have different lengths");
+    } else if (offset + count > _num_instances) {
+        PyErr_SetString(PyExc_IndexError, "instance range out of bounds");
+    } else {
+        const float* p = (const float*) pos_view.buf;
+        const float* q = (const float*) quat_view.buf;
+        const float* s = (const float*) scale_view.buf;
+        Py_BEGIN_ALLOW_THREADS
+        if (soa)
+            set_transforms_soa(p, q, s, count, offset);
+        else
+            set_transforms(p, q, s, count, offset);
+        Py_END_ALLOW_THREADS
+    }
+
+    PyBuffer_Release(&pos_view);
+    PyBuffer_Release(&quat_view);
+    PyBuffer_Release(&scale_view);
+}
+#endif
+
+/*
+ * Switches a bundled shader inherited by this node to its instanced variant
+ * with the same priority, so setup() is called after the scene shader is set.
+ * Shadow and depth prepass cameras pick their variants by the tag.
+ */
+void InstanceNode::_setup_shaders(NodePath np) {
+    static const char* bundled[] = {
+        "krender/shader/default.vert.glsl",
+        "krender/shader/depth.vert.glsl",
+        "krender/shader/shadow.vert.glsl"};
+    np.set_tag(INSTANCE_TAG, INSTANCE_TAG_STATE);
+
+    CPT(RenderState) state = np.get_net_state();
+    const ShaderAttrib* attrib = (const ShaderAttrib*) state->get_attrib(ShaderAttrib::get_class_slot());
+    if (attrib == nullptr || attrib->get_shader() == nullptr)
+        return;
+
+    const Shader* shader = attrib->get_shader();
+    std::string vert_path = shader->get_filename(Shader::ST_vertex).get_fullpath();
+    for (int i = 0; i < 3; i++) {
+        // also the variants of RenderPipeline::load_shader()
+        std::string suffix = "." + Filename(bundled[i]).get_basename();
+        bool is_variant = (
+            vert_path.compare(0, strlen(GBUFFER_INC_PREFIX), GBUFFER_INC_PREFIX) == 0 &&
+            vert_path.size() > suffix.size() &&
+            vert_path.compare(vert_path.size() - suffix.size(), std::string::npos, suffix) == 0);
+        if (vert_path == bundled[i] || is_variant) {
+            Shader* variant = load_shader(vert_path, shader->get_filename(Shader::ST_fragment));
+            if (variant != nullptr)
+                np.set_shader(variant, state->get_override(ShaderAttrib::get_class_slot()));
+            return;
+        }
+    }
+}
+
+/*
+ * Binds the buffers to np and rebinds the swapped ones after each upload.
+ * Only paths to other nodes are kept, a path to this node would hold
+ * a reference to it, so this node is rebound through a temporary path.
+ */
+void InstanceNode::_bind(NodePath np) {
+    _bind_data(np);
+    np.set_shader_input("instance_stride", LVecBase4i(_stride / RGBA_CHANNEL_COUNT, 0, 0, 0));
+    np.set_shader_input("instance_index_offset", LVecBase4i(0, 0, 0, 0));
+    np.set_shader_input("instance_lod_fade", LVecBase4(_lod_fade, 0, 0, 0));
+    np.set_shader_input("instance_index_tex", _instance_index_tex);
+    if (np.node() == this)
+        _is_bound = true;
+    else if (std::find(_bound_paths.begin(), _bound_paths.end(), np) == _bound_paths.end())
+        _bound_paths.push_back(np);
+}
 
-    data = _instance_prev_time_tex->modify_ram_image();
-    memcpy(data.p(), _instance_prev_time, sizeof(_instance_prev_time));
-    np.set_shader_input("instance_prev_time_tex", _instance_prev_time_tex);
+void InstanceNode::_bind_data(NodePath np) {
+    np.set_shader_input("instance_data_tex", _front_data_tex);
+    np.set_shader_input("instance_prev_data_tex", _front_prev_data_tex);
 }
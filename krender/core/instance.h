@@ -1,48 +1,241 @@
 #ifndef PANDA_INSTANCE_H
 #define PANDA_INSTANCE_H
 
+// defines HAVE_PYTHON, py_panda.h includes Python.h before the std headers
+#include "pandabase.h"
+#ifdef HAVE_PYTHON
+#include "py_panda.h"
+#endif
+
+#include <string>
+
+#include "filename.h"
 #include "nodePath.h"
 #include "pandaNode.h"
+#include "pvector.h"
+#include "shader.h"
 
-#define MAX_INSTANCES 1000
+#define INSTANCE_INC_GLSL ".krender_instance.inc.glsl"
+#define INSTANCED_GLSL_PREFIX ".krender_instanced."
+// key of the shadow tag states of TagStateManager,
+// the depth prepass cameras use it too
+#define INSTANCE_TAG "Shadows"
+#define INSTANCE_TAG_STATE "instanced"
+#define INSTANCE_SHADER_SORT 210
+#define MIN_INSTANCE_CAPACITY 16
 #define FLOAT_SIZE 4
 #define MAT4_HEIGHT 4
 #define MAT4_SIZE (MAT4_WIDTH * MAT4_HEIGHT * FLOAT_SIZE)
 #define MAT4_WIDTH 4
+#define POS_COMPONENTS 3
+#define QUAT_COMPONENTS 4
+#define SCALE_COMPONENTS 3
+#define COMPOSE_BATCH_SIZE 4096
+#define CULL_BATCH_SIZE 4096
+#define FRUSTUM_PLANES 6
+#define NO_LOD 255  // farther than the last LOD or culled
+#define NEW_LOD 254  // not sorted yet, appears without a crossfade
+#define LOD_CHANNEL_SIZE 3  // switch time, LOD before and after
 #define RGBA_CHANNEL_COUNT 4
 #define RGBA_MAT4_SIZE ((MAT4_WIDTH * MAT4_HEIGHT) / RGBA_CHANNEL_COUNT)
 
 
-typedef union LMatrix4Array {
-    LMatrix4 matrices[MAX_INSTANCES];
-    unsigned char data[MAT4_SIZE * MAX_INSTANCES];
-} LMatrix4Array;
+BEGIN_PUBLISH
+// built-in channels of the instance data, user channels follow them
+enum InstanceChannel {
+    IC_TRANSFORM = 0,
+    IC_TIME = 1,
+    NUM_BUILTIN_CHANNELS = 2
+};
+END_PUBLISH
+
+// dirty ranges of the instance buffers, uploaded separately
+enum InstanceBuffer {
+    IB_DATA = 0,  // interleaved channels of this frame
+    IB_PREV_DATA = 1,  // overridden channels of the previous frame
+    IB_INDEX = 2,  // visible instances
+    IB_HISTORY = 3,  // rows of the data texture a frame behind
+    NUM_INSTANCE_BUFFERS = 4
+};
+
+
+struct ComposeSource;
+struct LODSource;
 
 
+/*
+ * Instances of the geometry below this node, the transforms, times
+ * and user channels of an instance are interleaved in one buffer texture
+ * which is bound to this node.
+ * The data of the previous frame is kept in a second buffer, both are
+ * swapped after each upload, so shaders read it with get_instance_prev_*().
+ * With cull cameras only the instances inside of their frustums are drawn,
+ * shaders look up the instance id with get_instance_id() of get_glsl().
+ * Bundled shaders are switched to their instanced variants by setup().
+ * With LODs each LOD child draws the instances in its distance range.
+ */
 class EXPORT_CLASS InstanceNode: public PandaNode {
 PUBLISHED:
     explicit InstanceNode(const char* name, unsigned int num_instances);
+    virtual ~InstanceNode();
     void set_transform(unsigned int instance_id, LMatrix4 mat);
+    LMatrix4 get_transform(unsigned int instance_id);
     void set_prev_transform(unsigned int instance_id, LMatrix4 mat);
+    LMatrix4 get_prev_transform(unsigned int instance_id);
     void set_time(unsigned int instance_id, float time);
     void set_prev_time(unsigned int instance_id, float time);
+    int add_channel(const std::string &name, unsigned short num_components);
+    int get_channel(const std::string &name);
+    unsigned int get_num_channels();
+    std::string get_channel_name(unsigned int channel);
+    unsigned short get_channel_size(unsigned int channel);
+    unsigned int get_channel_offset(unsigned int channel);
+    unsigned int get_stride();
+    void set_channel(unsigned int instance_id, unsigned int channel, LVecBase4 value);
+    LVecBase4 get_channel_value(unsigned int instance_id, unsigned int channel);
+    std::string get_glsl();
+    void write_glsl(const std::string &filename=INSTANCE_INC_GLSL);
+    static Shader* load_shader(const Filename &vert_path, const Filename &frag_path);
+    void set_num_instances(unsigned int num_instances);
+    unsigned int get_num_instances();
+    unsigned int get_capacity();
     void setup();
     void setup(NodePath np);
     void update_shader_inputs();
     void update_shader_inputs(NodePath np);
+    bool upload();
+    size_t get_uploaded_bytes();
+    size_t get_total_uploaded_bytes();
+    void set_num_threads(unsigned int num_threads);
+    void add_cull_camera(NodePath camera);
+    void clear_cull_cameras();
+    void set_instance_bounds(LPoint3 center, PN_stdfloat radius);
+    void cull();
+    unsigned int get_num_visible();
+    unsigned int get_visible_instance(unsigned int i);
+    int add_lod(NodePath np, PN_stdfloat distance);
+    unsigned int get_num_lods();
+    unsigned int get_num_lod_instances(unsigned int lod);
+    void set_lod_camera(NodePath camera);
+    void set_lod_fade(PN_stdfloat duration);
+
+#ifdef HAVE_PYTHON
+    void set_transforms(PyObject* buffer, unsigned int offset=0);
+    void set_prev_transforms(PyObject* buffer, unsigned int offset=0);
+    void set_times(PyObject* buffer, unsigned int offset=0);
+    void set_prev_times(PyObject* buffer, unsigned int offset=0);
+    void set_channel_data(unsigned int channel, PyObject* buffer, unsigned int offset=0);
+    void set_prev_channel_data(unsigned int channel, PyObject* buffer, unsigned int offset=0);
+    void set_transforms(PyObject* pos, PyObject* quat, PyObject* scale, unsigned int offset=0);
+    void set_transforms_soa(PyObject* pos, PyObject* quat, PyObject* scale, unsigned int offset=0);
+#endif
+
+public:
+    void set_transforms(const float* data, unsigned int count, unsigned int offset);
+    void set_prev_transforms(const float* data, unsigned int count, unsigned int offset);
+    void set_times(const float* data, unsigned int count, unsigned int offset);
+    void set_prev_times(const float* data, unsigned int count, unsigned int offset);
+    void set_channel_data(unsigned int channel, const float* data, unsigned int count, unsigned int offset);
+    void set_prev_channel_data(unsigned int channel, const float* data, unsigned int count, unsigned int offset);
+    void set_transforms(
+        const float* pos, const float* quat, const float* scale,
+        unsigned int count, unsigned int offset);
+    void set_transforms_soa(
+        const float* pos, const float* quat, const float* scale,
+        unsigned int count, unsigned int offset);
+
+    struct Channel {
+        std::string name;
+        unsigned short num_components;
+        unsigned int offset;  // floats from the start of the instance
+    };
+
+    struct LOD {
+        NodePath np;
+        PN_stdfloat distance;  // drawn closer than it
+        unsigned int offset;  // first entry in the index buffer
+        unsigned int count;
+        pvector<PointerTo<PandaNode>> finals;  // final nodes below np
+    };
 
 private:
     unsigned int _num_instances;
-    LMatrix4Array* _instance_transform;
-    LMatrix4Array* _instance_prev_transform;
-    float _instance_time[MAX_INSTANCES];
-    float _instance_prev_time[MAX_INSTANCES];
-    PointerTo<Texture> _instance_transform_tex;
-    PointerTo<Texture> _instance_prev_transform_tex;
-    PointerTo<Texture> _instance_time_tex;
-    PointerTo<Texture> _instance_prev_time_tex;
+    unsigned int _capacity;
+    pvector<Channel> _channels;
+    unsigned int _stride;  // floats per instance, whole texels
+    float* _instance_data;
+    float* _instance_prev_data;
+    int* _instance_index;
+    PointerTo<Texture> _instance_data_tex;
+    PointerTo<Texture> _instance_prev_data_tex;
+    PointerTo<Texture> _instance_index_tex;
+
+    // textures drawn in this frame, the data ones are swapped after the upload
+    PointerTo<Texture> _front_data_tex;
+    PointerTo<Texture> _front_prev_data_tex;
+    pvector<NodePath> _bound_paths;
+
+    // frustum culling
+    pvector<NodePath> _cull_cameras;
+    LPoint3 _instance_center;
+    PN_stdfloat _instance_radius;
+    bool _has_instance_bounds;
+    bool _is_index_identity;
+    unsigned int _num_visible;
+    bool _is_hidden;  // no instances to draw
+    pvector<PointerTo<PandaNode>> _finals;  // final nodes set up below this one
+    pvector<int> _visible_ids;
+
+    // distance LODs
+    pvector<LOD> _lods;
+    NodePath _lod_camera;
+    PN_stdfloat _lod_fade;
+    pvector<unsigned char> _instance_lods;
+    pvector<unsigned char> _lod_codes;
+
+    // ranges of instances changed since the last upload
+    unsigned int _dirty_begin[NUM_INSTANCE_BUFFERS];
+    unsigned int _dirty_end[NUM_INSTANCE_BUFFERS];
+    int _upload_frame;
+    bool _is_bound;
+    size_t _uploaded_bytes;
+    size_t _total_uploaded_bytes;
+    unsigned int _num_threads;
     static TypeHandle _type_handle;
 
+    void _set_capacity(unsigned int capacity);
+    void _setup_data_textures();
+    int _add_channel(const std::string &name, unsigned short num_components);
+    void _set_matrix(float* data, unsigned int channel, unsigned int instance_id, const LMatrix4 &mat);
+    LMatrix4 _get_matrix(const float* data, unsigned int channel, unsigned int instance_id);
+    void _copy_channel_data(
+        float* buffer, unsigned int channel,
+        const float* data, unsigned int count, unsigned int offset);
+    void _init_instances(float* buffer, unsigned int begin, unsigned int end);
+    void _set_instance_count(unsigned int count);
+    void _set_lod_count(unsigned int lod, unsigned int offset, unsigned int count);
+    void _find_finals(NodePath np, pvector<PointerTo<PandaNode>> &finals);
+    unsigned int _cull_frustums(int* ids);
+    unsigned int _sort_lods(const int* ids, unsigned int count);
+    unsigned int _get_num_batches(unsigned int count, unsigned int* batch);
+    void _reset_index(unsigned int begin, unsigned int end);
+    void _mark_dirty(unsigned short buffer, unsigned int begin, unsigned int end);
+    void _upload_range(
+        PointerTo<Texture> tex, const unsigned char* data,
+        size_t instance_size, unsigned int begin, unsigned int end);
+    void _swap_data();
+    void _bind(NodePath np);
+    void _bind_data(NodePath np);
+    void _setup_shaders(NodePath np);
+    void _compose(const ComposeSource &src, unsigned int count, unsigned int offset);
+#ifdef HAVE_PYTHON
+    bool _get_buffer(PyObject* obj, Py_buffer* view, size_t components, unsigned int* count);
+    void _set_channel_buffer(unsigned int channel, PyObject* buffer, unsigned int offset, bool prev);
+    void _set_transform_buffers(
+        PyObject* pos, PyObject* quat, PyObject* scale,
+        unsigned int offset, bool soa);
+#endif
+
 public:
     static TypeHandle get_class_type() {
         return _type_handle;
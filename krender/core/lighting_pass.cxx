@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <string.h>
+
+#include "camera.h"
+#include "cardMaker.h"
+#include "geomEnums.h"
+#include "lens.h"
+
+#include "krender/core/lighting_pass.h"
+
+
+LightingPass::LightingPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        bool has_srgb, bool has_alpha, float sx, float sy):
+        PostPass(name, index, win, cam, has_srgb, has_alpha, sx, sy, _make_card(name)) {
+    _type = LIGHTING_PASS;
+    _tiles_x = 0;
+    _tiles_y = 0;
+
+    char* tex_name = (char*) malloc((strlen(name) + strlen("_light_tiles") + 1) * sizeof(char));
+    sprintf(tex_name, "%s_light_tiles", name);
+    _light_tiles = new Texture(tex_name);
+    free(tex_name);
+
+    // setup projection camera which captures the card of this pass
+    ((Camera*) get_camera().node())->set_scene(get_source_card());
+}
+
+PointerTo<Texture> LightingPass::get_light_tiles() {
+    return _light_tiles;
+}
+
+/*
+ * Finds the screen tiles covered by each light,
+ * tile stores bit mask of the light slots.
+ */
+void LightingPass::update_light_tiles(LightData* light_data, NodePath camera, NodePath scene) {
+    int width = std::max((int) (_win->get_x_size() * _scale_x), 1);
+    int height = std::max((int) (_win->get_y_size() * _scale_y), 1);
+    int tiles_x = (width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+    int tiles_y = (height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+
+    if (tiles_x != _tiles_x || tiles_y != _tiles_y) {
+        _tiles_x = tiles_x;
+        _tiles_y = tiles_y;
+        _light_tiles->setup_buffer_texture(
+            tiles_x * tiles_y, Texture::T_int, Texture::F_r32i, GeomEnums::UH_dynamic);
+        get_source_card().set_shader_input(ShaderInput("light_tiles", _light_tiles));
+        get_source_card().set_shader_input(ShaderInput("light_tiles_size", LVecBase2i(tiles_x, tiles_y)));
+    }
+
+    PTA_uchar ram_image = _light_tiles->modify_ram_image();
+    PN_int32* tiles = (PN_int32*) ram_image.p();
+    memset(tiles, 0, tiles_x * tiles_y * sizeof(PN_int32));
+
+    LMatrix4 proj_mat = ((Camera*) camera.node())->get_lens()->get_projection_mat();
+
+    for (int slot = 0; slot < MAX_LIGHTS; slot++) {
+        LightInfo_s* light = &light_data->contents.lights[slot].fields;
+        float radius = light->radius;
+        if (radius == 0)
+            continue;
+
+        LPoint3 center = camera.get_relative_point(
+            scene, LPoint3(light->pos[0], light->pos[1], light->pos[2]));
+
+        // screen-space bounds of the light sphere,
+        // projected corners of its bounding box in -1...1 range
+        LPoint2 bmin(1, 1);
+        LPoint2 bmax(-1, -1);
+        bool behind = false;
+        for (int i = 0; i < 8; i++) {
+            LVecBase4 corner(
+                center[0] + ((i & 1) ? radius : -radius),
+                center[1] + ((i & 2) ? radius : -radius),
+                center[2] + ((i & 4) ? radius : -radius),
+                1);
+            LVecBase4 clip = proj_mat.xform(corner);
+            if (clip[3] <= 0.0001) {
+                behind = true;
+                break;
+            }
+            LPoint2 ndc(clip[0] / clip[3], clip[1] / clip[3]);
+            bmin = bmin.fmin(ndc);
+            bmax = bmax.fmax(ndc);
+        }
+
+        if (behind) {  // crosses the camera plane
+            if (center[1] + radius < 0)
+                continue;  // completely behind the camera
+            bmin = LPoint2(-1, -1);
+            bmax = LPoint2(1, 1);
+        }
+
+        if (bmax[0] < -1 || bmax[1] < -1 || bmin[0] > 1 || bmin[1] > 1)
+            continue;  // off screen
+
+        int x0 = std::max((int) ((bmin[0] * 0.5 + 0.5) * width) / LIGHT_TILE_SIZE, 0);
+        int y0 = std::max((int) ((bmin[1] * 0.5 + 0.5) * height) / LIGHT_TILE_SIZE, 0);
+        int x1 = std::min((int) ((bmax[0] * 0.5 + 0.5) * width) / LIGHT_TILE_SIZE, tiles_x - 1);
+        int y1 = std::min((int) ((bmax[1] * 0.5 + 0.5) * height) / LIGHT_TILE_SIZE, tiles_y - 1);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                tiles[y * tiles_x + x] |= 1 << slot;
+            }
+        }
+    }
+}
+
+/*
+ * Makes a full-screen card for the lighting shader.
+ */
+NodePath LightingPass::_make_card(char* name) {
+    CardMaker cm(name);
+    cm.set_frame_fullscreen_quad();
+    return NodePath(cm.generate());
+}
@@ -0,0 +1,30 @@
+#ifndef CORE_LIGHTING_PASS_H
+#define CORE_LIGHTING_PASS_H
+
+#include "krender/core/light_data.h"
+#include "krender/core/post_pass.h"
+
+
+/*
+ * Full-screen pass, which lights the G-buffer of the scene pass.
+ * Lights are binned into screen tiles on CPU,
+ * so each pixel is lit only by the lights which cover its tile.
+ */
+class LightingPass: public PostPass {
+public:
+    LightingPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        bool has_srgb=false, bool has_alpha=false,
+        float sx=1, float sy=1);
+    void update_light_tiles(LightData* light_data, NodePath camera, NodePath scene);
+    PointerTo<Texture> get_light_tiles();
+
+protected:
+    PointerTo<Texture> _light_tiles;
+    int _tiles_x;
+    int _tiles_y;
+
+    static NodePath _make_card(char* name);
+};
+
+#endif
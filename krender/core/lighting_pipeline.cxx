@@ -13,6 +13,8 @@
 #include "virtualFileMountRamdisk.h"
 #include "virtualFileSystem.h"
 
+#include "krender/core/gbuffer_layout.h"
+#include "krender/core/instance.h"
 #include "krender/core/lighting_pipeline.h"
 #include "krender/core/helpers.h"
 
@@ -75,12 +77,30 @@ void LightingPipeline::_configure() {
         vfs->delete_file(CONFIG_INC_GLSL);
     vfs->write_file(CONFIG_INC_GLSL, config, false);
 
+    // default G-buffer formats, render pipelines include their own before them
+    if (vfs->exists(GBUFFER_INC_GLSL))
+        vfs->delete_file(GBUFFER_INC_GLSL);
+    vfs->write_file(GBUFFER_INC_GLSL, GBufferLayout().get_defines(), false);
+
     free(config);
 }
 
-// LightingPipeline::~LightingPipeline() {
-//     free(_light_data);
-// }
+LightingPipeline::~LightingPipeline() {
+    remove_lights();
+
+    // light manager refers to the shadow manager and the command list
+    delete _light_manager;
+    delete _shadow_manager;
+    delete _gpu_command_list;
+    _tag_state_manager->cleanup_states();
+    delete _tag_state_manager;
+
+    _shadow_cams.remove_node();
+    _shadowmap_fbo->clear_render_textures();
+    _win->get_engine()->remove_window(_shadowmap_fbo);
+
+    free(_light_data);
+}
 
 void LightingPipeline::_create_shadowmap() {
     _atlas_size = 256;
@@ -106,6 +126,7 @@ void LightingPipeline::_create_shadowmap() {
     // create FBO
     _shadowmap_fbo = _win->make_texture_buffer(
         "lighting_pipeline", _atlas_size, _atlas_size, nullptr, false, fbp);
+    delete fbp;
     _shadowmap_fbo->clear_render_textures();
     _shadowmap_fbo->disable_clears();
     _shadowmap_fbo->get_overlay_display_region()->disable_clears();
@@ -170,6 +191,16 @@ void LightingPipeline::_create_shadow_manager() {
             ((Camera*) camera.node())->set_camera_mask(1 << CAMERA_BIT_SHADOW);
         }
     }
+
+    // subtrees of InstanceNodes are tagged, all their instances
+    // are drawn by one call of each shadow camera
+    Shader* instanced_shader = InstanceNode::load_shader(
+        Filename("krender/shader/shadow.vert.glsl"),
+        Filename("krender/shader/shadow.frag.glsl"));
+    if (instanced_shader != nullptr)
+        _tag_state_manager->apply_state(
+            "shadow", NodePath(INSTANCE_TAG_STATE), instanced_shader,
+            INSTANCE_TAG_STATE, INSTANCE_SHADER_SORT);
 }
 
 void LightingPipeline::_create_queue() {
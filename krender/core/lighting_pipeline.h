@@ -39,6 +39,7 @@ PUBLISHED:
     LightingPipeline(
         PointerTo<GraphicsWindow> window, NodePath camera,
         bool has_srgb=false, bool has_pcf=false, unsigned int shadow_size=512);
+    virtual ~LightingPipeline();
     NodePath get_scene();
     void update();
     int get_num_commands();
@@ -58,6 +59,7 @@ protected:
     Filename _path;
     bool _has_srgb;
     bool _has_pcf;
+    LightData* _light_data;
 
     void _configure();
 
@@ -75,7 +77,6 @@ private:
     TagStateManager* _tag_state_manager;
     ShadowManager* _shadow_manager;
     InternalLightManager* _light_manager;
-    LightData* _light_data;
     PointerTo<Texture> _light_data_tex;
 
     short _atlas_size;
@@ -0,0 +1,444 @@
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OC_SSE 1
+#endif
+
+#include "boundingVolume.h"
+#include "camera.h"
+#include "finiteBoundingVolume.h"
+#include "geom.h"
+#include "geomNode.h"
+#include "geomPrimitive.h"
+#include "geomVertexReader.h"
+#include "lens.h"
+#include "nodePathCollection.h"
+
+#include "krender/core/occlusion_culler.h"
+
+// clip space w of the points considered to be at the camera plane
+#define OC_NEAR_W 0.0001
+
+
+TypeHandle OcclusionCuller::_type_handle;
+
+OcclusionCuller::OcclusionCuller(
+        unsigned int width, unsigned int height, unsigned int num_threads) {
+    _width = std::max(width, 4u);
+    _height = std::max(height, 1u);
+    _stride = (_width + 3) & ~3u;
+    _num_threads = num_threads ? num_threads : std::max(std::thread::hardware_concurrency(), 1u);
+    _num_threads = std::min(_num_threads, _height);
+    _depth.resize(_stride * _height, 1);
+    _view_proj_mat = LMatrix4::ident_mat();
+
+    _num_tested = 0;
+    _num_culled = 0;
+    _cull_time = 0;
+}
+
+/*
+ * Adds occluder, its triangles are cached,
+ * so only the transform of the occluder itself may change later.
+ */
+void OcclusionCuller::add_occluder(NodePath occluder) {
+    Occluder data;
+    data.np = occluder;
+
+    NodePathCollection geom_nps = occluder.find_all_matches("**/+GeomNode");
+    if (occluder.node()->is_geom_node())
+        geom_nps.add_path(occluder);
+
+    for (int i = 0; i < geom_nps.get_num_paths(); i++) {
+        NodePath geom_np = geom_nps.get_path(i);
+        GeomNode* geom_node = (GeomNode*) geom_np.node();
+        LMatrix4 mat = geom_np.get_mat(occluder);
+
+        for (int j = 0; j < geom_node->get_num_geoms(); j++) {
+            CPT(Geom) geom = geom_node->get_geom(j)->decompose();
+            GeomVertexReader reader(geom->get_vertex_data(), "vertex");
+
+            for (size_t k = 0; k < geom->get_num_primitives(); k++) {
+                CPT(GeomPrimitive) prim = geom->get_primitive(k);
+                if (prim->get_primitive_type() != GeomPrimitive::PT_polygons)
+                    continue;
+
+                for (int v = 0; v < prim->get_num_vertices(); v++) {
+                    reader.set_row(prim->get_vertex(v));
+                    data.vertices.push_back(mat.xform_point(reader.get_data3()));
+                }
+            }
+        }
+    }
+
+    _occluders.push_back(data);
+}
+
+void OcclusionCuller::add_occludee(NodePath occludee) {
+    Occludee data;
+    data.np = occludee;
+    data.hidden = DrawMask::all_off();
+    data.occluded = false;
+    _occludees.push_back(data);
+}
+
+/*
+ * Adds nodes tagged as "occluder" and "occludee".
+ */
+void OcclusionCuller::collect(NodePath scene) {
+    NodePathCollection occluders = scene.find_all_matches("**/=" OCCLUDER_TAG);
+    for (int i = 0; i < occluders.get_num_paths(); i++) {
+        add_occluder(occluders.get_path(i));
+    }
+
+    NodePathCollection occludees = scene.find_all_matches("**/=" OCCLUDEE_TAG);
+    for (int i = 0; i < occludees.get_num_paths(); i++) {
+        add_occludee(occludees.get_path(i));
+    }
+}
+
+/*
+ * Removes all occluders and occludees, hidden occludees are shown back.
+ */
+void OcclusionCuller::clear() {
+    for (unsigned int i = 0; i < _occludees.size(); i++) {
+        if (!_occludees[i].hidden.is_zero())
+            _occludees[i].np.show(_occludees[i].hidden);
+    }
+    _occluders.clear();
+    _occludees.clear();
+}
+
+unsigned int OcclusionCuller::get_num_occluders() {
+    return _occluders.size();
+}
+
+unsigned int OcclusionCuller::get_num_occludees() {
+    return _occludees.size();
+}
+
+/*
+ * Rasterizes occluders as seen by the camera
+ * and hides occluded occludees from the cameras with the given mask.
+ */
+void OcclusionCuller::cull(NodePath camera, NodePath scene, DrawMask mask) {
+    auto start = std::chrono::steady_clock::now();
+
+    Lens* lens = ((Camera*) camera.node())->get_lens();
+    _view_proj_mat = scene.get_mat(camera) * lens->get_projection_mat();
+
+    _setup_triangles(_view_proj_mat, scene);
+    _rasterize();
+    _cull_occludees(scene, mask);
+
+    _cull_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Hides occludees behind the given depth buffer instead of the occluders,
+ * e.g. the Hi-Z readback of the previous frame. The bounds are tested
+ * with the view projection matrix the depth buffer was rendered with.
+ * The texture must be a single channel float one with a RAM image.
+ */
+void OcclusionCuller::cull_depth(
+        NodePath scene, DrawMask mask,
+        Texture* depth, const LMatrix4 &view_proj_mat) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (!_load_depth(depth))
+        return;
+    _view_proj_mat = view_proj_mat;
+    _cull_occludees(scene, mask);
+
+    _cull_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Copies the depth texture into the depth buffer,
+ * which takes the size of the texture.
+ */
+bool OcclusionCuller::_load_depth(Texture* depth) {
+    if (depth == nullptr || !depth->has_ram_image() || depth->get_x_size() < 1 ||
+            depth->get_component_type() != Texture::T_float ||
+            depth->get_num_components() != 1)
+        return false;
+
+    CPTA_uchar image = depth->get_ram_image();
+    const float* data = (const float*) image.p();
+    _width = depth->get_x_size();
+    _height = depth->get_y_size();
+    _stride = (_width + 3) & ~3u;
+    _depth.assign(_stride * _height, 1);
+
+    for (unsigned int y = 0; y < _height; y++) {
+        std::copy(data + y * _width, data + (y + 1) * _width, _depth.begin() + y * _stride);
+    }
+    return true;
+}
+
+/*
+ * Hides occludees behind the depth buffer, shows back the visible ones.
+ */
+void OcclusionCuller::_cull_occludees(NodePath scene, DrawMask mask) {
+    _num_tested = _occludees.size();
+    _num_culled = 0;
+    for (unsigned int i = 0; i < _occludees.size(); i++) {
+        Occludee &occludee = _occludees[i];
+        occludee.occluded = _test_bounds(occludee.np, scene);
+
+        if (occludee.occluded) {
+            _num_culled++;
+            occludee.np.hide(mask);
+            occludee.hidden |= mask;
+        } else if (!(occludee.hidden & mask).is_zero()) {
+            // show only what was hidden by this culler
+            occludee.np.show(occludee.hidden & mask);
+            occludee.hidden &= ~mask;
+        }
+    }
+}
+
+/*
+ * Returns true if the occludee was culled by the last call to cull.
+ */
+bool OcclusionCuller::is_occluded(NodePath occludee) {
+    for (unsigned int i = 0; i < _occludees.size(); i++) {
+        if (_occludees[i].np == occludee)
+            return _occludees[i].occluded;
+    }
+    return false;
+}
+
+/*
+ * Returns true if the box given in the scene space is behind
+ * the depth buffer of the last cull, e.g. the bounds of an instance.
+ */
+bool OcclusionCuller::is_box_occluded(const LPoint3 &min_point, const LPoint3 &max_point) {
+    return _test_box(min_point, max_point, _view_proj_mat);
+}
+
+unsigned int OcclusionCuller::get_num_tested() {
+    return _num_tested;
+}
+
+unsigned int OcclusionCuller::get_num_culled() {
+    return _num_culled;
+}
+
+float OcclusionCuller::get_cull_rate() {
+    return _num_tested ? (float) _num_culled / _num_tested : 0;
+}
+
+/*
+ * Returns the duration of the last cull in seconds.
+ */
+double OcclusionCuller::get_cull_time() {
+    return _cull_time;
+}
+
+/*
+ * Returns depth of the occluders in 0...1 range, 1 if there is no occluder.
+ */
+float OcclusionCuller::get_depth(unsigned int x, unsigned int y) {
+    if (x >= _width || y >= _height)
+        return 1;
+    return _depth[y * _stride + x];
+}
+
+/*
+ * Projects occluder triangles into the depth buffer space.
+ */
+void OcclusionCuller::_setup_triangles(const LMatrix4 &view_proj_mat, NodePath scene) {
+    _triangles.clear();
+
+    for (unsigned int i = 0; i < _occluders.size(); i++) {
+        Occluder &occluder = _occluders[i];
+        LMatrix4 mat = occluder.np.get_mat(scene) * view_proj_mat;
+
+        for (size_t j = 0; j + 2 < occluder.vertices.size(); j += 3) {
+            ScreenTriangle tri;
+            bool clipped = false;
+
+            for (int k = 0; k < 3; k++) {
+                LVecBase4 clip = mat.xform(LVecBase4(occluder.vertices[j + k], 1));
+                if (clip[3] <= OC_NEAR_W) {
+                    // crosses the camera plane, skipping is conservative
+                    clipped = true;
+                    break;
+                }
+                tri.x[k] = (clip[0] / clip[3] * 0.5 + 0.5) * _width;
+                tri.y[k] = (clip[1] / clip[3] * 0.5 + 0.5) * _height;
+                tri.z[k] = clip[2] / clip[3] * 0.5 + 0.5;
+            }
+
+            if (!clipped)
+                _triangles.push_back(tri);
+        }
+    }
+}
+
+/*
+ * Rasterizes all triangles, each thread fills its own band of rows.
+ */
+void OcclusionCuller::_rasterize() {
+    std::fill(_depth.begin(), _depth.end(), 1.0f);
+
+    if (_num_threads <= 1 || _triangles.size() < 16) {
+        _rasterize_band(0, _height);
+        return;
+    }
+
+    pvector<std::thread> threads;
+    unsigned int band = (_height + _num_threads - 1) / _num_threads;
+    for (unsigned int y0 = 0; y0 < _height; y0 += band) {
+        threads.push_back(std::thread(
+            &OcclusionCuller::_rasterize_band, this, y0, std::min(y0 + band, _height)));
+    }
+    for (unsigned int i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+void OcclusionCuller::_rasterize_band(unsigned int y0, unsigned int y1) {
+    for (unsigned int i = 0; i < _triangles.size(); i++) {
+        _rasterize_triangle(_triangles[i], y0, y1);
+    }
+}
+
+/*
+ * Half-space rasterization at pixel centers, keeps the nearest depth.
+ */
+void OcclusionCuller::_rasterize_triangle(const ScreenTriangle &tri, unsigned int y0, unsigned int y1) {
+    float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.y[1] - tri.y[0]) * (tri.x[2] - tri.x[0]);
+    if (fabs(area) < 1e-8f)
+        return;
+
+    // bounding box clamped to the band
+    int min_x = std::max((int) floor(std::min(std::min(tri.x[0], tri.x[1]), tri.x[2])), 0);
+    int max_x = std::min((int) ceil(std::max(std::max(tri.x[0], tri.x[1]), tri.x[2])), (int) _width - 1);
+    int min_y = std::max((int) floor(std::min(std::min(tri.y[0], tri.y[1]), tri.y[2])), (int) y0);
+    int max_y = std::min((int) ceil(std::max(std::max(tri.y[0], tri.y[1]), tri.y[2])), (int) y1 - 1);
+    if (min_x > max_x || min_y > max_y)
+        return;
+
+    // edge functions e(x, y) = a * x + b * y + c, positive inside
+    float sign = area > 0 ? 1.0f : -1.0f;
+    float a[3], b[3], c[3];
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        a[i] = (tri.y[i] - tri.y[j]) * sign;
+        b[i] = (tri.x[j] - tri.x[i]) * sign;
+        c[i] = (tri.x[i] * tri.y[j] - tri.x[j] * tri.y[i]) * sign;
+    }
+
+    // depth plane z(x, y) = za * x + zb * y + zc,
+    // edge i is opposite to vertex (i + 2) % 3
+    float inv_area = 1.0f / fabs(area);
+    float za = (a[1] * tri.z[0] + a[2] * tri.z[1] + a[0] * tri.z[2]) * inv_area;
+    float zb = (b[1] * tri.z[0] + b[2] * tri.z[1] + b[0] * tri.z[2]) * inv_area;
+    float zc = (c[1] * tri.z[0] + c[2] * tri.z[1] + c[0] * tri.z[2]) * inv_area;
+
+    min_x &= ~3;  // aligned to SIMD width, stride is padded
+
+    for (int y = min_y; y <= max_y; y++) {
+        float py = y + 0.5f;
+        float* row = &_depth[y * _stride];
+
+#ifdef OC_SSE
+        __m128 step = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+        __m128 zero = _mm_setzero_ps();
+        for (int x = min_x; x <= max_x; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float) x), step);
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[0]), px), _mm_set1_ps(b[0] * py + c[0]));
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[1]), px), _mm_set1_ps(b[1] * py + c[1]));
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[2]), px), _mm_set1_ps(b[2] * py + c[2]));
+            __m128 inside = _mm_and_ps(
+                _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+                _mm_cmpge_ps(e2, zero));
+            if (_mm_movemask_ps(inside) == 0)
+                continue;
+
+            __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(za), px), _mm_set1_ps(zb * py + zc));
+            __m128 depth = _mm_loadu_ps(row + x);
+            __m128 nearest = _mm_min_ps(depth, z);
+            _mm_storeu_ps(row + x, _mm_or_ps(
+                _mm_and_ps(inside, nearest), _mm_andnot_ps(inside, depth)));
+        }
+#else
+        for (int x = min_x; x <= max_x; x++) {
+            float px = x + 0.5f;
+            if (a[0] * px + b[0] * py + c[0] < 0 ||
+                    a[1] * px + b[1] * py + c[1] < 0 ||
+                    a[2] * px + b[2] * py + c[2] < 0)
+                continue;
+
+            float z = za * px + zb * py + zc;
+            if (z < row[x])
+                row[x] = z;
+        }
+#endif
+    }
+}
+
+/*
+ * Returns true if the bounds of the occludee are behind the occluders
+ * in every pixel they cover.
+ */
+bool OcclusionCuller::_test_bounds(NodePath occludee, NodePath scene) {
+    CPT(BoundingVolume) bounds = occludee.get_bounds();
+    if (bounds->is_empty() || bounds->is_infinite() ||
+            !bounds->is_of_type(FiniteBoundingVolume::get_class_type()))
+        return false;
+
+    const FiniteBoundingVolume* fbv = DCAST(FiniteBoundingVolume, bounds);
+
+    // bounds are in the space of the occludee
+    return _test_box(fbv->get_min(), fbv->get_max(), occludee.get_mat(scene) * _view_proj_mat);
+}
+
+/*
+ * Returns true if the box transformed by the matrix into the clip space
+ * is behind the depth buffer in every pixel it covers.
+ */
+bool OcclusionCuller::_test_box(const LPoint3 &bmin, const LPoint3 &bmax, const LMatrix4 &mat) {
+    float min_x = _width, min_y = _height, min_z = 1;
+    float max_x = 0, max_y = 0;
+    for (int i = 0; i < 8; i++) {
+        LPoint3 corner(
+            (i & 1) ? bmax[0] : bmin[0],
+            (i & 2) ? bmax[1] : bmin[1],
+            (i & 4) ? bmax[2] : bmin[2]);
+        LVecBase4 clip = mat.xform(LVecBase4(corner, 1));
+        if (clip[3] <= OC_NEAR_W)
+            return false;  // crosses the camera plane
+
+        float x = (clip[0] / clip[3] * 0.5 + 0.5) * _width;
+        float y = (clip[1] / clip[3] * 0.5 + 0.5) * _height;
+        float z = clip[2] / clip[3] * 0.5 + 0.5;
+        min_x = std::min(min_x, x);
+        min_y = std::min(min_y, y);
+        min_z = std::min(min_z, z);
+        max_x = std::max(max_x, x);
+        max_y = std::max(max_y, y);
+    }
+
+    if (max_x < 0 || max_y < 0 || min_x >= _width || min_y >= _height)
+        return false;  // off screen, left for the frustum culling
+
+    int x0 = std::max((int) floor(min_x), 0);
+    int y0 = std::max((int) floor(min_y), 0);
+    int x1 = std::min((int) ceil(max_x), (int) _width - 1);
+    int y1 = std::min((int) ceil(max_y), (int) _height - 1);
+
+    for (int y = y0; y <= y1; y++) {
+        const float* row = &_depth[y * _stride];
+        for (int x = x0; x <= x1; x++) {
+            if (min_z <= row[x])
+                return false;  // visible in this pixel
+        }
+    }
+    return true;
+}
@@ -0,0 +1,109 @@
+#ifndef CORE_OCCLUSION_CULLER_H
+#define CORE_OCCLUSION_CULLER_H
+
+#include "drawMask.h"
+#include "lmatrix.h"
+#include "lpoint3.h"
+#include "nodePath.h"
+#include "pandabase.h"
+#include "pvector.h"
+#include "texture.h"
+#include "typedReferenceCount.h"
+
+#define OCCLUDER_TAG "occluder"
+#define OCCLUDEE_TAG "occludee"
+
+
+/*
+ * CPU occlusion culling.
+ * Occluder meshes are rasterized into a small depth buffer,
+ * occludees which bounds are behind it are hidden from the camera mask.
+ */
+class EXPORT_CLASS OcclusionCuller: public TypedReferenceCount {
+PUBLISHED:
+    OcclusionCuller(
+        unsigned int width=256, unsigned int height=128,
+        unsigned int num_threads=0);
+    void add_occluder(NodePath occluder);
+    void add_occludee(NodePath occludee);
+    void collect(NodePath scene);
+    void clear();
+    unsigned int get_num_occluders();
+    unsigned int get_num_occludees();
+    void cull(NodePath camera, NodePath scene, DrawMask mask);
+    void cull_depth(
+        NodePath scene, DrawMask mask,
+        Texture* depth, const LMatrix4 &view_proj_mat);
+    bool is_occluded(NodePath occludee);
+    bool is_box_occluded(const LPoint3 &min_point, const LPoint3 &max_point);
+    unsigned int get_num_tested();
+    unsigned int get_num_culled();
+    float get_cull_rate();
+    double get_cull_time();
+    float get_depth(unsigned int x, unsigned int y);
+
+public:
+    struct Occluder {
+        NodePath np;
+        pvector<LPoint3> vertices;  // triangles in occluder space
+    };
+
+    struct Occludee {
+        NodePath np;
+        DrawMask hidden;  // mask hidden by this culler
+        bool occluded;
+    };
+
+    struct ScreenTriangle {
+        float x[3];
+        float y[3];
+        float z[3];
+    };
+
+private:
+    unsigned int _width;
+    unsigned int _height;
+    unsigned int _stride;  // row size padded for SIMD
+    unsigned int _num_threads;
+    pvector<float> _depth;
+    LMatrix4 _view_proj_mat;  // of the last cull, scene to clip space
+
+    pvector<Occluder> _occluders;
+    pvector<Occludee> _occludees;
+    pvector<ScreenTriangle> _triangles;
+
+    unsigned int _num_tested;
+    unsigned int _num_culled;
+    double _cull_time;
+
+    void _setup_triangles(const LMatrix4 &view_proj_mat, NodePath scene);
+    void _rasterize();
+    void _rasterize_band(unsigned int y0, unsigned int y1);
+    void _rasterize_triangle(const ScreenTriangle &tri, unsigned int y0, unsigned int y1);
+    bool _load_depth(Texture* depth);
+    void _cull_occludees(NodePath scene, DrawMask mask);
+    bool _test_bounds(NodePath occludee, NodePath scene);
+    bool _test_box(const LPoint3 &bmin, const LPoint3 &bmax, const LMatrix4 &mat);
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(
+            _type_handle, "OcclusionCuller",
+            TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
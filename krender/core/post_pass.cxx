@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "krender/core/post_pass.h"
 
 #include "lens.h"
@@ -8,11 +10,68 @@ PostPass::PostPass(
         char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
         bool has_srgb, bool has_alpha, float sx, float sy, NodePath card):
         RenderPass(name, index, win, cam, has_srgb, has_alpha, sx, sy, card) {
+    _type = POST_PASS;
     _fbo = _make_fbo(win, has_srgb, has_alpha, true, false, 0, _index);
     _make_textures(true, false, 0);
     char* cam_name = (char*) malloc((strlen(name) + strlen("_camera") + 1) * sizeof(char));
     sprintf(cam_name, "%s_camera", name);
     _cam = _make_camera(_fbo, cam_name, cam);
+    free(cam_name);
+}
+
+/*
+ * Makes a post pass with the given color target, e.g. a float one.
+ */
+PostPass::PostPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        FrameBufferProperties* fbp, Texture::Format format,
+        float sx, float sy, NodePath card):
+        RenderPass(name, index, win, cam, false, false, sx, sy, card) {
+    _type = POST_PASS;
+    _fbo = _make_fbo(win, fbp, false, _index);
+    _add_texture("color", format, GraphicsOutput::RTP_color);
+    char* cam_name = (char*) malloc((strlen(name) + strlen("_camera") + 1) * sizeof(char));
+    sprintf(cam_name, "%s_camera", name);
+    _cam = _make_camera(_fbo, cam_name, cam);
+    free(cam_name);
+}
+
+PostPass::~PostPass() {
+    for (unsigned int i = 0; i < _stages.size(); i++) {
+        free(_stages[i].name);
+        free(_stages[i].path);
+    }
+}
+
+void PostPass::add_stage(char* name, char* path, bool pointwise) {
+    PostStage stage;
+    stage.name = strdup(name);
+    stage.path = strdup(path);
+    stage.pointwise = pointwise;
+    _stages.push_back(stage);
+}
+
+unsigned int PostPass::get_num_stages() {
+    return _stages.size();
+}
+
+PostStage PostPass::get_stage(unsigned int i) {
+    return _stages[i];
+}
+
+bool PostPass::has_stage(char* name) {
+    for (unsigned int i = 0; i < _stages.size(); i++) {
+        if (strcmp(_stages[i].name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Matches the name of the pass and the names of its stages.
+ */
+bool PostPass::has_name(char* name) {
+    return RenderPass::has_name(name) || has_stage(name);
 }
 
 /*
@@ -36,6 +95,7 @@ NodePath PostPass::_make_camera(PointerTo<GraphicsOutput> fbo, char* name, NodeP
     dr->set_incomplete_render(false);
     dr->set_sort(_index);
     dr->set_camera(cam);
+    _region = dr;
 
     return cam;
 }
@@ -4,6 +4,18 @@
 #include "krender/core/render_pass.h"
 
 
+/*
+ * Single post processing function of a generated post pass shader.
+ * Pointwise stages read prev_color only at the current pixel,
+ * so they can be fused into the pass of the previous stage.
+ */
+struct PostStage {
+    char* name;
+    char* path;
+    bool pointwise;
+};
+
+
 class PostPass: public RenderPass {
 public:
     PostPass(
@@ -11,8 +23,21 @@ public:
         bool has_srgb=false, bool has_alpha=false,
         float sx=1, float sy=1,
         NodePath card=NodePath::not_found());
+    PostPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        FrameBufferProperties* fbp, Texture::Format format,
+        float sx=1, float sy=1,
+        NodePath card=NodePath::not_found());
+    virtual ~PostPass();
+    void add_stage(char* name, char* path, bool pointwise=true);
+    unsigned int get_num_stages();
+    PostStage get_stage(unsigned int i);
+    bool has_stage(char* name);
+    virtual bool has_name(char* name);
 
 private:
+    pvector<PostStage> _stages;
+
     NodePath _make_camera(PointerTo<GraphicsOutput> fbo, char* name, NodePath camera);
 };
 
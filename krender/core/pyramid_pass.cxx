@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "krender/core/pyramid_pass.h"
+
+
+PyramidPass::PyramidPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        PointerTo<Texture> source, unsigned int num_levels, float threshold,
+        bool has_srgb, bool has_alpha, float sx, float sy):
+        CompoundPass(name, index, win, cam, has_srgb, has_alpha, sx, sy) {
+    _type = PYRAMID_PASS;
+    _source = source;
+    if (num_levels < 1)
+        num_levels = 1;
+
+    Shader* down_shader = Shader::load(
+        Shader::SL_GLSL,
+        Filename("krender/shader/post.vert.glsl"),
+        Filename("krender/shader/pyramid_down.frag.glsl"));
+    Shader* up_shader = Shader::load(
+        Shader::SL_GLSL,
+        Filename("krender/shader/post.vert.glsl"),
+        Filename("krender/shader/pyramid_up.frag.glsl"));
+
+    char suffix[32];
+
+    // downsample chain, each level is half the size of the previous one
+    PointerTo<Texture> level_tex = source;
+    for (unsigned int i = 0; i < num_levels; i++) {
+        float level_scale = 1.0 / (1 << i);
+        sprintf(suffix, "down%u", i);
+        PostPass* subpass = _make_subpass(
+            suffix, win, cam, has_srgb, has_alpha,
+            sx * level_scale, sy * level_scale, down_shader);
+        subpass->get_source_card().set_shader_input("source_tex", level_tex);
+        subpass->get_source_card().set_shader_input("pyramid_threshold", i == 0 ? threshold : 0);
+        level_tex = subpass->get_texture(0);
+    }
+
+    // upsample chain, back to the size of the first level
+    for (int i = num_levels - 2; i >= 0; i--) {
+        float level_scale = 1.0 / (1 << i);
+        sprintf(suffix, "up%d", i);
+        PostPass* subpass = _make_subpass(
+            suffix, win, cam, has_srgb, has_alpha,
+            sx * level_scale, sy * level_scale, up_shader);
+        subpass->get_source_card().set_shader_input("source_tex", level_tex);
+        level_tex = subpass->get_texture(0);
+    }
+
+    char* tex_name = (char*) malloc((strlen(_name) + strlen("_color") + 1) * sizeof(char));
+    sprintf(tex_name, "%s_color", _name);
+    _finish(tex_name);
+    free(tex_name);
+}
+
+PointerTo<Texture> PyramidPass::get_source() {
+    return _source;
+}
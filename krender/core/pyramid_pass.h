@@ -0,0 +1,24 @@
+#ifndef CORE_PYRAMID_PASS_H
+#define CORE_PYRAMID_PASS_H
+
+#include "krender/core/compound_pass.h"
+
+
+/*
+ * Blur pyramid, made of a thresholded downsample chain of the source texture
+ * and the dual filter (Kawase) upsample chain back to the first level.
+ */
+class PyramidPass: public CompoundPass {
+public:
+    PyramidPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        PointerTo<Texture> source, unsigned int num_levels=4, float threshold=0,
+        bool has_srgb=false, bool has_alpha=false,
+        float sx=0.5, float sy=0.5);
+    PointerTo<Texture> get_source();
+
+private:
+    PointerTo<Texture> _source;
+};
+
+#endif
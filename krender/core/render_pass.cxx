@@ -1,10 +1,13 @@
+#include <algorithm>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <type_traits>
 
+#include "camera.h"
 #include "displayRegion.h"
 #include "frameBufferProperties.h"
+#include "graphicsBuffer.h"
 #include "graphicsWindow.h"
 #include "pandaNode.h"
 #include "texture.h"
@@ -14,29 +17,156 @@
 
 #include "krender/core/render_pass.h"
 
+// texture name suffixes of the outputs in RenderPassOutput order
+static const char* OUTPUT_SUFFIXES[NUM_RENDER_PASS_OUTPUTS] = {
+    "color", "depth", "emissive", "normal", "selector", "velocity"};
+
 
 RenderPass::RenderPass(
         char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
         bool has_srgb, bool has_alpha, float sx, float sy, NodePath card) {
-    _name = name;
+    _name = strdup(name);
+    _type = SCENE_PASS;
     _index = index;
     _source_card = card;
+    _win = win;
+    _base_scale_x = sx;
+    _base_scale_y = sy;
     _scale_x = sx;
     _scale_y = sy;
+    _enabled = true;
+    _update_interval = 1;
+    _frame_count = 0;
+}
+
+/*
+ * Releases the FBO and the camera, textures are released
+ * by the last pass which reads them.
+ */
+RenderPass::~RenderPass() {
+    if (!_cam.is_empty())
+        _cam.remove_node();
+    if (_fbo != nullptr) {
+        _fbo->clear_render_textures();
+        _fbo->get_engine()->remove_window(_fbo);
+    }
+    free(_name);
 }
 
 char* RenderPass::get_name() {
     return _name;
 }
 
+unsigned short RenderPass::get_type() {
+    return _type;
+}
+
+bool RenderPass::has_name(char* name) {
+    return strcmp(_name, name) == 0;
+}
+
+float RenderPass::get_scale_x() {
+    return _scale_x;
+}
+
+float RenderPass::get_scale_y() {
+    return _scale_y;
+}
+
+/*
+ * Multiplies the initial size of the FBO by the given scale
+ * and fits it to the current window size.
+ */
+void RenderPass::set_resolution_scale(float scale) {
+    _scale_x = _base_scale_x * scale;
+    _scale_y = _base_scale_y * scale;
+
+    // parasite buffers can't be resized
+    if (_fbo == nullptr || !_fbo->is_of_type(GraphicsBuffer::get_class_type()))
+        return;
+
+    int fbo_width = std::max((int) (_win->get_x_size() * _scale_x), 1);
+    int fbo_height = std::max((int) (_win->get_y_size() * _scale_y), 1);
+    if (_fbo->get_x_size() != fbo_width || _fbo->get_y_size() != fbo_height)
+        DCAST(GraphicsBuffer, _fbo)->set_size(fbo_width, fbo_height);
+}
+
+/*
+ * Disabled pass doesn't render, its textures keep the last output.
+ */
+void RenderPass::set_enabled(bool enabled) {
+    _enabled = enabled;
+    _frame_count = 0;
+    _set_active(enabled);
+}
+
+bool RenderPass::is_enabled() {
+    return _enabled;
+}
+
+/*
+ * Renders the pass only every n-th frame.
+ */
+void RenderPass::set_update_interval(unsigned int interval) {
+    _update_interval = interval ? interval : 1;
+    _frame_count = 0;
+}
+
+unsigned int RenderPass::get_update_interval() {
+    return _update_interval;
+}
+
+/*
+ * Activates the pass in the frames it is rendered in,
+ * called by the pipeline once per frame.
+ */
+void RenderPass::update_active() {
+    _set_active(_enabled && _frame_count % _update_interval == 0);
+    _frame_count++;
+}
+
+void RenderPass::_set_active(bool active) {
+    if (_fbo != nullptr && _fbo->is_active() != active)
+        _fbo->set_active(active);
+}
+
 NodePath RenderPass::get_camera() {
     return _cam;
 }
 
+/*
+ * Sets mask of the objects rendered by this pass.
+ */
+void RenderPass::set_camera_mask(DrawMask mask) {
+    _camera_mask = mask;
+    ((Camera*) _cam.node())->set_camera_mask(mask);
+}
+
+DrawMask RenderPass::get_camera_mask() {
+    return _camera_mask;
+}
+
+PointerTo<DisplayRegion> RenderPass::get_display_region() {
+    return _region;
+}
+
+PointerTo<GraphicsOutput> RenderPass::get_fbo() {
+    return _fbo;
+}
+
 NodePath RenderPass::get_source_card() {
     return _source_card;
 }
 
+/*
+ * Makes the camera of the pass capture another card,
+ * e.g. when the previous pass is removed.
+ */
+void RenderPass::set_source_card(NodePath card) {
+    _source_card = card;
+    ((Camera*) _cam.node())->set_scene(card);
+}
+
 NodePath RenderPass::get_result_card() {
     return _result_card;
 }
@@ -49,6 +179,37 @@ unsigned int RenderPass::get_num_textures() {
     return _tex.size();
 }
 
+/*
+ * Returns texture of the given output, e.g. DEPTH_OUTPUT, or nullptr.
+ */
+PointerTo<Texture> RenderPass::get_output(unsigned short output) {
+    if (output >= NUM_RENDER_PASS_OUTPUTS)
+        return nullptr;
+    return _outputs[output];
+}
+
+/*
+ * Maps textures to the outputs by their names, "<pass name>_<suffix>".
+ */
+void RenderPass::update_outputs() {
+    size_t name_len = strlen(_name);
+    for (unsigned int i = 0; i < NUM_RENDER_PASS_OUTPUTS; i++) {
+        _outputs[i] = nullptr;
+        for (unsigned int j = 0; j < _tex.size(); j++) {
+            const std::string &tex_name = _tex[j]->get_name();
+            if (tex_name.size() > name_len + 1 &&
+                    tex_name.compare(name_len + 1, std::string::npos, OUTPUT_SUFFIXES[i]) == 0) {
+                _outputs[i] = _tex[j];
+                break;
+            }
+        }
+    }
+}
+
+void RenderPass::set_shader_input(const ShaderInput &input) {
+    get_source_card().set_shader_input(input);
+}
+
 void RenderPass::reload_shader() {
     if (get_source_card().is_empty())
         return;
@@ -57,6 +218,17 @@ void RenderPass::reload_shader() {
     if (shaderc == nullptr)
         return;
 
+    if (!shaderc->get_filename(Shader::ST_compute).empty()) {
+        Filename comp_path = shaderc->get_filename(Shader::ST_compute).get_fullpath();
+        Shader* shader = Shader::load_compute(Shader::SL_GLSL, comp_path);
+        if (shader == nullptr)
+            return;
+
+        get_source_card().clear_shader();
+        get_source_card().set_shader(shader, 100);
+        return;
+    }
+
     Filename vert_path = shaderc->get_filename(Shader::ST_vertex).get_fullpath();
     Filename frag_path = shaderc->get_filename(Shader::ST_fragment).get_fullpath();
 
@@ -91,8 +263,18 @@ PointerTo<GraphicsOutput> RenderPass::_make_fbo(
 
     fbp->set_aux_rgba(num_aux_textures);
 
-    int fbo_width = _scale_x == 1 ? 0 : win->get_x_size() * _scale_x;
-    int fbo_height = _scale_y == 1 ? 0 : win->get_y_size() * _scale_y;
+    PointerTo<GraphicsOutput> fbo = _make_fbo(win, fbp, has_alpha, sort);
+    delete fbp;
+    return fbo;
+}
+
+PointerTo<GraphicsOutput> RenderPass::_make_fbo(
+        PointerTo<GraphicsWindow> win, FrameBufferProperties* fbp,
+        bool has_alpha, unsigned short sort) {
+    // explicit size, so the FBO is not resized by the host window,
+    // it is resized by the pipeline instead
+    int fbo_width = std::max((int) (win->get_x_size() * _scale_x), 1);
+    int fbo_height = std::max((int) (win->get_y_size() * _scale_y), 1);
     PointerTo<GraphicsOutput> fbo = win->make_texture_buffer(
         _name, fbo_width, fbo_height, nullptr, false, fbp);
     fbo->clear_render_textures();
@@ -107,79 +289,45 @@ PointerTo<GraphicsOutput> RenderPass::_make_fbo(
 
     _result_card = fbo->get_texture_card();
     _result_card.set_name(card_name);
+    free(card_name);
 
     return fbo;
 }
 
+/*
+ * Makes a new texture named "<pass name>_<suffix>" and attaches it to the FBO.
+ */
+void RenderPass::_add_texture(
+        const char* suffix, Texture::Format format,
+        GraphicsOutput::RenderTexturePlane plane) {
+    char* tex_name = (char*) malloc((strlen(_name) + strlen(suffix) + 2) * sizeof(char));
+    sprintf(tex_name, "%s_%s", _name, suffix);
+
+    PointerTo<Texture> t = new Texture(tex_name);
+    free(tex_name);
+    t->set_format(format);
+    t->set_wrap_u(SamplerState::WM_clamp);
+    t->set_wrap_v(SamplerState::WM_clamp);
+    t->set_magfilter(SamplerState::FilterType::FT_linear);
+    t->set_minfilter(SamplerState::FilterType::FT_linear);
+    _fbo->add_render_texture(t, GraphicsOutput::RTM_bind_or_copy, plane);
+    _tex.push_back(t);
+}
+
 void RenderPass::_make_textures(
         bool has_color, bool has_depth, unsigned short num_aux_textures) {
-    if (has_color) {
-        char* tex_name = (char*) malloc((strlen(_name) + strlen("_color") + 1) * sizeof(char));
-        sprintf(tex_name, "%s_color", _name);
-
-        PointerTo<Texture> t = new Texture(tex_name);
-        t->set_format(Texture::Format::F_srgb_alpha);
-        t->set_wrap_u(SamplerState::WM_clamp);
-        t->set_wrap_v(SamplerState::WM_clamp);
-        t->set_magfilter(SamplerState::FilterType::FT_linear);
-        t->set_minfilter(SamplerState::FilterType::FT_linear);
-        _fbo->add_render_texture(t, GraphicsOutput::RTM_bind_or_copy, GraphicsOutput::RTP_color);
-        _tex.push_back(t);
-    }
+    if (has_color)
+        _add_texture("color", Texture::F_srgb_alpha, GraphicsOutput::RTP_color);
 
-    if (has_depth) {
-        char* tex_name = (char*) malloc((strlen(_name) + strlen("_depth") + 1) * sizeof(char));
-        sprintf(tex_name, "%s_depth", _name);
-
-        PointerTo<Texture> t = new Texture(tex_name);
-        t->set_format(Texture::Format::F_depth_component);
-        t->set_wrap_u(SamplerState::WM_clamp);
-        t->set_wrap_v(SamplerState::WM_clamp);
-        t->set_magfilter(SamplerState::FilterType::FT_linear);
-        t->set_minfilter(SamplerState::FilterType::FT_linear);
-        _fbo->add_render_texture(t, GraphicsOutput::RTM_bind_or_copy, GraphicsOutput::RTP_depth);
-        _tex.push_back(t);
-    }
+    if (has_depth)
+        _add_texture("depth", Texture::F_depth_component, GraphicsOutput::RTP_depth);
 
-    if (num_aux_textures >= 1) {
-        char* tex_name = (char*) malloc((strlen(_name) + strlen("_emissive") + 1) * sizeof(char));
-        sprintf(tex_name, "%s_emissive", _name);
-
-        PointerTo<Texture> t = new Texture(tex_name);
-        t->set_format(Texture::Format::F_srgb_alpha);
-        t->set_wrap_u(SamplerState::WM_clamp);
-        t->set_wrap_v(SamplerState::WM_clamp);
-        t->set_magfilter(SamplerState::FilterType::FT_linear);
-        t->set_minfilter(SamplerState::FilterType::FT_linear);
-        _fbo->add_render_texture(t, GraphicsOutput::RTM_bind_or_copy, GraphicsOutput::RTP_aux_rgba_0);
-        _tex.push_back(t);
-    }
+    if (num_aux_textures >= 1)
+        _add_texture("emissive", Texture::F_srgb_alpha, GraphicsOutput::RTP_aux_rgba_0);
 
-    if (num_aux_textures >= 2) {
-        char* tex_name = (char*) malloc((strlen(_name) + strlen("_normal") + 1) * sizeof(char));
-        sprintf(tex_name, "%s_normal", _name);
-
-        PointerTo<Texture> t = new Texture(tex_name);
-        t->set_format(Texture::Format::F_srgb_alpha);
-        t->set_wrap_u(SamplerState::WM_clamp);
-        t->set_wrap_v(SamplerState::WM_clamp);
-        t->set_magfilter(SamplerState::FilterType::FT_linear);
-        t->set_minfilter(SamplerState::FilterType::FT_linear);
-        _fbo->add_render_texture(t, GraphicsOutput::RTM_bind_or_copy, GraphicsOutput::RTP_aux_rgba_1);
-        _tex.push_back(t);
-    }
+    if (num_aux_textures >= 2)
+        _add_texture("normal", Texture::F_srgb_alpha, GraphicsOutput::RTP_aux_rgba_1);
 
-    if (num_aux_textures >= 3) {
-        char* tex_name = (char*) malloc((strlen(_name) + strlen("_selector") + 1) * sizeof(char));
-        sprintf(tex_name, "%s_selector", _name);
-
-        PointerTo<Texture> t = new Texture(tex_name);
-        t->set_format(Texture::Format::F_srgb_alpha);
-        t->set_wrap_u(SamplerState::WM_clamp);
-        t->set_wrap_v(SamplerState::WM_clamp);
-        t->set_magfilter(SamplerState::FilterType::FT_linear);
-        t->set_minfilter(SamplerState::FilterType::FT_linear);
-        _fbo->add_render_texture(t, GraphicsOutput::RTM_bind_or_copy, GraphicsOutput::RTP_aux_rgba_2);
-        _tex.push_back(t);
-    }
+    if (num_aux_textures >= 3)
+        _add_texture("selector", Texture::F_srgb_alpha, GraphicsOutput::RTP_aux_rgba_2);
 }
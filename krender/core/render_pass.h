@@ -1,9 +1,13 @@
 #ifndef CORE_RENDER_PASS_H
 #define CORE_RENDER_PASS_H
 
+#include "displayRegion.h"
+#include "frameBufferProperties.h"
 #include "graphicsOutput.h"
 #include "graphicsWindow.h"
+#include "drawMask.h"
 #include "nodePath.h"
+#include "shaderInput.h"
 #include "texture.h"
 #include "pvector.h"
 
@@ -11,10 +15,27 @@ BEGIN_PUBLISH
 enum RenderPassType {
     SCENE_PASS = 0,
     POST_PASS = 1,
-    DEPTH_PASS = 2
+    DEPTH_PASS = 2,
+    PYRAMID_PASS = 3,
+    DOF_PASS = 4,
+    LIGHTING_PASS = 5,
+    HIZ_PASS = 6,
+    COMPUTE_PASS = 7,
+    TEMPORAL_PASS = 8
+};
+
+enum RenderPassOutput {
+    COLOR_OUTPUT = 0,
+    DEPTH_OUTPUT = 1,
+    EMISSIVE_OUTPUT = 2,
+    NORMAL_OUTPUT = 3,
+    SELECTOR_OUTPUT = 4,
+    VELOCITY_OUTPUT = 5
 };
 END_PUBLISH
 
+#define NUM_RENDER_PASS_OUTPUTS 6
+
 
 class RenderPass {
 public:
@@ -23,29 +44,65 @@ public:
         bool has_srgb=false, bool has_alpha=false,
         float sx=1, float sy=1,
         NodePath card=NodePath::not_found());
+    virtual ~RenderPass();
     char* get_name();
+    unsigned short get_type();
+    virtual bool has_name(char* name);
+    float get_scale_x();
+    float get_scale_y();
+    virtual void set_resolution_scale(float scale);
+    void set_enabled(bool enabled);
+    bool is_enabled();
+    void set_update_interval(unsigned int interval);
+    unsigned int get_update_interval();
+    void update_active();
     NodePath get_camera();
+    virtual void set_camera_mask(DrawMask mask);
+    DrawMask get_camera_mask();
+    PointerTo<DisplayRegion> get_display_region();
+    PointerTo<GraphicsOutput> get_fbo();
     NodePath get_source_card();
+    void set_source_card(NodePath card);
     NodePath get_result_card();
     PointerTo<Texture> get_texture(unsigned int i);
     unsigned int get_num_textures();
+    PointerTo<Texture> get_output(unsigned short output);
+    void update_outputs();
+    virtual void set_shader_input(const ShaderInput &input);
     void reload_shader();
 
 protected:
     char* _name;
+    unsigned short _type;
     unsigned int _index;
+    GraphicsWindow* _win;
+    float _base_scale_x;
+    float _base_scale_y;
     float _scale_x;
     float _scale_y;
+    bool _enabled;
+    unsigned int _update_interval;
+    unsigned int _frame_count;
     PointerTo<GraphicsOutput> _fbo;
+    PointerTo<DisplayRegion> _region;
+    DrawMask _camera_mask;
     pvector<PointerTo<Texture>> _tex;
+    PointerTo<Texture> _outputs[NUM_RENDER_PASS_OUTPUTS];
     NodePath _cam;
     NodePath _source_card;
     NodePath _result_card;
 
+    virtual void _set_active(bool active);
     PointerTo<GraphicsOutput> _make_fbo(
         PointerTo<GraphicsWindow> win, bool has_srgb=false, bool has_alpha=false,
         bool has_color=true, bool has_depth=true,
         unsigned short num_aux_textures=1, unsigned short sort=0);
+    PointerTo<GraphicsOutput> _make_fbo(
+        PointerTo<GraphicsWindow> win, FrameBufferProperties* fbp,
+        bool has_alpha=false, unsigned short sort=0);
+    void _add_texture(
+        const char* suffix, Texture::Format format,
+        GraphicsOutput::RenderTexturePlane plane);
     void _make_textures(
         bool has_color=true, bool has_depth=true,
         unsigned short num_aux_textures=1);
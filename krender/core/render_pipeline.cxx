@@ -1,18 +1,37 @@
+#include <algorithm>
+#include <ctype.h>
+#include <sstream>
+#include <string.h>
+
 #include "camera.h"
+#include "clockObject.h"
+#include "config_putil.h"
 #include "pandaNode.h"
+#include "renderState.h"
+#include "shaderAttrib.h"
 #include "shaderInput.h"
 #include "texture.h"
+#include "virtualFileSystem.h"
 #include "windowProperties.h"
 
+#include "krender/core/compute_pass.h"
+#include "krender/core/cull_bin_krender.h"
 #include "krender/core/depth_pass.h"
+#include "krender/core/dof_pass.h"
 #include "krender/core/helpers.h"
+#include "krender/core/instance.h"
+#include "krender/core/lighting_pass.h"
 #include "krender/core/post_pass.h"
 #include "krender/core/render_pipeline.h"
 #include "krender/core/scene_pass.h"
+#include "krender/core/temporal_pass.h"
 
 
 TypeHandle RenderPipeline::_type_handle;
 
+// numbers the G-buffer includes of the pipelines
+static unsigned int num_gbuffer_includes = 0;
+
 RenderPipeline::RenderPipeline(
         GraphicsWindow* window, NodePath render2d, NodePath camera, NodePath camera2d,
         unsigned int index, unsigned int shadow_size,
@@ -21,46 +40,382 @@ RenderPipeline::RenderPipeline(
     _camera2d = camera2d;
     _render2d = render2d;
     _has_alpha = has_alpha;
+    _post_fusion = false;
     _index = index;
+    _sort = 0;
     _win_size = window->get_size();
+    _has_prev_view_proj = false;
+
+    std::ostringstream prefix;
+    prefix << GBUFFER_INC_PREFIX << num_gbuffer_includes++;
+    _gbuffer_prefix = prefix.str();
+    _configure_gbuffer();
 }
 
+RenderPipeline::~RenderPipeline() {
+    for (int i = _passes.size() - 1; i >= 0; i--) {
+        if (_passes[i] != NULL)
+            delete _passes[i];
+    }
+
+    VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+    if (vfs->exists(get_gbuffer_include()))
+        vfs->delete_file(get_gbuffer_include());
+}
+
+/*
+ * Adds a render pass, the call is recorded, so the pass is added again
+ * when the pipeline is rebuilt.
+ */
 void RenderPipeline::add_render_pass(
         char* name, unsigned short type, Shader* shader, BitMask32 mask, float sx, float sy) {
+    RenderPassSpec spec = RenderPassSpec();
+    spec.kind = RenderPassSpec::K_pass;
+    spec.name = name;
+    spec.type = type;
+    spec.shader = shader;
+    spec.mask = mask;
+    spec.sx = sx;
+    spec.sy = sy;
+    _specs.push_back(spec);
+
+    _add_render_pass(name, type, shader, mask, sx, sy);
+}
+
+void RenderPipeline::add_post_stage(
+        char* name, char* path, bool pointwise, float sx, float sy) {
+    RenderPassSpec spec = RenderPassSpec();
+    spec.kind = RenderPassSpec::K_post_stage;
+    spec.name = name;
+    spec.path = path;
+    spec.pointwise = pointwise;
+    spec.post_fusion = _post_fusion;
+    spec.sx = sx;
+    spec.sy = sy;
+    _specs.push_back(spec);
+
+    _add_post_stage(name, path, pointwise, sx, sy);
+}
+
+void RenderPipeline::add_pyramid_pass(
+        char* name, char* source, unsigned int num_levels, float threshold,
+        float sx, float sy) {
+    RenderPassSpec spec = RenderPassSpec();
+    spec.kind = RenderPassSpec::K_pyramid;
+    spec.name = name;
+    spec.source = source;
+    spec.num_levels = num_levels;
+    spec.threshold = threshold;
+    spec.sx = sx;
+    spec.sy = sy;
+    _specs.push_back(spec);
+
+    _add_pyramid_pass(name, source, num_levels, threshold, sx, sy);
+}
+
+void RenderPipeline::add_hiz_pass(
+        char* name, char* source, unsigned int num_levels, float sx, float sy) {
+    RenderPassSpec spec = RenderPassSpec();
+    spec.kind = RenderPassSpec::K_hiz;
+    spec.name = name;
+    spec.source = source;
+    spec.num_levels = num_levels;
+    spec.sx = sx;
+    spec.sy = sy;
+    _specs.push_back(spec);
+
+    _add_hiz_pass(name, source, num_levels, sx, sy);
+}
+
+/*
+ * Removes the render pass and releases its FBOs,
+ * the following post pass reads the color of the pass before it.
+ * Post stages fused into a single pass are removed together.
+ */
+void RenderPipeline::remove_render_pass(char* name) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return;
+
+    // forget the calls which added the pass and its stages
+    for (int i = _specs.size() - 1; i >= 0; i--) {
+        if (_find_render_pass((char*) _specs[i].name.c_str()) == render_pass)
+            _specs.erase(_specs.begin() + i);
+    }
+
+    _delete_render_pass(render_pass);
+    _rewire_prev_color();
+    if (_shared_cull != nullptr)
+        _update_shared_cull();
+}
+
+/*
+ * Deletes all render passes and adds them again, e.g. after
+ * the G-buffer layout is changed. The window, its GSG, the lights
+ * and the shadows are kept. Enabled state and update intervals
+ * of the passes are kept, shader inputs set by the application
+ * on the pass cards have to be set again.
+ */
+void RenderPipeline::rebuild() {
+    pvector<RenderPassSpec> specs = _specs;
+    std::unordered_map<std::string, std::pair<bool, unsigned int>> states;
+    for (unsigned int i = 0; i < specs.size(); i++) {
+        RenderPass* render_pass = _find_render_pass((char*) specs[i].name.c_str());
+        if (render_pass == NULL)
+            continue;
+        states[specs[i].name] = std::make_pair(render_pass->is_enabled(), render_pass->get_update_interval());
+        if (render_pass->get_type() == SCENE_PASS)
+            specs[i].depth_prepass = ((ScenePass*) render_pass)->has_depth_prepass();
+    }
+
+    for (int i = _passes.size() - 1; i >= 0; i--) {
+        if (_passes[i] != NULL)
+            _delete_render_pass(_passes[i]);
+    }
+    _passes.clear();
+    _pass_handles.clear();
+    _sort = 0;
+
+    bool post_fusion = _post_fusion;
+    for (unsigned int i = 0; i < specs.size(); i++) {
+        RenderPassSpec &spec = specs[i];
+        char* name = (char*) spec.name.c_str();
+        switch (spec.kind) {
+        case RenderPassSpec::K_pass:
+            _add_render_pass(name, spec.type, spec.shader, spec.mask, spec.sx, spec.sy);
+            break;
+        case RenderPassSpec::K_post_stage:
+            _post_fusion = spec.post_fusion;
+            _add_post_stage(name, (char*) spec.path.c_str(), spec.pointwise, spec.sx, spec.sy);
+            break;
+        case RenderPassSpec::K_pyramid:
+            _add_pyramid_pass(
+                name, (char*) spec.source.c_str(), spec.num_levels, spec.threshold,
+                spec.sx, spec.sy);
+            break;
+        case RenderPassSpec::K_hiz:
+            _add_hiz_pass(name, (char*) spec.source.c_str(), spec.num_levels, spec.sx, spec.sy);
+            break;
+        }
+        if (spec.depth_prepass)
+            set_depth_prepass(name);
+    }
+    _post_fusion = post_fusion;
+
+    for (unsigned int i = 0; i < specs.size(); i++) {
+        RenderPass* render_pass = _find_render_pass((char*) specs[i].name.c_str());
+        if (render_pass == NULL || states.count(specs[i].name) == 0)
+            continue;
+        render_pass->set_enabled(states[specs[i].name].first);
+        render_pass->set_update_interval(states[specs[i].name].second);
+    }
+    _rewire_prev_color();
+
+    if (_resolution_controller != nullptr)
+        _apply_resolution_scale(_resolution_controller->get_scale());
+}
+
+/*
+ * Removes the pass from the pass lists and the registry and deletes it.
+ */
+void RenderPipeline::_delete_render_pass(RenderPass* render_pass) {
+    // card the post pass after this one captures instead of this one,
+    // the source card of a post pass is the result card of the previous pass
+    NodePath card;
+    auto post_it = std::find(_post_passes.begin(), _post_passes.end(), render_pass);
+    if (post_it != _post_passes.end()) {
+        if (render_pass->get_type() == POST_PASS)
+            card = render_pass->get_source_card();
+        else if (post_it != _post_passes.begin())
+            card = (*(post_it - 1))->get_result_card();
+        else if (_scene_passes.size())
+            card = _scene_passes.back()->get_result_card();
+    }
+
+    pvector<RenderPass*>* lists[] = {&_scene_passes, &_post_passes};
+    for (int i = 0; i < 2; i++) {
+        auto it = std::find(lists[i]->begin(), lists[i]->end(), render_pass);
+        if (it != lists[i]->end())
+            lists[i]->erase(it);
+    }
+    auto pyramid_it = std::find(_pyramid_passes.begin(), _pyramid_passes.end(), render_pass);
+    if (pyramid_it != _pyramid_passes.end())
+        _pyramid_passes.erase(pyramid_it);
+    auto hiz_it = std::find(_hiz_passes.begin(), _hiz_passes.end(), render_pass);
+    if (hiz_it != _hiz_passes.end())
+        _hiz_passes.erase(hiz_it);
+
+    // handles of the other passes stay valid
+    auto handle_it = std::find(_passes.begin(), _passes.end(), render_pass);
+    if (handle_it != _passes.end()) {
+        int handle = handle_it - _passes.begin();
+        *handle_it = NULL;
+        for (auto it = _pass_handles.begin(); it != _pass_handles.end();) {
+            if (it->second == handle)
+                it = _pass_handles.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    // the post pass after this one captures the card of this pass,
+    // which carries its shader, move it to the card of the previous pass
+    if (!card.is_empty()) {
+        NodePath result_card = render_pass->get_result_card();
+        int slot = ShaderAttrib::get_class_slot();
+        if (render_pass->get_type() == POST_PASS)
+            card.clear_attrib(ShaderAttrib::get_class_type());
+
+        for (unsigned int i = 0; i < _post_passes.size(); i++) {
+            if (_post_passes[i]->get_type() != POST_PASS || _post_passes[i]->get_source_card() != result_card)
+                continue;
+            CPT(RenderState) state = result_card.get_state();
+            if (state->has_attrib(slot))
+                card.set_attrib(state->get_attrib(slot), state->get_override(slot));
+            _post_passes[i]->set_source_card(card);
+        }
+    }
+
+    delete render_pass;
+}
+
+void RenderPipeline::_add_render_pass(
+        char* name, unsigned short type, Shader* shader, BitMask32 mask, float sx, float sy) {
     RenderPass* render_pass;
 
     if (type == SCENE_PASS) {
         ScenePass* scene_pass = new ScenePass(
-            name, _scene_passes.size() + _index, _win, _camera,
-            _has_srgb, _has_alpha, sx, sy);
+            name, _index + _sort++, _win, _camera,
+            _has_srgb, _has_alpha, sx, sy,
+            NodePath::not_found(), _gbuffer_layout);
 
         // setup camera which which captures scene
         // and renders into FBO using default camera lens
         NodePath cam = scene_pass->get_camera();
         ((Camera*) cam.node())->set_scene(get_scene());
-        ((Camera*) cam.node())->set_camera_mask(mask);
+        scene_pass->set_camera_mask(mask);
 
         _scene_passes.push_back((RenderPass*) scene_pass);
+        _register_pass(scene_pass);
+        if (_shared_cull != nullptr)
+            _update_shared_cull();
 
         get_scene().set_shader_input("win_size", _win_size);
 
+        // nodes without TransformHistory have no motion of their own
+        get_scene().set_shader_input(ShaderInput("prev_model_delta", LMatrix4::zeros_mat()));
+
         // render_pass = (RenderPass*) scene_pass;
 
     } else if (type == DEPTH_PASS) {
         DepthPass* depth_pass = new DepthPass(
-            name, _scene_passes.size() + _index, _win, _camera,
+            name, _index + _sort++, _win, _camera,
             _has_srgb, _has_alpha, sx, sy);
 
         // setup camera which which captures scene
         // and renders into FBO using default camera lens
         NodePath cam = depth_pass->get_camera();
         ((Camera*) cam.node())->set_scene(get_scene());
-        ((Camera*) cam.node())->set_camera_mask(mask);
+        depth_pass->set_camera_mask(mask);
 
         _scene_passes.push_back((RenderPass*) depth_pass);
+        _register_pass(depth_pass);
+        if (_shared_cull != nullptr)
+            _update_shared_cull();
 
         // render_pass = (RenderPass*) depth_pass;
 
+    } else if (type == PYRAMID_PASS) {
+        _add_pyramid_pass(name, (char*) "prev_color", 4, 0, sx, sy);
+
+    } else if (type == HIZ_PASS) {
+        // built from the depth of the last scene or depth pass
+        for (int i = _scene_passes.size() - 1; i >= 0; i--) {
+            RenderPass* scene_pass = _scene_passes[i];
+            for (unsigned int j = 0; j < scene_pass->get_num_textures(); j++) {
+                std::string tex_name = scene_pass->get_texture(j)->get_name();
+                if (tex_name == std::string(scene_pass->get_name()) + "_depth") {
+                    _add_hiz_pass(name, (char*) tex_name.c_str(), 4, sx, sy);
+                    return;
+                }
+            }
+        }
+
+    } else if (type == DOF_PASS) {
+        DofPass* dof_pass = new DofPass(
+            name, _index + _sort, _win, _camera2d,
+            _has_srgb, _has_alpha, sx, sy);
+        _sort += dof_pass->get_num_subpasses();
+
+        _bind_inputs(dof_pass);
+        dof_pass->set_shader_input(ShaderInput("win_size", _win_size));
+
+        _post_passes.push_back((RenderPass*) dof_pass);
+        _register_pass(dof_pass);
+
+    } else if (type == LIGHTING_PASS) {
+        LightingPass* lighting_pass = new LightingPass(
+            name, _index + _sort++, _win, _camera2d,
+            _has_srgb, _has_alpha, sx, sy);
+
+        _bind_inputs(lighting_pass);
+
+        _bind_gbuffer_inputs(lighting_pass);
+
+        LightingPipeline::update_shader_inputs(lighting_pass->get_source_card());
+        lighting_pass->update_light_tiles(_light_data, _camera, get_scene());
+        lighting_pass->get_source_card().set_shader_input("win_size", _win_size);
+
+        if (shader == nullptr)
+            shader = load_shader(
+                Filename("krender/shader/post.vert.glsl"),
+                Filename("krender/shader/lighting.frag.glsl"));
+        if (shader != nullptr)
+            lighting_pass->get_source_card().set_shader(shader, 100);
+
+        _post_passes.push_back((RenderPass*) lighting_pass);
+        _register_pass(lighting_pass);
+
+    } else if (type == TEMPORAL_PASS) {
+        TemporalPass* temporal_pass = new TemporalPass(
+            name, _index + _sort++, _win, _camera2d,
+            _has_srgb, _has_alpha, sx, sy);
+
+        _bind_inputs(temporal_pass);
+        _bind_gbuffer_inputs(temporal_pass);
+        temporal_pass->get_source_card().set_shader_input("win_size", _win_size);
+
+        if (shader == nullptr)
+            shader = load_shader(
+                Filename("krender/shader/post.vert.glsl"),
+                Filename("krender/shader/temporal.frag.glsl"));
+        if (shader != nullptr)
+            temporal_pass->get_source_card().set_shader(shader, 100);
+
+        _post_passes.push_back((RenderPass*) temporal_pass);
+        _register_pass(temporal_pass);
+
+    } else if (type == COMPUTE_PASS) {
+        ComputePass* compute_pass = new ComputePass(
+            name, _index + _sort++, _win, _camera2d, sx, sy);
+
+        // textures of the previous passes are bound as samplers,
+        // the shader may declare them as images as well
+        _bind_inputs(compute_pass);
+
+        LightingPipeline::update_shader_inputs(compute_pass->get_source_card());
+        compute_pass->set_shader_input(ShaderInput("win_size", _win_size));
+
+        if (shader == nullptr)
+            shader = Shader::load_compute(
+                Shader::SL_GLSL,
+                Filename("krender/shader/compute.comp.glsl"));
+        if (shader != nullptr)
+            compute_pass->get_source_card().set_shader(shader, 100);
+
+        _post_passes.push_back((RenderPass*) compute_pass);
+        _register_pass(compute_pass);
+
     } else {  // POST_PASS
         // get plane from previous render pass
         NodePath prev_plane;
@@ -70,43 +425,15 @@ void RenderPipeline::add_render_pass(
             prev_plane = _scene_passes.back()->get_result_card();
 
         PostPass* post_pass = new PostPass(
-            name, _scene_passes.size() + _post_passes.size() + _index, _win, _camera2d,
+            name, _index + _sort++, _win, _camera2d,
             _has_srgb, _has_alpha, sx, sy, prev_plane);
 
-        // pass textures from the scene passes to the current render pass
-        for (unsigned int i = 0; i < _scene_passes.size(); i++) {
-            RenderPass* scene_pass = _scene_passes[i];
-            for (unsigned int j = 0; j < scene_pass->get_num_textures(); j++) {
-                PointerTo<Texture> t = scene_pass->get_texture(j);
-                post_pass->get_source_card().set_shader_input(ShaderInput(t->get_name(), t));
-            }
-        }
-
-        // pass textures from the previous post pass to the current render pass
-        RenderPass* prev_pass = NULL;
-        if (_post_passes.size()) {
-            prev_pass = _post_passes.back();
-        } else if (_scene_passes.size()) {
-            prev_pass = _scene_passes.back();
-        }
-        if (prev_pass != NULL) {
-            for (unsigned int j = 0; j < prev_pass->get_num_textures() && j < 1; j++) {
-                PointerTo<Texture> t = prev_pass->get_texture(j);
-
-                // substract post pass name from texture name
-                // const char* suffix = t->get_name().substr(
-                //     0, strlen(prev_pass->get_name()) + 1).c_str();
-                // char* name = (char*) malloc((
-                //     strlen("prev_") + strlen(suffix) + 1) * sizeof(char));
-                // sprintf(name, "prev_%s", suffix);
-                // post_pass->get_source_card().set_shader_input(ShaderInput(std::string(name), t));
-                post_pass->get_source_card().set_shader_input(ShaderInput(std::string("prev_color"), t));
-            }
-        }
+        _bind_inputs(post_pass);
 
         LightingPipeline::update_shader_inputs(post_pass->get_source_card());
 
         _post_passes.push_back((RenderPass*) post_pass);
+        _register_pass(post_pass);
 
         post_pass->get_source_card().set_shader_input("win_size", _win_size);
         if (shader != nullptr)
@@ -121,91 +448,817 @@ void RenderPipeline::add_render_pass(
     }
 }
 
-NodePath RenderPipeline::get_camera(char* name) {
+/*
+ * Sets formats of the targets of the scene passes added after this call,
+ * shaders loaded by load_shader() after this call use them too.
+ */
+void RenderPipeline::set_gbuffer_layout(const GBufferLayout &layout) {
+    _gbuffer_layout = layout;
+    _configure_gbuffer();
+}
+
+GBufferLayout RenderPipeline::get_gbuffer_layout() {
+    return _gbuffer_layout;
+}
+
+/*
+ * Returns name of the include with the G-buffer formats of this pipeline,
+ * each pipeline has its own one.
+ */
+std::string RenderPipeline::get_gbuffer_include() {
+    return _gbuffer_prefix + ".inc.glsl";
+}
+
+/*
+ * Loads the shader with the G-buffer formats of this pipeline,
+ * e.g. the scene shaders, which write the G-buffer.
+ * Shaders loaded by Shader.load() use the default formats.
+ */
+Shader* RenderPipeline::load_shader(const Filename &vert_path, const Filename &frag_path) {
+    Filename vert_variant = _make_shader_variant(vert_path);
+    Filename frag_variant = _make_shader_variant(frag_path);
+    if (vert_variant.empty() || frag_variant.empty())
+        return nullptr;
+    return Shader::load(Shader::SL_GLSL, vert_variant, frag_variant);
+}
+
+/*
+ * Writes G-buffer formats for the encode/decode helpers of the shaders.
+ */
+void RenderPipeline::_configure_gbuffer() {
+    VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+    if (vfs->exists(get_gbuffer_include()))
+        vfs->delete_file(get_gbuffer_include());
+    vfs->write_file(get_gbuffer_include(), _gbuffer_layout.get_defines(), false);
+}
+
+/*
+ * Copies the shader stage into the VFS with the G-buffer include
+ * of this pipeline after the #version line.
+ */
+Filename RenderPipeline::_make_shader_variant(const Filename &path) {
+    VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+    Filename resolved = path;
+    if (!vfs->resolve_filename(resolved, get_model_path()))
+        return Filename();
+
+    std::string source = vfs->read_file(resolved, true);
+    size_t begin = 0;
+    if (source.compare(0, strlen("#version"), "#version") == 0)
+        begin = source.find('\n') + 1;
+
+    std::string variant = _gbuffer_prefix + "." + path.get_basename();
+    if (vfs->exists(variant))
+        vfs->delete_file(variant);
+    vfs->write_file(
+        variant,
+        source.substr(0, begin) + "#pragma include \"" + get_gbuffer_include() + "\"\n" + source.substr(begin),
+        false);
+    return Filename(variant);
+}
+
+/*
+ * Enables depth prepass of the scene pass,
+ * which avoids overdraw of the expensive lit shaders.
+ */
+void RenderPipeline::set_depth_prepass(char* name, bool enabled) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL || render_pass->get_type() != SCENE_PASS)
+        return;
+
+    ((ScenePass*) render_pass)->set_depth_prepass(enabled);
+    if (_shared_cull != nullptr)
+        _update_shared_cull();
+}
+
+/*
+ * Culls the scene once per frame for all scene and depth passes,
+ * each pass draws the shared visible set filtered by its camera mask.
+ */
+void RenderPipeline::set_shared_cull(bool enabled) {
+    if (enabled == (_shared_cull != nullptr))
+        return;
+
+    _shared_cull = enabled ? new SharedCull() : nullptr;
+    _update_shared_cull();
+}
+
+/*
+ * Enables occlusion culling of the scene passes,
+ * occludees are culled from the main camera before each frame.
+ */
+void RenderPipeline::set_occlusion_culler(OcclusionCuller* culler) {
+    if (_occlusion_culler != nullptr)
+        _occlusion_culler->clear();
+    _occlusion_culler = culler;
+}
+
+OcclusionCuller* RenderPipeline::get_occlusion_culler() {
+    return _occlusion_culler;
+}
+
+/*
+ * Returns the number of shader, texture and material changes
+ * in the opaque bins of the previous frame, see "krender-state-sort".
+ */
+unsigned int RenderPipeline::get_num_state_changes() {
+    return CullBinKRender::get_num_state_changes();
+}
+
+/*
+ * Returns a key of the tag states the pipeline sets on the camera,
+ * empty for cameras without a tag state key.
+ */
+static std::string get_tag_states_key(Camera* cam) {
+    if (cam->get_tag_state_key().empty())
+        return "";
+
+    std::ostringstream key;
+    key << cam->get_tag_state_key();
+    if (cam->has_tag_state(INSTANCE_TAG_STATE))
+        key << " " << (const void*) cam->get_tag_state(INSTANCE_TAG_STATE).p();
+    return key.str();
+}
+
+/*
+ * Installs cull traversers of the scene and depth passes,
+ * default ones if the shared cull is disabled.
+ * Cameras of the shared passes use the union of the camera masks,
+ * so the single cull captures objects of all passes.
+ * Tag states are baked into the recorded states, so the passes sharing
+ * a cull must share the tag states too. Cameras are grouped by them,
+ * e.g. the depth prepass cameras share a cull of their own.
+ */
+void RenderPipeline::_update_shared_cull() {
+    _tag_shared_culls.clear();
+    DrawMask union_mask = DrawMask::all_off();
+    for (unsigned int i = 0; i < _scene_passes.size(); i++) {
+        union_mask |= _scene_passes[i]->get_camera_mask();
+    }
+
     for (unsigned int i = 0; i < _scene_passes.size(); i++) {
-        if (strcmp(_scene_passes[i]->get_name(), name) == 0) {
-            return _scene_passes[i]->get_camera();
+        RenderPass* render_pass = _scene_passes[i];
+        DrawMask pass_mask = render_pass->get_camera_mask();
+
+        pvector<NodePath> cams;
+        pvector<PointerTo<DisplayRegion>> regions;
+        cams.push_back(render_pass->get_camera());
+        regions.push_back(render_pass->get_display_region());
+        if (render_pass->get_type() == SCENE_PASS && ((ScenePass*) render_pass)->has_depth_prepass()) {
+            cams.push_back(((ScenePass*) render_pass)->get_prepass_camera());
+            regions.push_back(((ScenePass*) render_pass)->get_prepass_region());
+        }
+
+        // the prepass camera, if any, draws only opaque objects
+        for (unsigned int j = 0; j < cams.size(); j++) {
+            Camera* cam = (Camera*) cams[j].node();
+            bool is_prepass = j > 0;
+            if (_shared_cull != nullptr) {
+                SharedCull* shared_cull = _shared_cull;
+                std::string tag_states_key = get_tag_states_key(cam);
+                if (!tag_states_key.empty()) {
+                    if (_tag_shared_culls.count(tag_states_key) == 0)
+                        _tag_shared_culls[tag_states_key] = new SharedCull();
+                    shared_cull = _tag_shared_culls[tag_states_key];
+                }
+                cam->set_camera_mask(union_mask);
+                regions[j]->set_cull_traverser(new SharedCullTraverser(shared_cull, pass_mask, is_prepass));
+            } else {
+                cam->set_camera_mask(pass_mask);
+                if (is_prepass)
+                    regions[j]->set_cull_traverser(new OpaqueCullTraverser());
+                else
+                    regions[j]->set_cull_traverser(new CullTraverser());
+            }
         }
     }
+}
+
+/*
+ * Enables merging of consecutive post stages into a single full-screen pass.
+ * Affects post stages added after this call.
+ */
+void RenderPipeline::set_post_fusion(bool enabled) {
+    _post_fusion = enabled;
+}
+
+/*
+ * Adds a post stage which shader is generated by the pipeline.
+ * The stage file must define "vec4 process_<name>(vec4 color, vec2 uv)",
+ * which receives the color of the previous stage at the current pixel.
+ * Stages which read neighbours of prev_color must not be pointwise.
+ */
+void RenderPipeline::_add_post_stage(
+        char* name, char* path, bool pointwise, float sx, float sy) {
+    if (_post_fusion && pointwise && _post_passes.size()) {
+        PostPass* prev_pass = (PostPass*) _post_passes.back();
+        if (prev_pass->get_type() == POST_PASS && prev_pass->get_num_stages() &&
+                prev_pass->get_scale_x() == sx && prev_pass->get_scale_y() == sy) {
+            prev_pass->add_stage(name, path, pointwise);
+            _pass_handles.emplace(name, _pass_handles[prev_pass->get_name()]);
+            _make_post_shader(prev_pass);
+            return;
+        }
+    }
+
+    _add_render_pass(name, POST_PASS, nullptr, BitMask32(0), sx, sy);
+    PostPass* post_pass = (PostPass*) _post_passes.back();
+    post_pass->add_stage(name, path, pointwise);
+    _make_post_shader(post_pass);
+}
+
+/*
+ * Returns the list of post passes and the stages they are made of.
+ */
+std::string RenderPipeline::get_fusion_report() {
+    std::ostringstream report;
     for (unsigned int i = 0; i < _post_passes.size(); i++) {
-        if (strcmp(_post_passes[i]->get_name(), name) == 0) {
-            return _post_passes[i]->get_camera();
+        if (_post_passes[i]->get_type() != POST_PASS) {
+            report << _post_passes[i]->get_name() << ": built-in\n";
+            continue;
+        }
+
+        PostPass* post_pass = (PostPass*) _post_passes[i];
+        report << post_pass->get_name() << ":";
+        if (post_pass->get_num_stages() == 0)
+            report << " custom shader";
+        for (unsigned int j = 0; j < post_pass->get_num_stages(); j++) {
+            report << (j ? " + " : " ") << post_pass->get_stage(j).name;
         }
+        if (post_pass->get_num_stages() > 1)
+            report << " (fused)";
+        report << "\n";
     }
-    return NodePath::not_found();
+    return report.str();
 }
 
-NodePath RenderPipeline::get_source_card(char* name) {
+/*
+ * Adds a blur pyramid of the given texture,
+ * "prev_color" stands for the color of the last render pass.
+ * The result is passed to the following post passes as "<name>_color".
+ */
+void RenderPipeline::_add_pyramid_pass(
+        char* name, char* source, unsigned int num_levels, float threshold,
+        float sx, float sy) {
+    PointerTo<Texture> source_tex = _find_texture(source);
+    if (source_tex == nullptr)
+        return;
+
+    PyramidPass* pyramid_pass = new PyramidPass(
+        name, _index + _sort, _win, _camera2d,
+        source_tex, num_levels, threshold,
+        _has_srgb, _has_alpha, sx, sy);
+    _sort += pyramid_pass->get_num_subpasses();
+
+    _pyramid_passes.push_back(pyramid_pass);
+    _register_pass(pyramid_pass);
+}
+
+/*
+ * Adds a farthest depth pyramid of the given depth texture.
+ * If the occlusion culler is set, its coarsest level of the previous frame
+ * is used to cull the occludees instead of the occluders.
+ */
+void RenderPipeline::_add_hiz_pass(
+        char* name, char* source, unsigned int num_levels, float sx, float sy) {
+    PointerTo<Texture> source_tex = _find_texture(source);
+    if (source_tex == nullptr)
+        return;
+
+    HiZPass* hiz_pass = new HiZPass(
+        name, _index + _sort, _win, _camera2d,
+        source_tex, num_levels, sx, sy);
+    _sort += hiz_pass->get_num_subpasses();
+
+    _hiz_passes.push_back(hiz_pass);
+    _register_pass(hiz_pass);
+}
+
+/*
+ * Generates fragment shader, which calls all stages of the post pass in order,
+ * and binds it to the post pass.
+ */
+void RenderPipeline::_make_post_shader(PostPass* post_pass) {
+    std::ostringstream code;
+    code << "#version 140\n";
+    code << "// generated by krender for the post pass " << post_pass->get_name() << "\n\n";
+
+    // union of the inputs of all stages
+    code << "uniform ivec2 win_size;\n";
+    code << "uniform sampler2D prev_color;\n";
     for (unsigned int i = 0; i < _scene_passes.size(); i++) {
-        if (strcmp(_scene_passes[i]->get_name(), name) == 0) {
-            return _scene_passes[i]->get_source_card();
+        RenderPass* scene_pass = _scene_passes[i];
+        for (unsigned int j = 0; j < scene_pass->get_num_textures(); j++) {
+            code << "uniform sampler2D " << scene_pass->get_texture(j)->get_name() << ";\n";
         }
     }
-    for (unsigned int i = 0; i < _post_passes.size(); i++) {
-        if (strcmp(_post_passes[i]->get_name(), name) == 0) {
-            return _post_passes[i]->get_source_card();
-        }
+
+    // blur pyramids are named after their sources,
+    // e.g. BASE_EMISSIVE_PYRAMID or PREV_COLOR_PYRAMID
+    PointerTo<Texture> prev_tex = post_pass->get_source_card().get_shader_input("prev_color").get_texture();
+    for (unsigned int i = 0; i < _pyramid_passes.size(); i++) {
+        PyramidPass* pyramid_pass = _pyramid_passes[i];
+        std::string tex_name = pyramid_pass->get_texture(0)->get_name();
+        code << "uniform sampler2D " << tex_name << ";\n";
+
+        std::string source_name = pyramid_pass->get_source()->get_name();
+        for (size_t j = 0; j < source_name.size(); j++)
+            source_name[j] = toupper(source_name[j]);
+        code << "#define " << source_name << "_PYRAMID " << tex_name << "\n";
+        if (pyramid_pass->get_source() == prev_tex)
+            code << "#define PREV_COLOR_PYRAMID " << tex_name << "\n";
     }
-    return NodePath::not_found();
+    code << "\nin vec2 vert_uv;\n";
+    code << "out vec4 color;\n\n";
+
+    for (unsigned int i = 0; i < post_pass->get_num_stages(); i++) {
+        code << "#pragma include \"" << post_pass->get_stage(i).path << "\"\n";
+    }
+
+    code << "\nvoid main() {\n";
+    code << "    color = texture(prev_color, vert_uv);\n";
+    for (unsigned int i = 0; i < post_pass->get_num_stages(); i++) {
+        code << "    color = process_" << post_pass->get_stage(i).name << "(color, vert_uv);\n";
+    }
+    code << "}\n";
+
+    char* frag_path = (char*) malloc((
+        strlen(".krender_") + strlen(post_pass->get_name()) + strlen(".frag.glsl") + 1) * sizeof(char));
+    sprintf(frag_path, ".krender_%s.frag.glsl", post_pass->get_name());
+
+    VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+    if (vfs->exists(frag_path))
+        vfs->delete_file(frag_path);
+    vfs->write_file(frag_path, code.str(), false);
+
+    Shader* shader = Shader::load(
+        Shader::SL_GLSL,
+        Filename("krender/shader/post.vert.glsl"),
+        Filename(frag_path));
+    free(frag_path);
+
+    post_pass->get_source_card().clear_shader();
+    if (shader != nullptr)
+        post_pass->get_source_card().set_shader(shader, 100);
 }
 
-NodePath RenderPipeline::get_result_card(char* name) {
+/*
+ * Passes textures of the scene passes, blur pyramids
+ * and the color of the previous pass to the post pass.
+ */
+void RenderPipeline::_bind_inputs(RenderPass* render_pass) {
+    // pass textures from the scene passes to the current render pass
     for (unsigned int i = 0; i < _scene_passes.size(); i++) {
-        if (strcmp(_scene_passes[i]->get_name(), name) == 0) {
-            return _scene_passes[i]->get_result_card();
+        RenderPass* scene_pass = _scene_passes[i];
+        for (unsigned int j = 0; j < scene_pass->get_num_textures(); j++) {
+            PointerTo<Texture> t = scene_pass->get_texture(j);
+            render_pass->set_shader_input(ShaderInput(t->get_name(), t));
         }
     }
-    for (unsigned int i = 0; i < _post_passes.size(); i++) {
-        if (strcmp(_post_passes[i]->get_name(), name) == 0) {
-            return _post_passes[i]->get_result_card();
+
+    // pass blur pyramids to the current render pass
+    for (unsigned int i = 0; i < _pyramid_passes.size(); i++) {
+        PointerTo<Texture> t = _pyramid_passes[i]->get_texture(0);
+        render_pass->set_shader_input(ShaderInput(t->get_name(), t));
+    }
+
+    // pass depth pyramids to the current render pass
+    for (unsigned int i = 0; i < _hiz_passes.size(); i++) {
+        PointerTo<Texture> t = _hiz_passes[i]->get_texture(0);
+        render_pass->set_shader_input(ShaderInput(t->get_name(), t));
+    }
+
+    // pass textures from the previous post pass to the current render pass
+    PointerTo<Texture> t = _find_texture((char*) "prev_color");
+    if (t != nullptr)
+        render_pass->set_shader_input(ShaderInput(std::string("prev_color"), t));
+}
+
+/*
+ * Passes G-buffer of the last scene pass under the names
+ * expected by the shader, e.g. base_normal -> gbuffer_normal.
+ */
+void RenderPipeline::_bind_gbuffer_inputs(RenderPass* render_pass) {
+    for (int i = _scene_passes.size() - 1; i >= 0; i--) {
+        RenderPass* scene_pass = _scene_passes[i];
+        if (scene_pass->get_type() != SCENE_PASS)
+            continue;
+        for (unsigned int j = 0; j < scene_pass->get_num_textures(); j++) {
+            PointerTo<Texture> t = scene_pass->get_texture(j);
+            std::string suffix = t->get_name().substr(strlen(scene_pass->get_name()) + 1);
+            render_pass->set_shader_input(ShaderInput("gbuffer_" + suffix, t));
         }
+        break;
     }
-    return NodePath::not_found();
 }
 
-PointerTo<Texture> RenderPipeline::get_texture(char* name, unsigned int j) {
+/*
+ * Adds the pass to the registry, its handle is the registration order.
+ */
+void RenderPipeline::_register_pass(RenderPass* render_pass) {
+    render_pass->update_outputs();
+    _pass_handles.emplace(render_pass->get_name(), _passes.size());
+    _passes.push_back(render_pass);
+}
+
+/*
+ * Finds render pass by its name or by the name of one of its post stages.
+ */
+RenderPass* RenderPipeline::_find_render_pass(char* name) {
+    auto it = _pass_handles.find(name);
+    if (it == _pass_handles.end())
+        return NULL;
+    return _passes[it->second];
+}
+
+/*
+ * Returns handle of the pass named by its name or a name of its stage,
+ * -1 if there is no such pass. Handles don't change,
+ * so they can be kept instead of the names.
+ */
+int RenderPipeline::get_pass_handle(char* name) {
+    auto it = _pass_handles.find(name);
+    if (it == _pass_handles.end())
+        return -1;
+    return it->second;
+}
+
+unsigned int RenderPipeline::get_num_passes() {
+    return _passes.size();
+}
+
+char* RenderPipeline::get_pass_name(int handle) {
+    if (handle < 0 || handle >= (int) _passes.size() || _passes[handle] == NULL)
+        return NULL;
+    return _passes[handle]->get_name();
+}
+
+unsigned short RenderPipeline::get_pass_type(int handle) {
+    if (handle < 0 || handle >= (int) _passes.size() || _passes[handle] == NULL)
+        return 0;
+    return _passes[handle]->get_type();
+}
+
+/*
+ * Returns the number of passes, which outputs are read by the pass.
+ */
+unsigned int RenderPipeline::get_num_pass_inputs(int handle) {
+    return _find_pass_inputs(handle).size();
+}
+
+int RenderPipeline::get_pass_input(int handle, unsigned int i) {
+    pvector<int> inputs = _find_pass_inputs(handle);
+    if (i >= inputs.size())
+        return -1;
+    return inputs[i];
+}
+
+/*
+ * Returns texture of the given output, e.g. DEPTH_OUTPUT, or nullptr.
+ */
+PointerTo<Texture> RenderPipeline::get_output(int handle, unsigned short output) {
+    if (handle < 0 || handle >= (int) _passes.size() || _passes[handle] == NULL)
+        return nullptr;
+    return _passes[handle]->get_output(output);
+}
+
+PointerTo<Texture> RenderPipeline::get_output(char* name, unsigned short output) {
+    return get_output(get_pass_handle(name), output);
+}
+
+/*
+ * Finds passes, which textures are bound to the pass.
+ * Blur and depth pyramids read only their sources.
+ */
+pvector<int> RenderPipeline::_find_pass_inputs(int handle) {
+    pvector<int> inputs;
+    if (handle < 0 || handle >= (int) _passes.size() || _passes[handle] == NULL)
+        return inputs;
+
+    RenderPass* render_pass = _passes[handle];
+    NodePath card = render_pass->get_source_card();
+    PointerTo<Texture> prev_tex;
+    if (!card.is_empty()) {
+        ShaderInput prev_input = card.get_shader_input("prev_color");
+        if (prev_input.get_value_type() == ShaderInput::M_texture)
+            prev_tex = prev_input.get_texture();
+    }
+
+    for (unsigned int i = 0; i < _passes.size(); i++) {
+        if ((int) i == handle || _passes[i] == NULL)
+            continue;
+
+        for (unsigned int j = 0; j < _passes[i]->get_num_textures(); j++) {
+            PointerTo<Texture> t = _passes[i]->get_texture(j);
+            bool is_bound;
+            if (render_pass->get_type() == PYRAMID_PASS)
+                is_bound = ((PyramidPass*) render_pass)->get_source() == t;
+            else if (render_pass->get_type() == HIZ_PASS)
+                is_bound = ((HiZPass*) render_pass)->get_source() == t;
+            else if (card.is_empty())
+                is_bound = false;
+            else {
+                ShaderInput input = card.get_shader_input(t->get_name());
+                is_bound = t == prev_tex || (
+                    input.get_value_type() == ShaderInput::M_texture && input.get_texture() == t);
+            }
+
+            if (is_bound) {
+                inputs.push_back(i);
+                break;
+            }
+        }
+    }
+    return inputs;
+}
+
+/*
+ * Finds output texture of the scene passes and blur pyramids by its name,
+ * "prev_color" stands for the color of the last render pass.
+ */
+PointerTo<Texture> RenderPipeline::_find_texture(char* name) {
+    if (strcmp(name, "prev_color") == 0)
+        return _find_prev_color(_post_passes.size());
     for (unsigned int i = 0; i < _scene_passes.size(); i++) {
-        if (strcmp(_scene_passes[i]->get_name(), name) == 0) {
-            return _scene_passes[i]->get_texture(j);
+        RenderPass* scene_pass = _scene_passes[i];
+        for (unsigned int j = 0; j < scene_pass->get_num_textures(); j++) {
+            if (scene_pass->get_texture(j)->get_name() == name)
+                return scene_pass->get_texture(j);
         }
     }
+    for (unsigned int i = 0; i < _pyramid_passes.size(); i++) {
+        if (_pyramid_passes[i]->get_texture(0)->get_name() == name)
+            return _pyramid_passes[i]->get_texture(0);
+    }
+    for (unsigned int i = 0; i < _hiz_passes.size(); i++) {
+        if (_hiz_passes[i]->get_texture(0)->get_name() == name)
+            return _hiz_passes[i]->get_texture(0);
+    }
+    return nullptr;
+}
+
+/*
+ * Enables or disables the pass, the following post passes
+ * receive "prev_color" of the last enabled pass before them.
+ * Post stages fused into a single pass are switched together.
+ */
+void RenderPipeline::set_pass_enabled(char* name, bool enabled) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL || render_pass->is_enabled() == enabled)
+        return;
+
+    render_pass->set_enabled(enabled);
+    _rewire_prev_color();
+}
+
+/*
+ * Passes the color of the last enabled pass before each post pass
+ * as its "prev_color".
+ */
+void RenderPipeline::_rewire_prev_color() {
     for (unsigned int i = 0; i < _post_passes.size(); i++) {
-        if (strcmp(_post_passes[i]->get_name(), name) == 0) {
-            return _post_passes[i]->get_texture(j);
-        }
+        PointerTo<Texture> t = _find_prev_color(i);
+        if (t != nullptr)
+            _post_passes[i]->set_shader_input(ShaderInput(std::string("prev_color"), t));
+    }
+}
+
+bool RenderPipeline::is_pass_enabled(char* name) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return false;
+    return render_pass->is_enabled();
+}
+
+/*
+ * Renders the pass only every n-th frame,
+ * the other frames reuse its last output.
+ */
+void RenderPipeline::set_pass_update_interval(char* name, unsigned int interval) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return;
+    render_pass->set_update_interval(interval);
+}
+
+unsigned int RenderPipeline::get_pass_update_interval(char* name) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return 0;
+    return render_pass->get_update_interval();
+}
+
+/*
+ * Finds color of the last enabled post pass before the i-th one,
+ * or the color of the last scene pass.
+ */
+PointerTo<Texture> RenderPipeline::_find_prev_color(unsigned int i) {
+    for (int j = (int) i - 1; j >= 0; j--) {
+        if (_post_passes[j]->is_enabled())
+            return _post_passes[j]->get_texture(0);
     }
-    return NULL;
+    if (_scene_passes.size())
+        return _scene_passes.back()->get_texture(0);
+    return nullptr;
+}
+
+NodePath RenderPipeline::get_camera(char* name) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return NodePath::not_found();
+    return render_pass->get_camera();
+}
+
+NodePath RenderPipeline::get_source_card(char* name) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return NodePath::not_found();
+    return render_pass->get_source_card();
+}
+
+NodePath RenderPipeline::get_result_card(char* name) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return NodePath::not_found();
+    return render_pass->get_result_card();
+}
+
+PointerTo<Texture> RenderPipeline::get_texture(char* name, unsigned int j) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return NULL;
+    return render_pass->get_texture(j);
 }
 
 unsigned int RenderPipeline::get_num_textures(char* name) {
+    RenderPass* render_pass = _find_render_pass(name);
+    if (render_pass == NULL)
+        return 0;
+    return render_pass->get_num_textures();
+}
+
+/*
+ * Enables dynamic resolution, the scale picked by the controller
+ * is applied to the scene passes and all post passes except the last one,
+ * which upscales the result to the window size.
+ */
+void RenderPipeline::set_resolution_controller(ResolutionController* controller) {
+    _resolution_controller = controller;
+    _apply_resolution_scale(controller == nullptr ? 1 : controller->get_scale());
+}
+
+ResolutionController* RenderPipeline::get_resolution_controller() {
+    return _resolution_controller;
+}
+
+/*
+ * Binds prev_model_delta to the nodes of the history in each update.
+ */
+void RenderPipeline::set_transform_history(TransformHistory* history) {
+    if (_transform_history != nullptr)
+        _transform_history->clear();
+    _transform_history = history;
+}
+
+TransformHistory* RenderPipeline::get_transform_history() {
+    return _transform_history;
+}
+
+void RenderPipeline::_apply_resolution_scale(float scale) {
     for (unsigned int i = 0; i < _scene_passes.size(); i++) {
-        if (strcmp(_scene_passes[i]->get_name(), name) == 0) {
-            return _scene_passes[i]->get_num_textures();
-        }
+        _scene_passes[i]->set_resolution_scale(scale);
+    }
+    for (unsigned int i = 0; i < _pyramid_passes.size(); i++) {
+        _pyramid_passes[i]->set_resolution_scale(scale);
+    }
+    for (unsigned int i = 0; i < _hiz_passes.size(); i++) {
+        _hiz_passes[i]->set_resolution_scale(scale);
     }
+
+    // temporal passes upsample to the full resolution
+    bool is_upsampled = false;
     for (unsigned int i = 0; i < _post_passes.size(); i++) {
-        if (strcmp(_post_passes[i]->get_name(), name) == 0) {
-            return _post_passes[i]->get_num_textures();
-        }
+        if (_post_passes[i]->get_type() == TEMPORAL_PASS)
+            is_upsampled = true;
+        if (is_upsampled || i + 1 == _post_passes.size())
+            _post_passes[i]->set_resolution_scale(1);
+        else
+            _post_passes[i]->set_resolution_scale(scale);
     }
-    return 0;
+}
+
+/*
+ * Jitters the lens for the first enabled temporal pass
+ * and binds the view projection matrices of the velocity target.
+ */
+void RenderPipeline::_update_velocity() {
+    Lens* lens = ((Camera*) _camera.node())->get_lens();
+    TemporalPass* jittered_pass = nullptr;
+    for (unsigned int i = 0; i < _post_passes.size(); i++) {
+        if (_post_passes[i]->get_type() != TEMPORAL_PASS)
+            continue;
+        TemporalPass* temporal_pass = (TemporalPass*) _post_passes[i];
+        temporal_pass->clear_jitter();
+        if (jittered_pass == nullptr && temporal_pass->is_enabled())
+            jittered_pass = temporal_pass;
+    }
+
+    LMatrix4 view_proj = get_scene().get_mat(_camera) * lens->get_projection_mat();
+    if (_gbuffer_layout.get_velocity_format() != GBUFFER_NONE) {
+        get_scene().set_shader_input(ShaderInput("view_proj", view_proj));
+        get_scene().set_shader_input(ShaderInput(
+            "prev_view_proj", _has_prev_view_proj ? _prev_view_proj : view_proj));
+    }
+    _prev_view_proj = view_proj;
+    _has_prev_view_proj = true;
+
+    if (jittered_pass != nullptr && _scene_passes.size())
+        jittered_pass->update(lens, _scene_passes.back()->get_fbo()->get_size());
 }
 
 void RenderPipeline::update() {
+    float scale = _resolution_controller == nullptr ? 1 : _resolution_controller->get_scale();
+
+    if (_resolution_controller != nullptr) {
+        // CPU frame time, GPU timer queries are not exposed by Panda3D
+        if (!_resolution_controller->is_deterministic())
+            _resolution_controller->add_frame_time(ClockObject::get_global_clock()->get_dt());
+        if (_resolution_controller->update()) {
+            scale = _resolution_controller->get_scale();
+            _apply_resolution_scale(scale);
+        }
+    }
+
     if (_win_size.get_x() != _win->get_x_size() || _win_size.get_y() != _win->get_y_size()) {
         _win_size = _win->get_size();
+        _apply_resolution_scale(scale);
         _configure();
         for (unsigned int i = 0; i < _post_passes.size(); i++) {
             _post_passes[i]->get_source_card().set_shader_input("win_size", _win_size);
             _post_passes[i]->reload_shader();
         }
         get_scene().set_shader_input("win_size", _win_size);
+        for (unsigned int i = 0; i < _post_passes.size(); i++) {
+            if (_post_passes[i]->get_type() == TEMPORAL_PASS)
+                ((TemporalPass*) _post_passes[i])->reset_history();
+        }
+    }
+
+    // passes rendered in this frame
+    for (unsigned int i = 0; i < _scene_passes.size(); i++) {
+        _scene_passes[i]->update_active();
+    }
+    for (unsigned int i = 0; i < _pyramid_passes.size(); i++) {
+        _pyramid_passes[i]->update_active();
     }
+    for (unsigned int i = 0; i < _hiz_passes.size(); i++) {
+        _hiz_passes[i]->update_active();
+    }
+    for (unsigned int i = 0; i < _post_passes.size(); i++) {
+        _post_passes[i]->update_active();
+    }
+
+    if (_occlusion_culler != nullptr) {
+        DrawMask mask = DrawMask::all_off();
+        for (unsigned int i = 0; i < _scene_passes.size(); i++) {
+            mask |= _scene_passes[i]->get_camera_mask();
+        }
+
+        if (_hiz_passes.size()) {
+            // depth of the previous frame, read back after it was rendered,
+            // the copy of this frame is used by the next one
+            HiZPass* hiz_pass = _hiz_passes.front();
+            if (hiz_pass->has_readback())
+                _occlusion_culler->cull_depth(
+                    get_scene(), mask,
+                    hiz_pass->get_readback(), hiz_pass->get_readback_view_proj());
+            hiz_pass->clear_readback();
+
+            Lens* lens = ((Camera*) _camera.node())->get_lens();
+            hiz_pass->request_readback(get_scene().get_mat(_camera) * lens->get_projection_mat());
+        } else {
+            _occlusion_culler->cull(_camera, get_scene(), mask);
+        }
+    }
+
+    if (_transform_history != nullptr)
+        _transform_history->update(get_scene());
 
     LightingPipeline::update();
+    _update_velocity();
+
+    LMatrix4 inv_proj_mat;
+    inv_proj_mat.invert_from(((Camera*) _camera.node())->get_lens()->get_projection_mat());
+    LMatrix4 inv_view_proj = inv_proj_mat * _camera.get_mat(get_scene());
 
     for (unsigned int i = 0; i < _post_passes.size(); i++) {
         NodePath card = _post_passes[i]->get_source_card();
         LightingPipeline::update_shader_inputs(card);
+
+        if (_post_passes[i]->get_type() == LIGHTING_PASS) {
+            LightingPass* lighting_pass = (LightingPass*) _post_passes[i];
+            lighting_pass->update_light_tiles(_light_data, _camera, get_scene());
+            card.set_shader_input(ShaderInput("inv_view_proj", inv_view_proj));
+        }
     }
 }
@@ -1,6 +1,9 @@
 #ifndef CORE_RENDER_PIPELINE_H
 #define CORE_RENDER_PIPELINE_H
 
+#include <string>
+#include <unordered_map>
+
 #include "bitMask.h"
 #include "graphicsWindow.h"
 #include "nodePath.h"
@@ -8,8 +11,45 @@
 #include "pvector.h"
 #include "typedWritableReferenceCount.h"
 
-#include "krender/core/render_pass.h"
+#include "krender/core/gbuffer_layout.h"
+#include "krender/core/hiz_pass.h"
 #include "krender/core/lighting_pipeline.h"
+#include "krender/core/occlusion_culler.h"
+#include "krender/core/post_pass.h"
+#include "krender/core/pyramid_pass.h"
+#include "krender/core/render_pass.h"
+#include "krender/core/resolution_controller.h"
+#include "krender/core/shared_cull.h"
+#include "krender/core/transform_history.h"
+
+
+/*
+ * Arguments of a call, which added a render pass,
+ * replayed when the pipeline is rebuilt.
+ */
+struct RenderPassSpec {
+    enum Kind {
+        K_pass,
+        K_post_stage,
+        K_pyramid,
+        K_hiz
+    };
+
+    Kind kind;
+    std::string name;
+    unsigned short type;
+    PointerTo<Shader> shader;
+    BitMask32 mask;
+    float sx;
+    float sy;
+    std::string source;  // pyramids
+    unsigned int num_levels;
+    float threshold;
+    std::string path;  // post stages
+    bool pointwise;
+    bool post_fusion;
+    bool depth_prepass;  // scene passes
+};
 
 
 class EXPORT_CLASS RenderPipeline: public LightingPipeline {
@@ -18,28 +58,107 @@ PUBLISHED:
         GraphicsWindow* window, NodePath render2d, NodePath camera, NodePath camera2d,
         unsigned int index=0, unsigned int shadow_size=512,
         bool has_srgb=false, bool has_pcf=false, bool has_alpha=false);
+    virtual ~RenderPipeline();
     void add_render_pass(
         char* name, unsigned short type,
         Shader* shader=nullptr, BitMask32 mask=BitMask32(0),
         float sx=1, float sy=1);
+    void remove_render_pass(char* name);
+    void rebuild();
+    void set_gbuffer_layout(const GBufferLayout &layout);
+    GBufferLayout get_gbuffer_layout();
+    std::string get_gbuffer_include();
+    Shader* load_shader(const Filename &vert_path, const Filename &frag_path);
+    void set_depth_prepass(char* name, bool enabled=true);
+    void set_shared_cull(bool enabled);
+    void set_occlusion_culler(OcclusionCuller* culler);
+    OcclusionCuller* get_occlusion_culler();
+    unsigned int get_num_state_changes();
+    void set_post_fusion(bool enabled);
+    void add_post_stage(
+        char* name, char* path, bool pointwise=true,
+        float sx=1, float sy=1);
+    std::string get_fusion_report();
+    void add_pyramid_pass(
+        char* name, char* source, unsigned int num_levels=4, float threshold=0,
+        float sx=0.5, float sy=0.5);
+    void add_hiz_pass(
+        char* name, char* source, unsigned int num_levels=4,
+        float sx=0.5, float sy=0.5);
+    void set_pass_enabled(char* name, bool enabled);
+    bool is_pass_enabled(char* name);
+    void set_pass_update_interval(char* name, unsigned int interval);
+    unsigned int get_pass_update_interval(char* name);
+    int get_pass_handle(char* name);
+    unsigned int get_num_passes();
+    char* get_pass_name(int handle);
+    unsigned short get_pass_type(int handle);
+    unsigned int get_num_pass_inputs(int handle);
+    int get_pass_input(int handle, unsigned int i);
+    PointerTo<Texture> get_output(int handle, unsigned short output);
+    PointerTo<Texture> get_output(char* name, unsigned short output);
     NodePath get_camera(char* name);
     NodePath get_source_card(char* name);
     NodePath get_result_card(char* name);
     PointerTo<Texture> get_texture(char* name, unsigned int i);
     unsigned int get_num_textures(char* name);
+    void set_resolution_controller(ResolutionController* controller);
+    ResolutionController* get_resolution_controller();
+    void set_transform_history(TransformHistory* history);
+    TransformHistory* get_transform_history();
     void update();
 
 private:
     NodePath _camera2d;
     NodePath _render2d;
     bool _has_alpha;
+    bool _post_fusion;
     unsigned int _index;
+    unsigned int _sort;
     LVecBase2i _win_size;
+    GBufferLayout _gbuffer_layout;
+    std::string _gbuffer_prefix;  // of the G-buffer include and the shader variants
+    PointerTo<ResolutionController> _resolution_controller;
+    PointerTo<SharedCull> _shared_cull;
+    std::unordered_map<std::string, PointerTo<SharedCull>> _tag_shared_culls;  // by tag states
+    PointerTo<OcclusionCuller> _occlusion_culler;
+    PointerTo<TransformHistory> _transform_history;
+    LMatrix4 _prev_view_proj;  // without the jitter of the temporal passes
+    bool _has_prev_view_proj;
 
     pvector<RenderPass*> _scene_passes;
     pvector<RenderPass*> _post_passes;
+    pvector<PyramidPass*> _pyramid_passes;
+    pvector<HiZPass*> _hiz_passes;
+    pvector<RenderPassSpec> _specs;
+    pvector<RenderPass*> _passes;  // indexed by handles
+    std::unordered_map<std::string, int> _pass_handles;  // by pass and stage names
     static TypeHandle _type_handle;
 
+    void _configure_gbuffer();
+    Filename _make_shader_variant(const Filename &path);
+    void _add_render_pass(
+        char* name, unsigned short type,
+        Shader* shader, BitMask32 mask, float sx, float sy);
+    void _add_post_stage(char* name, char* path, bool pointwise, float sx, float sy);
+    void _add_pyramid_pass(
+        char* name, char* source, unsigned int num_levels, float threshold,
+        float sx, float sy);
+    void _add_hiz_pass(char* name, char* source, unsigned int num_levels, float sx, float sy);
+    void _delete_render_pass(RenderPass* render_pass);
+    void _rewire_prev_color();
+    void _bind_inputs(RenderPass* render_pass);
+    void _bind_gbuffer_inputs(RenderPass* render_pass);
+    void _register_pass(RenderPass* render_pass);
+    RenderPass* _find_render_pass(char* name);
+    pvector<int> _find_pass_inputs(int handle);
+    PointerTo<Texture> _find_texture(char* name);
+    PointerTo<Texture> _find_prev_color(unsigned int i);
+    void _apply_resolution_scale(float scale);
+    void _update_shared_cull();
+    void _update_velocity();
+    void _make_post_shader(PostPass* post_pass);
+
 public:
     static TypeHandle get_class_type() {
         return _type_handle;
@@ -0,0 +1,120 @@
+#include <math.h>
+
+#include "krender/core/resolution_controller.h"
+
+// frame time must drop below this part of the target to raise the scale
+#define RAISE_THRESHOLD 0.85
+
+
+TypeHandle ResolutionController::_type_handle;
+
+ResolutionController::ResolutionController(
+        double target_frame_time, float min_scale, float max_scale, float step,
+        unsigned int interval) {
+    _target_frame_time = target_frame_time;
+    _min_scale = min_scale;
+    _max_scale = max_scale;
+    _step = step > 0 ? step : 0.05;
+    _interval = interval > 0 ? interval : 1;
+    _deterministic = false;
+
+    _scale = max_scale;
+    _frame_time_sum = 0;
+    _num_frame_times = 0;
+    _average_frame_time = 0;
+}
+
+void ResolutionController::set_target_frame_time(double frame_time) {
+    _target_frame_time = frame_time;
+}
+
+double ResolutionController::get_target_frame_time() {
+    return _target_frame_time;
+}
+
+void ResolutionController::set_scale_bounds(float min_scale, float max_scale) {
+    _min_scale = min_scale;
+    _max_scale = max_scale;
+    if (_scale < _min_scale)
+        _scale = _min_scale;
+    if (_scale > _max_scale)
+        _scale = _max_scale;
+}
+
+float ResolutionController::get_min_scale() {
+    return _min_scale;
+}
+
+float ResolutionController::get_max_scale() {
+    return _max_scale;
+}
+
+/*
+ * Disables measuring of the frame time by the pipeline,
+ * so the scale depends on the injected frame times only.
+ */
+void ResolutionController::set_deterministic(bool deterministic) {
+    _deterministic = deterministic;
+}
+
+bool ResolutionController::is_deterministic() {
+    return _deterministic;
+}
+
+void ResolutionController::add_frame_time(double frame_time) {
+    _frame_time_sum += frame_time;
+    _num_frame_times++;
+}
+
+/*
+ * Returns the average frame time of the last completed interval.
+ */
+double ResolutionController::get_average_frame_time() {
+    return _average_frame_time;
+}
+
+float ResolutionController::get_scale() {
+    return _scale;
+}
+
+/*
+ * Picks a new scale once per interval of frames.
+ * Returns true if the scale was changed.
+ */
+bool ResolutionController::update() {
+    if (_num_frame_times < _interval)
+        return false;
+
+    _average_frame_time = _frame_time_sum / _num_frame_times;
+    _frame_time_sum = 0;
+    _num_frame_times = 0;
+
+    if (_average_frame_time <= 0)
+        return false;
+
+    // frame time is proportional to the number of pixels,
+    // which is proportional to the square of the scale
+    float ratio = _target_frame_time / _average_frame_time;
+    if (ratio >= 1 && ratio < 1.0 / RAISE_THRESHOLD)
+        return false;  // close enough
+
+    float scale = _scale * sqrt(ratio);
+    if (scale < _min_scale)
+        scale = _min_scale;
+    if (scale > _max_scale)
+        scale = _max_scale;
+
+    // change in steps, so FBOs are not resized by tiny amounts
+    float steps = floor(fabs(scale - _scale) / _step);
+    if (steps < 1) {
+        if (scale != _min_scale && scale != _max_scale)
+            return false;
+        if (scale == _scale)
+            return false;
+    } else {
+        scale = _scale + (scale > _scale ? steps : -steps) * _step;
+    }
+
+    _scale = scale;
+    return true;
+}
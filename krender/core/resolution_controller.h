@@ -0,0 +1,65 @@
+#ifndef CORE_RESOLUTION_CONTROLLER_H
+#define CORE_RESOLUTION_CONTROLLER_H
+
+#include "pandabase.h"
+#include "typedReferenceCount.h"
+
+
+/*
+ * Picks the resolution scale of the render passes,
+ * which keeps the frame time close to the target frame time.
+ * In the deterministic mode the frame times are injected by the caller only.
+ */
+class EXPORT_CLASS ResolutionController: public TypedReferenceCount {
+PUBLISHED:
+    ResolutionController(
+        double target_frame_time=1.0 / 60.0,
+        float min_scale=0.5, float max_scale=1, float step=0.05,
+        unsigned int interval=30);
+    void set_target_frame_time(double frame_time);
+    double get_target_frame_time();
+    void set_scale_bounds(float min_scale, float max_scale);
+    float get_min_scale();
+    float get_max_scale();
+    void set_deterministic(bool deterministic);
+    bool is_deterministic();
+    void add_frame_time(double frame_time);
+    double get_average_frame_time();
+    float get_scale();
+    bool update();
+
+private:
+    double _target_frame_time;
+    float _min_scale;
+    float _max_scale;
+    float _step;
+    unsigned int _interval;
+    bool _deterministic;
+
+    float _scale;
+    double _frame_time_sum;
+    unsigned int _num_frame_times;
+    double _average_frame_time;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(
+            _type_handle, "ResolutionController",
+            TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
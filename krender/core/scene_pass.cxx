@@ -1,15 +1,157 @@
+#include <string.h>
+
+#include "camera.h"
+#include "colorWriteAttrib.h"
+#include "depthTestAttrib.h"
+#include "depthWriteAttrib.h"
+#include "renderState.h"
+#include "shader.h"
+#include "shaderAttrib.h"
+
+#include "krender/core/instance.h"
 #include "krender/core/scene_pass.h"
+#include "krender/core/shared_cull.h"
 
 
 ScenePass::ScenePass(
         char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
-        bool has_srgb, bool has_alpha, float sx, float sy, NodePath card):
+        bool has_srgb, bool has_alpha, float sx, float sy, NodePath card,
+        GBufferLayout layout):
         RenderPass(name, index, win, cam, has_srgb, has_alpha, sx, sy, card) {
-    _fbo = _make_fbo(win, has_srgb, has_alpha, true, true, 3, _index);
-    _make_textures(true, true, 3);
+    FrameBufferProperties* fbp = layout.make_fb_properties(has_srgb);
+    _fbo = _make_fbo(win, fbp, has_alpha, _index);
+    delete fbp;
+    _make_gbuffer_textures(layout);
     char* cam_name = (char*) malloc((strlen(name) + strlen("_camera") + 1) * sizeof(char));
     sprintf(cam_name, "%s_camera", name);
     _cam = _make_camera(_fbo, cam_name, cam);
+    free(cam_name);
+}
+
+ScenePass::~ScenePass() {
+    set_depth_prepass(false);
+}
+
+void ScenePass::set_camera_mask(DrawMask mask) {
+    RenderPass::set_camera_mask(mask);
+    if (has_depth_prepass())
+        ((Camera*) _prepass_cam.node())->set_camera_mask(mask);
+}
+
+/*
+ * Makes the textures of the G-buffer,
+ * dropped aux targets don't take attachment slots.
+ */
+void ScenePass::_make_gbuffer_textures(GBufferLayout &layout) {
+    _add_texture(
+        "color", GBufferLayout::get_texture_format(layout.get_color_format()),
+        GraphicsOutput::RTP_color);
+    _add_texture(
+        "depth", layout.get_depth_texture_format(),
+        GraphicsOutput::RTP_depth);
+
+    const char* suffixes[] = {"emissive", "normal", "selector", "velocity"};
+    unsigned short formats[] = {
+        layout.get_emissive_format(),
+        layout.get_normal_format(),
+        layout.get_selector_format(),
+        layout.get_velocity_format()};
+
+    // same kind of attachment for all aux targets, see GBufferLayout
+    bool has_hdr_aux = layout.has_hdr_aux();
+    int slot = 0;
+    for (int i = 0; i < 4; i++) {
+        if (formats[i] == GBUFFER_NONE)
+            continue;
+
+        int plane = (has_hdr_aux ? GraphicsOutput::RTP_aux_hrgba_0 : GraphicsOutput::RTP_aux_rgba_0) + slot++;
+        _add_texture(
+            suffixes[i], GBufferLayout::get_texture_format(formats[i]),
+            (GraphicsOutput::RenderTexturePlane) plane);
+
+        // background has no motion of its own
+        if (strcmp(suffixes[i], "velocity") == 0) {
+            _fbo->set_clear_active(plane, true);
+            _fbo->set_clear_value(plane, LColor(0, 0, 0, 1));
+        }
+    }
+}
+
+/*
+ * Renders depth of the scene into the depth attachment of this pass
+ * before the scene itself, which is then rendered with less-equal test
+ * and without depth writes, so each opaque pixel is shaded only once.
+ * The prepass skips transparent objects, so they don't hide the opaque
+ * ones behind them and are still tested against the opaque depth.
+ */
+void ScenePass::set_depth_prepass(bool enabled) {
+    if (enabled == has_depth_prepass())
+        return;
+
+    Camera* scene_cam = (Camera*) _cam.node();
+
+    if (!enabled) {
+        _fbo->remove_display_region(_prepass_region);
+        _prepass_region = nullptr;
+        _prepass_cam.remove_node();
+        scene_cam->set_initial_state(RenderState::make_empty());
+        return;
+    }
+
+    char* cam_name = (char*) malloc((strlen(_name) + strlen("_prepass_camera") + 1) * sizeof(char));
+    sprintf(cam_name, "%s_prepass_camera", _name);
+
+    _prepass_cam = _cam.get_parent().attach_new_node(new Camera(cam_name));
+    free(cam_name);
+    Camera* prepass_cam = (Camera*) _prepass_cam.node();
+    prepass_cam->set_lens(scene_cam->get_lens());
+    prepass_cam->set_scene(scene_cam->get_scene());
+    prepass_cam->set_camera_mask(_camera_mask);
+
+    // depth only, cheap shader, priority 200 like the shadow cameras,
+    // above the 100 of the shaders set on the scene
+    CPT(RenderState) state = RenderState::make(
+        ColorWriteAttrib::make(ColorWriteAttrib::C_off), 1);
+    Shader* shader = Shader::load(
+        Shader::SL_GLSL,
+        Filename("krender/shader/depth.vert.glsl"),
+        Filename("krender/shader/depth.frag.glsl"));
+    if (shader != nullptr)
+        state = state->add_attrib(ShaderAttrib::make(shader, 200), 200);
+    prepass_cam->set_initial_state(state);
+
+    // subtrees of InstanceNodes, above the depth shader like the shadow ones
+    Shader* instanced_shader = InstanceNode::load_shader(
+        Filename("krender/shader/depth.vert.glsl"),
+        Filename("krender/shader/depth.frag.glsl"));
+    prepass_cam->set_tag_state_key(INSTANCE_TAG);
+    if (instanced_shader != nullptr)
+        prepass_cam->set_tag_state(
+            INSTANCE_TAG_STATE, RenderState::make(
+                ShaderAttrib::make(instanced_shader, INSTANCE_SHADER_SORT), INSTANCE_SHADER_SORT));
+
+    // FBO is cleared once before all of its display regions,
+    // so the scene region reuses depth written by the prepass region
+    _prepass_region = _fbo->make_display_region();
+    _prepass_region->set_sort((int) _index - 1);
+    _prepass_region->set_camera(_prepass_cam);
+    _prepass_region->set_cull_traverser(new OpaqueCullTraverser());
+
+    scene_cam->set_initial_state(RenderState::make(
+        DepthTestAttrib::make(DepthTestAttrib::M_less_equal),
+        DepthWriteAttrib::make(DepthWriteAttrib::M_off), 1));
+}
+
+bool ScenePass::has_depth_prepass() {
+    return !_prepass_cam.is_empty();
+}
+
+NodePath ScenePass::get_prepass_camera() {
+    return _prepass_cam;
+}
+
+PointerTo<DisplayRegion> ScenePass::get_prepass_region() {
+    return _prepass_region;
 }
 
 /*
@@ -23,6 +165,7 @@ NodePath ScenePass::_make_camera(PointerTo<GraphicsOutput> fbo, char* name, Node
     DisplayRegion* dr = fbo->make_display_region();
     dr->set_sort(_index);
     dr->set_camera(cam);
+    _region = dr;
 
     return cam;
 }
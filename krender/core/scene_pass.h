@@ -1,6 +1,9 @@
 #ifndef CORE_SCENE_PASS_H
 #define CORE_SCENE_PASS_H
 
+#include "displayRegion.h"
+
+#include "krender/core/gbuffer_layout.h"
 #include "krender/core/render_pass.h"
 
 
@@ -10,10 +13,21 @@ public:
         char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
         bool has_srgb=false, bool has_alpha=false,
         float sx=1, float sy=1,
-        NodePath card=NodePath::not_found());
+        NodePath card=NodePath::not_found(),
+        GBufferLayout layout=GBufferLayout());
+    virtual ~ScenePass();
+    virtual void set_camera_mask(DrawMask mask);
+    void set_depth_prepass(bool enabled);
+    bool has_depth_prepass();
+    NodePath get_prepass_camera();
+    PointerTo<DisplayRegion> get_prepass_region();
 
 protected:
+    NodePath _prepass_cam;
+    PointerTo<DisplayRegion> _prepass_region;
+
     NodePath _make_camera(PointerTo<GraphicsOutput> fbo, char* name, NodePath camera);
+    void _make_gbuffer_textures(GBufferLayout &layout);
 };
 
 #endif
@@ -0,0 +1,186 @@
+#include "clockObject.h"
+#include "cullBinAttrib.h"
+#include "cullBinManager.h"
+#include "cullTraverserData.h"
+#include "pandaNode.h"
+#include "sceneSetup.h"
+#include "transparencyAttrib.h"
+
+#include "krender/core/shared_cull.h"
+
+
+SharedCull::SharedCull() {
+    _frame = -1;
+}
+
+SharedCull::~SharedCull() {
+    clear();
+}
+
+void SharedCull::clear() {
+    for (unsigned int i = 0; i < _records.size(); i++) {
+        delete _records[i].object;
+    }
+    _records.clear();
+}
+
+int SharedCull::get_frame() {
+    return _frame;
+}
+
+void SharedCull::set_frame(int frame) {
+    _frame = frame;
+}
+
+void SharedCull::add_record(CullableObject* object, DrawMask draw_mask) {
+    Record record;
+    record.object = object;
+    record.draw_mask = draw_mask;
+    _records.push_back(record);
+}
+
+unsigned int SharedCull::get_num_records() {
+    return _records.size();
+}
+
+SharedCull::Record SharedCull::get_record(unsigned int i) {
+    return _records[i];
+}
+
+
+SharedCullTraverser::SharedCullTraverser(SharedCull* shared_cull, DrawMask pass_mask, bool is_opaque_only) {
+    _shared_cull = shared_cull;
+    _pass_mask = pass_mask;
+    _target_handler = nullptr;
+    _is_leader = false;
+    _is_opaque_only = is_opaque_only;
+}
+
+DrawMask SharedCullTraverser::get_pass_mask() {
+    return _pass_mask;
+}
+
+/*
+ * Returns false for the objects drawn with blending or alpha test
+ * and for the ones put into the sorted bins.
+ */
+bool SharedCullTraverser::is_opaque(const CullableObject &object) {
+    const TransparencyAttrib* transparency;
+    if (object._state->get_attrib(transparency) &&
+            transparency->get_mode() != TransparencyAttrib::M_none)
+        return false;
+
+    const CullBinAttrib* bin;
+    if (object._state->get_attrib(bin) && !bin->get_bin_name().empty()) {
+        CullBinManager* bin_manager = CullBinManager::get_global_ptr();
+        int bin_index = bin_manager->find_bin(bin->get_bin_name());
+        if (bin_index >= 0) {
+            CullBinManager::BinType bin_type = bin_manager->get_bin_type(bin_index);
+            if (bin_type == CullBinManager::BT_back_to_front || bin_type == CullBinManager::BT_fixed)
+                return false;
+        }
+    }
+    return true;
+}
+
+void SharedCullTraverser::set_scene(
+        SceneSetup* scene_setup, GraphicsStateGuardianBase* gsg,
+        bool dr_incomplete_render) {
+    _pass_state = scene_setup->get_initial_state();
+
+    int frame = ClockObject::get_global_clock()->get_frame_count();
+    _is_leader = _shared_cull->get_frame() != frame;
+
+    if (_is_leader) {
+        // record states without camera state,
+        // it is applied by each pass on its own
+        _shared_cull->clear();
+        _shared_cull->set_frame(frame);
+        scene_setup->set_initial_state(RenderState::make_empty());
+    } else {
+        // nothing to traverse, objects are replayed from the record
+        scene_setup->set_scene_root(NodePath("shared_cull"));
+    }
+
+    CullTraverser::set_scene(scene_setup, gsg, dr_incomplete_render);
+
+    // intercept culled objects
+    _target_handler = get_cull_handler();
+    set_cull_handler(this);
+}
+
+/*
+ * Remembers the draw mask of the node, which geoms are recorded next.
+ */
+void SharedCullTraverser::traverse_below(CullTraverserData &data) {
+    _draw_mask = data._draw_mask;
+    CullTraverser::traverse_below(data);
+}
+
+/*
+ * Records the object with the tag states of the leader camera applied.
+ */
+void SharedCullTraverser::record_object(CullableObject* object, const CullTraverser* traverser) {
+    _shared_cull->add_record(new CullableObject(*object), _draw_mask);
+    if (is_visible(_draw_mask))
+        _forward(*object);
+    delete object;
+}
+
+void SharedCullTraverser::end_traverse() {
+    if (!_is_leader) {
+        for (unsigned int i = 0; i < _shared_cull->get_num_records(); i++) {
+            SharedCull::Record record = _shared_cull->get_record(i);
+            if (is_visible(record.draw_mask))
+                _forward(*record.object);
+        }
+    }
+
+    set_cull_handler(_target_handler);
+    CullTraverser::end_traverse();
+}
+
+/*
+ * Same check as CullTraverserData::is_this_node_hidden.
+ */
+bool SharedCullTraverser::is_visible(DrawMask draw_mask) {
+    return (
+        !(draw_mask & PandaNode::get_overall_bit()).is_zero() &&
+        !(draw_mask & _pass_mask).is_zero());
+}
+
+void SharedCullTraverser::_forward(const CullableObject &object) {
+    if (_is_opaque_only && !is_opaque(object))
+        return;
+
+    CullableObject* copy = new CullableObject(object);
+    copy->_state = _pass_state->compose(copy->_state);
+    _target_handler->record_object(copy, this);
+}
+
+
+OpaqueCullTraverser::OpaqueCullTraverser() {
+    _target_handler = nullptr;
+}
+
+void OpaqueCullTraverser::set_scene(
+        SceneSetup* scene_setup, GraphicsStateGuardianBase* gsg,
+        bool dr_incomplete_render) {
+    CullTraverser::set_scene(scene_setup, gsg, dr_incomplete_render);
+
+    // intercept culled objects
+    _target_handler = get_cull_handler();
+    set_cull_handler(this);
+}
+
+void OpaqueCullTraverser::record_object(CullableObject* object, const CullTraverser* traverser) {
+    if (SharedCullTraverser::is_opaque(*object))
+        _target_handler->record_object(object, this);
+    else
+        delete object;
+}
+
+void OpaqueCullTraverser::end_traverse() {
+    set_cull_handler(_target_handler);
+    CullTraverser::end_traverse();
+}
@@ -0,0 +1,94 @@
+#ifndef CORE_SHARED_CULL_H
+#define CORE_SHARED_CULL_H
+
+#include "cullHandler.h"
+#include "cullTraverser.h"
+#include "cullableObject.h"
+#include "drawMask.h"
+#include "pvector.h"
+#include "referenceCount.h"
+#include "renderState.h"
+
+
+/*
+ * Visible set of the scene, culled once per frame
+ * and shared by all passes which use the same lens.
+ */
+class SharedCull: public ReferenceCount {
+public:
+    struct Record {
+        CullableObject* object;
+        DrawMask draw_mask;
+    };
+
+    SharedCull();
+    ~SharedCull();
+    void clear();
+    int get_frame();
+    void set_frame(int frame);
+    void add_record(CullableObject* object, DrawMask draw_mask);
+    unsigned int get_num_records();
+    Record get_record(unsigned int i);
+
+private:
+    int _frame;
+    pvector<Record> _records;
+};
+
+
+/*
+ * Cull traverser of a single display region.
+ * The first traverser of the frame culls the scene with the union
+ * of camera masks and records the result, the others replay the record.
+ * Each one keeps only objects visible to its own pass mask
+ * and applies its own camera initial state. Tag states are applied
+ * during the cull, so the recorded states carry the tag states
+ * of the leader and all passes sharing a cull must share them.
+ */
+class SharedCullTraverser: public CullTraverser, public CullHandler {
+public:
+    SharedCullTraverser(SharedCull* shared_cull, DrawMask pass_mask, bool is_opaque_only=false);
+    DrawMask get_pass_mask();
+    bool is_visible(DrawMask draw_mask);
+    static bool is_opaque(const CullableObject &object);
+
+    virtual void set_scene(
+        SceneSetup* scene_setup, GraphicsStateGuardianBase* gsg,
+        bool dr_incomplete_render);
+    virtual void traverse_below(CullTraverserData &data);
+    virtual void record_object(CullableObject* object, const CullTraverser* traverser);
+    virtual void end_traverse();
+
+private:
+    PointerTo<SharedCull> _shared_cull;
+    DrawMask _pass_mask;
+    DrawMask _draw_mask;
+    CPT(RenderState) _pass_state;
+    CullHandler* _target_handler;
+    bool _is_leader;
+    bool _is_opaque_only;
+
+    void _forward(const CullableObject &object);
+};
+
+
+/*
+ * Cull traverser, which draws only the opaque objects,
+ * e.g. for the depth prepass, which must not write depth
+ * of the transparent objects in front of the opaque ones.
+ */
+class OpaqueCullTraverser: public CullTraverser, public CullHandler {
+public:
+    OpaqueCullTraverser();
+
+    virtual void set_scene(
+        SceneSetup* scene_setup, GraphicsStateGuardianBase* gsg,
+        bool dr_incomplete_render);
+    virtual void record_object(CullableObject* object, const CullTraverser* traverser);
+    virtual void end_traverse();
+
+private:
+    CullHandler* _target_handler;
+};
+
+#endif
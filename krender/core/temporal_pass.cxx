@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <string.h>
+
+#include "camera.h"
+#include "cardMaker.h"
+
+#include "krender/core/temporal_pass.h"
+
+
+/*
+ * Radical inverse of the index in the given base, 0...1.
+ */
+static float halton(unsigned int index, unsigned int base) {
+    float f = 1;
+    float r = 0;
+    while (index > 0) {
+        f /= base;
+        r += f * (index % base);
+        index /= base;
+    }
+    return r;
+}
+
+
+TemporalPass::TemporalPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        bool has_srgb, bool has_alpha, float sx, float sy):
+        PostPass(name, index, win, cam, has_srgb, has_alpha, sx, sy, _make_card(name)) {
+    _type = TEMPORAL_PASS;
+    _film_offset = LVecBase2(0, 0);
+    _film_jitter = LVecBase2(0, 0);
+    _jitter = LVecBase2(0, 0);
+    _jitter_index = 0;
+    _has_history = false;
+
+    // copy of the output, read back by the next frame
+    char* tex_name = (char*) malloc((strlen(name) + strlen("_history") + 1) * sizeof(char));
+    sprintf(tex_name, "%s_history", name);
+    _history = new Texture(tex_name);
+    free(tex_name);
+    _history->set_wrap_u(SamplerState::WM_clamp);
+    _history->set_wrap_v(SamplerState::WM_clamp);
+    _history->set_magfilter(SamplerState::FilterType::FT_linear);
+    _history->set_minfilter(SamplerState::FilterType::FT_linear);
+    _fbo->add_render_texture(_history, GraphicsOutput::RTM_copy_texture, GraphicsOutput::RTP_color);
+
+    get_source_card().set_shader_input(ShaderInput("temporal_history", _history));
+    get_source_card().set_shader_input(ShaderInput("temporal_jitter", _jitter));
+    get_source_card().set_shader_input(ShaderInput("temporal_blend", LVecBase4(1, 0, 0, 0)));
+
+    // setup projection camera which captures the card of this pass
+    ((Camera*) get_camera().node())->set_scene(get_source_card());
+}
+
+TemporalPass::~TemporalPass() {
+    clear_jitter();
+}
+
+/*
+ * Shifts the lens by the next sub-pixel offset of the Halton (2, 3) sequence,
+ * size is the resolution of the jittered scene pass.
+ * Called by the pipeline once per frame, after the previous jitter is cleared.
+ */
+void TemporalPass::update(Lens* lens, LVecBase2i size) {
+    clear_jitter();
+
+    _jitter_index = (_jitter_index + 1) % TEMPORAL_JITTER_PHASES;
+    LVecBase2 pixel(
+        halton(_jitter_index + 1, 2) - 0.5,
+        halton(_jitter_index + 1, 3) - 0.5);
+
+    LMatrix4 proj_mat = lens->get_projection_mat();
+    LVecBase2 film_size = lens->get_film_size();
+    _film_offset = lens->get_film_offset();
+    _film_jitter = LVecBase2(
+        pixel[0] * film_size[0] / std::max(size[0], 1),
+        pixel[1] * film_size[1] / std::max(size[1], 1));
+    lens->set_film_offset(_film_offset + _film_jitter);
+    _lens = lens;
+
+    // measured on a point in front of the lens,
+    // so the direction of the shift doesn't depend on the lens type
+    LVector3 forward = LVector3::forward(lens->get_coordinate_system());
+    LVecBase4 point(forward * ((lens->get_near() + lens->get_far()) * 0.5), 1);
+    LVecBase4 clip = proj_mat.xform(point);
+    LVecBase4 jittered_clip = lens->get_projection_mat().xform(point);
+    _jitter = LVecBase2(
+        (jittered_clip[0] / jittered_clip[3] - clip[0] / clip[3]) * 0.5,
+        (jittered_clip[1] / jittered_clip[3] - clip[1] / clip[3]) * 0.5);
+
+    get_source_card().set_shader_input(ShaderInput("temporal_jitter", _jitter));
+    get_source_card().set_shader_input(ShaderInput(
+        "temporal_blend", LVecBase4(_has_history ? TEMPORAL_BLEND : 1, 0, 0, 0)));
+    _has_history = true;
+}
+
+/*
+ * Moves the lens back to its film offset without the jitter.
+ * A film offset changed by the application in the meantime is kept.
+ */
+void TemporalPass::clear_jitter() {
+    if (_lens == nullptr)
+        return;
+    if (_lens->get_film_offset() == _film_offset + _film_jitter)
+        _lens->set_film_offset(_film_offset);
+    _lens = nullptr;
+}
+
+/*
+ * Returns the jitter of this frame in UV units of the jittered pass.
+ */
+LVecBase2 TemporalPass::get_jitter() {
+    return _jitter;
+}
+
+/*
+ * Drops the history in the next frame, e.g. after a camera cut.
+ */
+void TemporalPass::reset_history() {
+    _has_history = false;
+}
+
+PointerTo<Texture> TemporalPass::get_history() {
+    return _history;
+}
+
+NodePath TemporalPass::_make_card(char* name) {
+    CardMaker cm(name);
+    cm.set_frame_fullscreen_quad();
+    return NodePath(cm.generate());
+}
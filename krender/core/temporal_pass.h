@@ -0,0 +1,44 @@
+#ifndef CORE_TEMPORAL_PASS_H
+#define CORE_TEMPORAL_PASS_H
+
+#include "lens.h"
+
+#include "krender/core/post_pass.h"
+
+#define TEMPORAL_BLEND 0.1  // weight of the current frame
+#define TEMPORAL_JITTER_PHASES 16
+
+
+/*
+ * Temporal upsampling of the passes rendered at reduced resolution.
+ * The lens of the scene is jittered by a sub-pixel offset each frame,
+ * the jittered colors are accumulated into the full resolution history,
+ * which is reprojected with the velocity target of the scene pass
+ * and clamped to the neighbourhood of the current color.
+ */
+class TemporalPass: public PostPass {
+public:
+    TemporalPass(
+        char* name, unsigned int index, GraphicsWindow* win, NodePath cam,
+        bool has_srgb=false, bool has_alpha=false,
+        float sx=1, float sy=1);
+    virtual ~TemporalPass();
+    void update(Lens* lens, LVecBase2i size);
+    void clear_jitter();
+    LVecBase2 get_jitter();
+    void reset_history();
+    PointerTo<Texture> get_history();
+
+protected:
+    PointerTo<Texture> _history;
+    PointerTo<Lens> _lens;  // jittered lens
+    LVecBase2 _film_offset;  // of the lens without the jitter
+    LVecBase2 _film_jitter;
+    LVecBase2 _jitter;  // in UV units of the jittered pass
+    unsigned int _jitter_index;
+    bool _has_history;
+
+    static NodePath _make_card(char* name);
+};
+
+#endif
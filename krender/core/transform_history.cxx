@@ -0,0 +1,79 @@
+#include "shaderInput.h"
+
+#include "krender/core/transform_history.h"
+
+
+TypeHandle TransformHistory::_type_handle;
+
+TransformHistory::TransformHistory() {
+}
+
+/*
+ * Tracks the model matrix of np, it has no motion until the next update.
+ */
+void TransformHistory::add_node(NodePath np) {
+    nassertv(!np.is_empty());
+    for (unsigned int i = 0; i < _entries.size(); i++) {
+        if (_entries[i].np == np)
+            return;
+    }
+
+    Entry entry;
+    entry.np = np;
+    entry.mat = LMatrix4::ident_mat();
+    entry.bound_mat = LMatrix4::ident_mat();
+    entry.has_mat = false;
+    _entries.push_back(entry);
+}
+
+void TransformHistory::remove_node(NodePath np) {
+    for (unsigned int i = 0; i < _entries.size(); i++) {
+        if (_entries[i].np == np) {
+            np.clear_shader_input("prev_model_delta");
+            _entries.erase(_entries.begin() + i);
+            return;
+        }
+    }
+}
+
+void TransformHistory::clear() {
+    for (unsigned int i = 0; i < _entries.size(); i++) {
+        if (!_entries[i].np.is_empty())
+            _entries[i].np.clear_shader_input("prev_model_delta");
+    }
+    _entries.clear();
+}
+
+unsigned int TransformHistory::get_num_nodes() {
+    return _entries.size();
+}
+
+/*
+ * Binds the motion since the last update and stores the current matrices,
+ * meant to be called once per frame before rendering.
+ * The delta is inverse(model matrix) * previous model matrix,
+ * p3d_ModelMatrix of a node below composed with it gives its previous one.
+ * Inputs of still nodes aren't touched, removed nodes are dropped.
+ */
+void TransformHistory::update(NodePath scene) {
+    unsigned int j = 0;
+    for (unsigned int i = 0; i < _entries.size(); i++) {
+        Entry &entry = _entries[i];
+        if (entry.np.is_empty() || entry.np.is_removed())
+            continue;
+
+        LMatrix4 mat = entry.np.get_mat(scene);
+        LMatrix4 delta = LMatrix4::ident_mat();
+        LMatrix4 inv_mat;
+        if (entry.has_mat && inv_mat.invert_from(mat))
+            delta = inv_mat * entry.mat;
+        if (!entry.has_mat || delta != entry.bound_mat) {
+            entry.np.set_shader_input(ShaderInput("prev_model_delta", delta));
+            entry.bound_mat = delta;
+        }
+        entry.mat = mat;
+        entry.has_mat = true;
+        _entries[j++] = entry;
+    }
+    _entries.resize(j);
+}
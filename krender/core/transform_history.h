@@ -0,0 +1,58 @@
+#ifndef CORE_TRANSFORM_HISTORY_H
+#define CORE_TRANSFORM_HISTORY_H
+
+#include "nodePath.h"
+#include "pandabase.h"
+#include "pvector.h"
+#include "typedReferenceCount.h"
+
+
+/*
+ * Keeps the model matrices of the previous frame for scene nodes,
+ * the counterpart of get_instance_prev_transform() of InstanceNode.
+ * Bound to them as the prev_model_delta shader input, which moves
+ * the current scene space positions to the previous ones, so it applies
+ * to the geometry of the child nodes with their own transforms too.
+ */
+class EXPORT_CLASS TransformHistory: public TypedReferenceCount {
+PUBLISHED:
+    TransformHistory();
+    void add_node(NodePath np);
+    void remove_node(NodePath np);
+    void clear();
+    unsigned int get_num_nodes();
+    void update(NodePath scene);
+
+public:
+    struct Entry {
+        NodePath np;
+        LMatrix4 mat;  // model matrix of the last update
+        LMatrix4 bound_mat;  // prev_model_delta
+        bool has_mat;
+    };
+
+private:
+    pvector<Entry> _entries;
+
+    static TypeHandle _type_handle;
+
+public:
+    static TypeHandle get_class_type() {
+        return _type_handle;
+    }
+    static void init_type() {
+        TypedReferenceCount::init_type();
+        register_type(
+            _type_handle, "TransformHistory",
+            TypedReferenceCount::get_class_type());
+    }
+    virtual TypeHandle get_type() const {
+        return get_class_type();
+    }
+    virtual TypeHandle force_init_type() {
+        init_type();
+        return get_class_type();
+    }
+};
+
+#endif
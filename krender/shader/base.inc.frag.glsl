@@ -1,5 +1,9 @@
+#ifndef BASE_INC_FRAG_GLSL
+#define BASE_INC_FRAG_GLSL
+
 #pragma include ".krender_config.inc.glsl"
 #pragma include "krender/shader/defines.inc.glsl"
+#pragma include ".krender_gbuffer.inc.glsl"
 
 
 vec3 decode_normal(vec3 color) {
@@ -61,3 +65,85 @@ vec3 srgb3(vec3 lrgb_color) {
         srgb(lrgb_color.g),
         srgb(lrgb_color.b));
 }
+
+float get_z_from_depth(float depth) {
+    /*
+      Convert 0...1 depth values to the linear camera distance.
+    */
+    // convert 0...1 depth values to -1...1 depth values.
+    float depth_decoded = (depth * 2.0 - 1.0);
+
+    float cam_depth_range = CAM_FAR - CAM_NEAR;
+    float cam_depth_max = CAM_FAR + CAM_NEAR;
+    return (
+        2.0 * CAM_NEAR * CAM_FAR /
+        (cam_depth_max - depth_decoded * cam_depth_range));
+}
+
+vec4 encode_gbuffer_color(vec4 color) {
+    /*
+      Linear color -> G-buffer color target.
+      sRGB target is encoded here, unless the framebuffer does it.
+    */
+#if (GBUFFER_COLOR_FORMAT == GBUFFER_SRGB_ALPHA)
+    return vec4(srgb3(color.rgb), color.a);
+#else
+    return color;
+#endif
+}
+
+vec4 decode_gbuffer_color(vec4 data) {
+    /*
+      G-buffer color target -> linear color.
+    */
+#if (GBUFFER_COLOR_FORMAT == GBUFFER_SRGB_ALPHA && SRGB_COLOR == 0)
+    return vec4(lrgb3(data.rgb), data.a);
+#else
+    return data;
+#endif
+}
+
+vec4 encode_gbuffer_emissive(vec4 emissive) {
+    /*
+      Aux targets keep linear values, 8-bit ones of an sRGB framebuffer
+      are encoded and decoded by the hardware.
+    */
+    return emissive;
+}
+
+vec4 encode_gbuffer_selector(vec4 selector) {
+    return selector;
+}
+
+vec4 encode_gbuffer_normal(vec3 normal) {
+    /*
+      XYZ Normal -> G-buffer normal target.
+    */
+#if (GBUFFER_NORMAL_FORMAT == GBUFFER_RGBA16F)
+    return vec4(normal, 1.0);
+#else
+    return vec4(encode_normal(normal), 1.0);
+#endif
+}
+
+vec3 decode_gbuffer_normal(vec4 data) {
+    /*
+      G-buffer normal target -> XYZ Normal.
+    */
+#if (GBUFFER_NORMAL_FORMAT == GBUFFER_RGBA16F)
+    return normalize(data.rgb);
+#else
+    return normalize(decode_normal(data.rgb));
+#endif
+}
+
+vec4 encode_gbuffer_velocity(vec4 clip_pos, vec4 prev_clip_pos) {
+    /*
+      Clip positions of this and the previous frame -> motion in 0...1 UV units.
+    */
+    vec2 ndc = clip_pos.xy / clip_pos.w;
+    vec2 prev_ndc = prev_clip_pos.xy / prev_clip_pos.w;
+    return vec4((ndc - prev_ndc) * 0.5, 0.0, 1.0);
+}
+
+#endif
@@ -16,13 +16,9 @@ in vec2 vert_uv;
 // outputs
 out vec4 color;
 
-#pragma include "krender/shader/blur.inc.frag.glsl"
+#pragma include "krender/shader/bloom.inc.frag.glsl"
 
 
 void main() {
-    vec3 bloom = process_blur(base_emissive, vert_uv);
-
-    color = texture(prev_color, vert_uv);
-    color.rgb += bloom.rgb;
-    color.a = 1.0;
+    color = process_bloom(texture(prev_color, vert_uv), vert_uv);
 }
@@ -0,0 +1,28 @@
+#ifndef BLOOM_INC_FRAG_GLSL
+#define BLOOM_INC_FRAG_GLSL
+/*
+  Bloom post stage.
+  Expects base_emissive and win_size to be declared by the including shader.
+  Samples BASE_EMISSIVE_PYRAMID instead of blurring, when it's defined.
+*/
+
+#pragma include "krender/shader/blur.inc.frag.glsl"
+
+
+vec4 process_bloom(vec4 color, vec2 uv) {
+    /*
+      Adds blurred emission on top of the previous render pass.
+      Reads prev_color only at the current pixel, so it can be fused.
+    */
+#ifdef BASE_EMISSIVE_PYRAMID
+    vec3 bloom = texture(BASE_EMISSIVE_PYRAMID, uv).rgb;
+#else
+    vec3 bloom = process_blur(base_emissive, uv).rgb;
+#endif
+
+    color.rgb += bloom.rgb;
+    color.a = 1.0;
+    return color;
+}
+
+#endif
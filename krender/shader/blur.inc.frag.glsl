@@ -1,8 +1,12 @@
+#ifndef BLUR_INC_FRAG_GLSL
+#define BLUR_INC_FRAG_GLSL
+
 #pragma include ".krender_config.inc.glsl"
 #pragma include "krender/shader/defines.inc.glsl"
 
 #define TWO_PI 6.283185307179586
 #define BLUR_SAMPLES 4
+#define BLUR_SIZE 0.01
 
 
 float intersect_circle(vec2 d, float radius) {
@@ -18,7 +22,7 @@ float intersect_circle(vec2 d, float radius) {
 }
 
 vec4 process_blur(sampler2D tex, vec2 uv, float blur_size) {
-    float aspect = win_size.x / win_size.y;
+    float aspect = float(win_size.x) / float(win_size.y);
     vec2 max_radius = vec2(blur_size, blur_size * aspect);
     float max_length = length(max_radius);
 
@@ -49,3 +53,9 @@ vec4 process_blur(sampler2D tex, vec2 uv, float blur_size) {
     blur /= max(1e-5, blurw);
     return blur;
 }
+
+vec4 process_blur(sampler2D tex, vec2 uv) {
+    return process_blur(tex, uv, BLUR_SIZE);
+}
+
+#endif
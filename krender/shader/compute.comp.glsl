@@ -0,0 +1,24 @@
+#version 430
+// version 430, so we can use compute shaders and image stores,
+// which are supported by Mesa llvmpipe as well
+
+// COMPUTE_GROUP_SIZE in compute_pass.h
+layout (local_size_x = 8, local_size_y = 8) in;
+
+// custom inputs from the previous pass
+uniform sampler2D prev_color;
+
+// outputs
+layout (rgba16f) uniform writeonly image2D output_image;
+
+
+void main() {
+    ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 size = imageSize(output_image);
+    if (texel.x >= size.x || texel.y >= size.y)
+        return;
+
+    // passes the previous color through, a template for custom passes
+    vec2 uv = (vec2(texel) + 0.5) / vec2(size);
+    imageStore(output_image, texel, texture(prev_color, uv));
+}
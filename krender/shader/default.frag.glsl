@@ -23,6 +23,10 @@ in vec3 vert_norm;
 in vec3 vert_pos;
 in vec3 vert_tan;
 in vec3 vert_binorm;
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    in vec4 vert_clip_pos;
+    in vec4 vert_prev_clip_pos;
+#endif
 
 // custom inputs
 uniform samplerBuffer light_data;
@@ -34,7 +38,19 @@ uniform samplerBuffer light_data;
 
 // outputs
 out vec4 color;
-out vec4 emissive;
+#if (GBUFFER_EMISSIVE_FORMAT != GBUFFER_NONE)
+    out vec4 emissive;
+#endif
+// aux targets are packed, so the targets before the velocity are written too
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+#if (GBUFFER_NORMAL_FORMAT != GBUFFER_NONE)
+    out vec4 gbuffer_normal;
+#endif
+#if (GBUFFER_SELECTOR_FORMAT != GBUFFER_NONE)
+    out vec4 selector;
+#endif
+    out vec4 velocity;
+#endif
 
 
 void main() {
@@ -45,16 +61,27 @@ void main() {
     vec4 emission_map = texture(p3d_TextureEmission, vert_uv);
     vec3 emission = emission_map.rgb * p3d_Material.emission.rgb;
 
-    emissive.rgb = diffuse.rgb * emission.rgb;
-    emissive.a = diffuse.a;
+    vec4 emission_color = vec4(diffuse.rgb * emission.rgb, diffuse.a);
+#if (GBUFFER_EMISSIVE_FORMAT != GBUFFER_NONE)
+    emissive = encode_gbuffer_emissive(emission_color);
+#endif
 
     ShadingData shading_data;
     shading_data.vert_pos = vert_pos;
     shading_data.normal = normal;
     vec4 shading = process_shading(light_data, shadowmap, shading_data);
-    shading += min(emissive.r + emissive.g + emissive.b, 1.0);
+    shading += min(emission_color.r + emission_color.g + emission_color.b, 1.0);
+
+    color = encode_gbuffer_color(vec4(
+        diffuse.rgb * p3d_Material.baseColor.rgb * shading.rgb, diffuse.a));
 
-    color.rgb = diffuse.rgb * p3d_Material.baseColor.rgb * shading.rgb;
-    color.rgb = srgb3(color.rgb);
-    color.a = diffuse.a;
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+#if (GBUFFER_NORMAL_FORMAT != GBUFFER_NONE)
+    gbuffer_normal = encode_gbuffer_normal(normal);
+#endif
+#if (GBUFFER_SELECTOR_FORMAT != GBUFFER_NONE)
+    selector = encode_gbuffer_selector(vec4(1.0, 0.0, 0.0, 1.0));
+#endif
+    velocity = encode_gbuffer_velocity(vert_clip_pos, vert_prev_clip_pos);
+#endif
 }
@@ -11,12 +11,33 @@ in vec4 p3d_Vertex;
 uniform mat4 p3d_ModelMatrix;
 uniform mat4 p3d_ViewProjectionMatrix;
 
+// variant for InstanceNode, see InstanceNode::load_shader()
+#ifdef INSTANCED
+#pragma include "krender/shader/instance.inc.glsl"
+#endif
+
+#pragma include ".krender_gbuffer.inc.glsl"
+
+// motion since the previous frame, see RenderPipeline::update()
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    uniform mat4 view_proj;  // without the jitter of the temporal pass
+    uniform mat4 prev_view_proj;
+    uniform mat4 prev_model_delta;  // zero for nodes without TransformHistory
+#endif
+
 // custom outputs to fragment shader
 out vec2 vert_uv;
 out vec3 vert_norm;
 out vec3 vert_pos;
 out vec3 vert_tan;
 out vec3 vert_binorm;
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    out vec4 vert_clip_pos;
+    out vec4 vert_prev_clip_pos;
+#endif
+
+// must match depth.vert.glsl for the depth prepass
+invariant gl_Position;
 
 
 void main() {
@@ -24,6 +45,10 @@ void main() {
 
     vec4 vertex = p3d_Vertex;
     mat4 model_matrix = p3d_ModelMatrix;
+#ifdef INSTANCED
+    int instance_id = get_instance_id();
+    model_matrix = model_matrix * get_instance_transform(instance_id);
+#endif
 
     vert_pos = (model_matrix * vertex).xyz;
     vert_norm = normalize(model_matrix * vec4(p3d_Normal.xyz, 0.0)).xyz;
@@ -35,4 +60,16 @@ void main() {
     vert_binorm = normalize(cross(vert_norm, vert_tan) * p3d_Tangent.w);
 
     gl_Position = p3d_ViewProjectionMatrix * vec4(vert_pos, 1.0);
+
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    // motion of the node or of a parent since the previous frame
+    mat4 prev_matrix = p3d_ModelMatrix;
+    if (prev_model_delta[3][3] != 0.0)
+        prev_matrix = prev_model_delta * prev_matrix;
+#ifdef INSTANCED
+    prev_matrix = prev_matrix * get_instance_prev_transform(instance_id);
+#endif
+    vert_clip_pos = view_proj * vec4(vert_pos, 1.0);
+    vert_prev_clip_pos = prev_view_proj * (prev_matrix * vertex);
+#endif
 }
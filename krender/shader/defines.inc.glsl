@@ -6,3 +6,4 @@
 #define SHADOW_SOURCE_PACKET_SIZE (R32 + SHADOW_SOURCE_INFO_SIZE)
 #define MAX_LIGHTS 24
 #define LIGHT_DATA_SIZE ((LIGHT_INFO_SIZE * MAX_LIGHTS) + (SHADOW_SOURCE_INFO_SIZE * MAX_LIGHTS * 6))
+#define LIGHT_TILE_SIZE 32
@@ -0,0 +1,7 @@
+#version 130
+// https://docs.panda3d.org/1.10/python/programming/shaders/list-of-glsl-inputs
+
+
+void main() {
+    // empty shader, because we render depth only (in vertex shader)
+}
@@ -0,0 +1,31 @@
+#version 130
+// https://docs.panda3d.org/1.10/python/programming/shaders/list-of-glsl-inputs
+
+// base panda inputs
+in vec4 p3d_Vertex;
+
+// uniform panda inputs
+uniform mat4 p3d_ModelMatrix;
+uniform mat4 p3d_ViewProjectionMatrix;
+
+// variant for InstanceNode, see InstanceNode::load_shader()
+#ifdef INSTANCED
+#pragma include "krender/shader/instance.inc.glsl"
+#endif
+
+// same math as in default.vert.glsl,
+// so depth of the prepass matches depth of the scene pass exactly
+invariant gl_Position;
+
+
+void main() {
+    vec4 vertex = p3d_Vertex;
+    mat4 model_matrix = p3d_ModelMatrix;
+#ifdef INSTANCED
+    model_matrix = model_matrix * get_instance_transform(get_instance_id());
+#endif
+
+    vec3 vert_pos = (model_matrix * vertex).xyz;
+
+    gl_Position = p3d_ViewProjectionMatrix * vec4(vert_pos, 1.0);
+}
@@ -0,0 +1,53 @@
+#ifndef DOF_INC_FRAG_GLSL
+#define DOF_INC_FRAG_GLSL
+/*
+  Depth of field post stage.
+  Expects base_depth, prev_color and win_size to be declared by the including shader.
+  Samples PREV_COLOR_PYRAMID instead of blurring, when it's defined.
+*/
+
+#pragma include "krender/shader/base.inc.frag.glsl"
+#pragma include "krender/shader/blur.inc.frag.glsl"
+
+// custom inputs
+uniform float dof_focus_near;
+uniform float dof_focus_far;
+uniform float dof_blur_near;
+uniform float dof_blur_far;
+
+
+float get_dof_coc(float z) {
+    /*
+      Signed circle of confusion, negative for the near field
+      and positive for the far field, 0 in focus.
+    */
+    float dof_focus = dof_focus_far - dof_focus_near;
+    float dof_focus_mid = dof_focus_near + dof_focus / 2.0;
+    return (
+        z > dof_focus_mid ?
+        smoothstep(dof_focus_far, dof_blur_far, z) :
+        -(1.0 - smoothstep(dof_blur_near, dof_focus_near, z)));
+}
+
+vec4 process_dof(vec4 color, vec2 uv) {
+    /*
+      Blurs out of focus pixels of the previous render pass.
+      Reads neighbours of prev_color, so it can only start a fused pass,
+      unless the blur pyramid of prev_color is used.
+    */
+    float depth = texture(base_depth, uv).x;
+    float z = get_z_from_depth(depth);
+    float value = abs(get_dof_coc(z));
+
+#ifdef PREV_COLOR_PYRAMID
+    vec3 blur = texture(PREV_COLOR_PYRAMID, uv).rgb;
+#else
+    vec3 blur = process_blur(prev_color, uv).rgb;
+#endif
+
+    color.rgb = mix(color.rgb, blur, value);
+    color.a = 1.0;
+    return color;
+}
+
+#endif
@@ -0,0 +1,31 @@
+#version 140
+// version 140, so we can use sampler2D
+
+// custom inputs from the first render pass
+uniform sampler2D base_depth;
+
+// custom inputs from the previous render pass
+uniform sampler2D prev_color;
+
+// custom inputs
+uniform ivec2 win_size;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+
+// outputs
+out vec4 color;
+
+#pragma include "krender/shader/dof.inc.frag.glsl"
+
+
+void main() {
+    /*
+      Downsamples the previous render pass
+      and stores the signed circle of confusion into alpha.
+    */
+    float z = get_z_from_depth(texture(base_depth, vert_uv).x);
+
+    color.rgb = texture(prev_color, vert_uv).rgb;
+    color.a = get_dof_coc(z) * 0.5 + 0.5;
+}
@@ -0,0 +1,53 @@
+#version 140
+// version 140, so we can use sampler2D
+
+// custom inputs from the first render pass
+uniform sampler2D base_depth;
+
+// custom inputs from the previous render pass
+uniform sampler2D prev_color;
+
+// custom inputs from the gather pass
+uniform sampler2D dof_gather;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+
+// outputs
+out vec4 color;
+
+#pragma include "krender/shader/base.inc.frag.glsl"
+
+
+void main() {
+    /*
+      Bilateral upsample of the gathered blur,
+      the low resolution texels are weighted by their depth similarity.
+    */
+    float z = get_z_from_depth(texture(base_depth, vert_uv).x);
+
+    vec2 size = vec2(textureSize(dof_gather, 0));
+    vec2 pos = vert_uv * size - 0.5;
+    vec2 base = floor(pos);
+    vec2 f = pos - base;
+
+    vec4 blur = vec4(0.0);
+    float blurw = 0.0;
+    for (int y = 0; y <= 1; ++y) {
+        for (int x = 0; x <= 1; ++x) {
+            vec2 texel = clamp(base + vec2(x, y), vec2(0.0), size - 1.0);
+            vec2 texel_uv = (texel + 0.5) / size;
+            float texel_z = get_z_from_depth(texture(base_depth, texel_uv).x);
+
+            float bilinear = (x == 1 ? f.x : 1.0 - f.x) * (y == 1 ? f.y : 1.0 - f.y);
+            float weight = bilinear / (1e-3 + abs(texel_z - z));
+            blur += texelFetch(dof_gather, ivec2(texel), 0) * weight;
+            blurw += weight;
+        }
+    }
+    blur /= max(1e-5, blurw);
+
+    float value = abs(blur.a * 2.0 - 1.0);
+    color.rgb = mix(texture(prev_color, vert_uv).rgb, blur.rgb, value);
+    color.a = 1.0;
+}
@@ -0,0 +1,74 @@
+#version 140
+// version 140, so we can use sampler2D
+
+// custom inputs from the circle of confusion pass
+uniform sampler2D dof_coc;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+
+// outputs
+out vec4 color;
+
+#define TWO_PI 6.283185307179586
+#define DOF_RINGS 3
+#define DOF_RADIUS 0.01
+
+
+void main() {
+    /*
+      Gathers far field blur for out of focus pixels
+      and near field blur, which spreads over every pixel it covers,
+      also over the sharp background behind the foreground.
+    */
+    vec4 center = texture(dof_coc, vert_uv);
+    float coc = center.a * 2.0 - 1.0;
+
+    vec2 size = vec2(textureSize(dof_coc, 0));
+    vec2 max_radius = vec2(DOF_RADIUS, DOF_RADIUS * size.x / size.y);
+
+    vec3 far = center.rgb;
+    float farw = 1.0;
+    vec3 near = center.rgb * max(-coc, 0.0);
+    float nearw = max(-coc, 0.0);
+    float n_near = 1.0;
+
+    for (int ring = 1; ring <= DOF_RINGS; ++ring) {
+        int n_samples = 8 * ring;
+        float ring_distance = ring / float(DOF_RINGS);  // in units of the max radius
+
+        for (int i = 0; i < n_samples; ++i) {
+            float phi = i / float(n_samples) * TWO_PI;
+            vec2 dir = vec2(sin(phi), cos(phi));
+
+            // far field is not allowed to take samples of the sharper foreground,
+            // in focus pixels don't gather it at all
+            if (coc > 0.01) {
+                vec4 tex_data = texture(dof_coc, vert_uv + dir * max_radius * ring_distance * coc);
+                float weight = step(0.0, tex_data.a * 2.0 - 1.0);
+                far += tex_data.rgb * weight;
+                farw += weight;
+            }
+
+            // near field sample covers this pixel, if its circle reaches it
+            vec4 tex_data = texture(dof_coc, vert_uv + dir * max_radius * ring_distance);
+            float near_coc = max(-(tex_data.a * 2.0 - 1.0), 0.0);
+            float weight = clamp((near_coc - ring_distance) * DOF_RINGS + 1.0, 0.0, 1.0) * step(0.01, near_coc);
+            near += tex_data.rgb * weight;
+            nearw += weight;
+            n_near += 1.0;
+        }
+    }
+
+    far /= farw;
+    near /= max(nearw, 1e-4);
+
+    // share of the pixel covered by the near field, doubled,
+    // so the blurred foreground is opaque over the half covered edge
+    float near_alpha = clamp(nearw * 2.0 / n_near, 0.0, 1.0);
+    float value = max(abs(coc), near_alpha);
+
+    // the composite pass mixes the sharp color with this one by the value
+    color.rgb = mix(far, near, near_alpha / max(value, 1e-4));
+    color.a = (coc < 0.0 || near_alpha > abs(coc) ? -value : value) * 0.5 + 0.5;
+}
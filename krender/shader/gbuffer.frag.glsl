@@ -0,0 +1,71 @@
+#version 140
+// version 140 to match default.frag.glsl
+// https://docs.panda3d.org/1.10/python/programming/shaders/list-of-glsl-inputs
+
+#pragma include "krender/shader/base.inc.frag.glsl"
+
+// panda structs
+struct Panda3DMaterial {
+    vec4 baseColor;
+    vec4 emission;
+};
+
+// panda inputs
+uniform Panda3DMaterial p3d_Material;
+uniform sampler2D p3d_TextureModulate;
+uniform sampler2D p3d_TextureNormal;
+uniform sampler2D p3d_TextureEmission;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+in vec3 vert_norm;
+in vec3 vert_pos;
+in vec3 vert_tan;
+in vec3 vert_binorm;
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    in vec4 vert_clip_pos;
+    in vec4 vert_prev_clip_pos;
+#endif
+
+// outputs, lighting is calculated later by the lighting pass
+out vec4 color;
+#if (GBUFFER_EMISSIVE_FORMAT != GBUFFER_NONE)
+    out vec4 emissive;
+#endif
+#if (GBUFFER_NORMAL_FORMAT != GBUFFER_NONE)
+    out vec4 normal;
+#endif
+#if (GBUFFER_SELECTOR_FORMAT != GBUFFER_NONE)
+    out vec4 selector;
+#endif
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    out vec4 velocity;
+#endif
+
+
+void main() {
+    mat3 tbn = mat3(vert_tan, vert_binorm, vert_norm);
+    vec4 diffuse = texture(p3d_TextureModulate, vert_uv);
+
+    color = encode_gbuffer_color(vec4(diffuse.rgb * p3d_Material.baseColor.rgb, diffuse.a));
+
+#if (GBUFFER_EMISSIVE_FORMAT != GBUFFER_NONE)
+    vec4 emission_map = texture(p3d_TextureEmission, vert_uv);
+    vec3 emission = emission_map.rgb * p3d_Material.emission.rgb;
+    emissive = encode_gbuffer_emissive(vec4(diffuse.rgb * emission.rgb, diffuse.a));
+#endif
+
+#if (GBUFFER_NORMAL_FORMAT != GBUFFER_NONE)
+    vec4 normal_map = texture(p3d_TextureNormal, vert_uv);
+    normal = encode_gbuffer_normal(normalize(tbn * normalize(decode_normal(normal_map.rgb))).xyz);
+#endif
+
+#if (GBUFFER_SELECTOR_FORMAT != GBUFFER_NONE)
+    // r - lit surface, unlit background stays 0
+    selector = encode_gbuffer_selector(vec4(1.0, 0.0, 0.0, 1.0));
+#endif
+
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    velocity = encode_gbuffer_velocity(vert_clip_pos, vert_prev_clip_pos);
+#endif
+}
@@ -0,0 +1,49 @@
+#version 140
+// version 140, so we can use sampler2D
+
+// custom inputs from the previous level
+uniform sampler2D source_tex;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+
+// outputs
+out vec4 color;
+
+// widest footprint taken, e.g. level 0 at 1/8 of the source size
+#define HIZ_MAX_FOOTPRINT 16
+
+
+void main() {
+    /*
+      Farthest depth of the source texels covered by this texel.
+      Sizes of the levels are not always even and the first level
+      may be smaller than half of the source, so the whole footprint is taken.
+      Wider footprints than HIZ_MAX_FOOTPRINT get the far plane,
+      which never occludes anything, so the result stays conservative.
+    */
+    vec2 source_size = vec2(textureSize(source_tex, 0));
+    vec2 half_texel = 0.5 * vec2(abs(dFdx(vert_uv.x)), abs(dFdy(vert_uv.y)));
+    ivec2 lo = ivec2(floor((vert_uv - half_texel) * source_size));
+    ivec2 hi = ivec2(ceil((vert_uv + half_texel) * source_size)) - 1;
+    lo = clamp(lo, ivec2(0), ivec2(source_size) - 1);
+    hi = clamp(hi, lo, ivec2(source_size) - 1);
+
+    if (any(greaterThan(hi - lo, ivec2(HIZ_MAX_FOOTPRINT - 1)))) {
+        color = vec4(1.0, 0.0, 0.0, 1.0);
+        return;
+    }
+
+    float depth = 0.0;
+    for (int y = 0; y < HIZ_MAX_FOOTPRINT; y++) {
+        if (lo.y + y > hi.y)
+            break;
+        for (int x = 0; x < HIZ_MAX_FOOTPRINT; x++) {
+            if (lo.x + x > hi.x)
+                break;
+            depth = max(depth, texelFetch(source_tex, lo + ivec2(x, y), 0).r);
+        }
+    }
+
+    color = vec4(depth, 0.0, 0.0, 1.0);
+}
@@ -0,0 +1,58 @@
+// per-instance data of the InstanceNode,
+// the channels of an instance are interleaved in RGBA32F texels,
+// the data of the previous frame has the same layout
+uniform samplerBuffer instance_data_tex;
+uniform samplerBuffer instance_prev_data_tex;
+uniform isamplerBuffer instance_index_tex;
+uniform int instance_stride;  // texels per instance
+uniform int instance_index_offset;  // first entry of the LOD drawn
+uniform int instance_lod;
+
+// offsets of the built-in channels in texels
+#define INSTANCE_TRANSFORM 0
+#define INSTANCE_TIME 4
+
+
+// id of the instance drawn, the visible instances are compacted
+int get_instance_id() {
+    return texelFetch(instance_index_tex, instance_index_offset + gl_InstanceID).r;
+}
+
+// rows of the Panda matrix are the columns of the GLSL matrix
+mat4 get_instance_mat4(samplerBuffer data, int id, int offset) {
+    int base = id * instance_stride + offset;
+    return mat4(
+        texelFetch(data, base),
+        texelFetch(data, base + 1),
+        texelFetch(data, base + 2),
+        texelFetch(data, base + 3));
+}
+
+mat4 get_instance_transform(int id) {
+    return get_instance_mat4(instance_data_tex, id, INSTANCE_TRANSFORM);
+}
+
+mat4 get_instance_prev_transform(int id) {
+    return get_instance_mat4(instance_prev_data_tex, id, INSTANCE_TRANSFORM);
+}
+
+float get_instance_time(int id) {
+    return texelFetch(instance_data_tex, id * instance_stride + INSTANCE_TIME).x;
+}
+
+float get_instance_prev_time(int id) {
+    return texelFetch(instance_prev_data_tex, id * instance_stride + INSTANCE_TIME).x;
+}
+
+// ordered dither of the LOD crossfades, true if the fragment is faded out,
+// e.g. if (instance_lod_dither(fade, gl_FragCoord.xy)) discard;
+// with the fade of get_instance_lod_fade() passed from the vertex shader,
+// both LODs cover complementary fragments
+bool instance_lod_dither(float fade, vec2 frag_coord) {
+    const float bayer[16] = float[16](
+        0.0, 8.0, 2.0, 10.0, 12.0, 4.0, 14.0, 6.0,
+        3.0, 11.0, 1.0, 9.0, 15.0, 7.0, 13.0, 5.0);
+    ivec2 p = ivec2(mod(frag_coord, 4.0));
+    float threshold = (bayer[p.y * 4 + p.x] + 0.5) / 16.0;
+    return fade >= 0.0 ? threshold >= fade : threshold < 1.0 + fade;
+}
@@ -0,0 +1,76 @@
+#version 140
+// version 140 for samplerBuffer
+// https://docs.panda3d.org/1.10/python/programming/shaders/list-of-glsl-inputs
+
+#pragma include "krender/shader/base.inc.frag.glsl"
+#pragma include "krender/shader/shading.inc.frag.glsl"
+
+// custom inputs from the scene pass
+uniform sampler2D gbuffer_color;
+uniform sampler2D gbuffer_depth;
+#if (GBUFFER_EMISSIVE_FORMAT != GBUFFER_NONE)
+    uniform sampler2D gbuffer_emissive;
+#endif
+#if (GBUFFER_NORMAL_FORMAT != GBUFFER_NONE)
+    uniform sampler2D gbuffer_normal;
+#endif
+#if (GBUFFER_SELECTOR_FORMAT != GBUFFER_NONE)
+    uniform sampler2D gbuffer_selector;
+#endif
+
+// custom inputs
+uniform mat4 inv_view_proj;
+uniform samplerBuffer light_data;
+uniform SHADOWMAP shadowmap;
+uniform isamplerBuffer light_tiles;
+uniform ivec2 light_tiles_size;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+
+// outputs
+out vec4 color;
+
+
+void main() {
+    /*
+      Lights each visible pixel of the G-buffer once,
+      only by the lights which cover the screen tile of the pixel.
+    */
+    vec4 diffuse = decode_gbuffer_color(texture(gbuffer_color, vert_uv));
+    color.rgb = srgb3(diffuse.rgb);
+    color.a = diffuse.a;
+
+    // reconstruct world position from depth
+    float depth = texture(gbuffer_depth, vert_uv).r;
+    vec4 pos = inv_view_proj * vec4(vert_uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec3 vert_pos = pos.xyz / pos.w;
+
+#if (GBUFFER_SELECTOR_FORMAT != GBUFFER_NONE)
+    if (texture(gbuffer_selector, vert_uv).r < 0.5)
+        return;  // background
+#else
+    if (depth >= 1.0)
+        return;  // background
+#endif
+
+    ShadingData shading_data;
+    shading_data.vert_pos = vert_pos;
+#if (GBUFFER_NORMAL_FORMAT != GBUFFER_NONE)
+    shading_data.normal = decode_gbuffer_normal(texture(gbuffer_normal, vert_uv));
+#else
+    // flat normal from the reconstructed position
+    shading_data.normal = normalize(cross(dFdx(vert_pos), dFdy(vert_pos)));
+#endif
+
+    ivec2 tile = ivec2(gl_FragCoord.xy) / LIGHT_TILE_SIZE;
+    int light_mask = texelFetch(light_tiles, tile.y * light_tiles_size.x + tile.x).r;
+
+    vec4 shading = process_shading_masked(light_data, shadowmap, shading_data, light_mask);
+#if (GBUFFER_EMISSIVE_FORMAT != GBUFFER_NONE)
+    vec4 emissive = texture(gbuffer_emissive, vert_uv);
+    shading += min(emissive.r + emissive.g + emissive.b, 1.0);
+#endif
+
+    color.rgb = srgb3(diffuse.rgb * shading.rgb);
+}
@@ -0,0 +1,32 @@
+#version 140
+// version 140, so we can use sampler2D
+
+// custom inputs from the previous pyramid level
+uniform sampler2D source_tex;
+uniform float pyramid_threshold;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+
+// outputs
+out vec4 color;
+
+
+void main() {
+    /*
+      Dual filter downsample.
+      https://community.arm.com/cfs-file/__key/communityserver-blogs-components-weblogfiles/00-00-00-20-66/siggraph2015_2D00_mmg_2D00_marius_2D00_notes.pdf
+    */
+    vec2 halfpixel = 0.5 / vec2(textureSize(source_tex, 0));
+
+    vec4 sum = texture(source_tex, vert_uv) * 4.0;
+    sum += texture(source_tex, vert_uv - halfpixel);
+    sum += texture(source_tex, vert_uv + halfpixel);
+    sum += texture(source_tex, vert_uv + vec2(halfpixel.x, -halfpixel.y));
+    sum += texture(source_tex, vert_uv - vec2(halfpixel.x, -halfpixel.y));
+    sum /= 8.0;
+
+    // keep only the bright part of the first level
+    color.rgb = max(sum.rgb - pyramid_threshold, 0.0);
+    color.a = 1.0;
+}
@@ -0,0 +1,32 @@
+#version 140
+// version 140, so we can use sampler2D
+
+// custom inputs from the previous pyramid level
+uniform sampler2D source_tex;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+
+// outputs
+out vec4 color;
+
+
+void main() {
+    /*
+      Dual filter upsample.
+      https://community.arm.com/cfs-file/__key/communityserver-blogs-components-weblogfiles/00-00-00-20-66/siggraph2015_2D00_mmg_2D00_marius_2D00_notes.pdf
+    */
+    vec2 halfpixel = 0.5 / vec2(textureSize(source_tex, 0));
+
+    vec4 sum = texture(source_tex, vert_uv + vec2(-halfpixel.x * 2.0, 0.0));
+    sum += texture(source_tex, vert_uv + vec2(-halfpixel.x, halfpixel.y)) * 2.0;
+    sum += texture(source_tex, vert_uv + vec2(0.0, halfpixel.y * 2.0));
+    sum += texture(source_tex, vert_uv + vec2(halfpixel.x, halfpixel.y)) * 2.0;
+    sum += texture(source_tex, vert_uv + vec2(halfpixel.x * 2.0, 0.0));
+    sum += texture(source_tex, vert_uv + vec2(halfpixel.x, -halfpixel.y)) * 2.0;
+    sum += texture(source_tex, vert_uv + vec2(0.0, -halfpixel.y * 2.0));
+    sum += texture(source_tex, vert_uv + vec2(-halfpixel.x, -halfpixel.y)) * 2.0;
+
+    color.rgb = sum.rgb / 12.0;
+    color.a = 1.0;
+}
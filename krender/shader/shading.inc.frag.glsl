@@ -155,3 +155,18 @@ vec4 process_shading(samplerBuffer light_data, SHADOWMAP shadowmap, SHADING_DATA
     }
     return shading;
 }
+
+vec4 process_shading_masked(samplerBuffer light_data, SHADOWMAP shadowmap, SHADING_DATA shading_data, int light_mask) {
+    /*
+      Same as process_shading, but shades only the lights present in the mask,
+      all of them, as the mask already holds just the lights reaching the pixel.
+    */
+    vec4 shading = vec4(0.0, 0.0, 0.0, 0.0);
+    for (int light_slot = 0; light_slot < MAX_LIGHTS; light_slot++) {
+        if ((light_mask >> light_slot) == 0) break;
+        if ((light_mask & (1 << light_slot)) == 0) continue;
+
+        shading += process_light(light_data, shadowmap, shading_data, light_slot);
+    }
+    return shading;
+}
@@ -10,6 +10,11 @@ in vec4 p3d_Vertex;
 uniform mat4 p3d_ModelMatrix;
 uniform mat4 p3d_ViewProjectionMatrix;
 
+// variant for InstanceNode, see InstanceNode::load_shader()
+#ifdef INSTANCED
+#pragma include "krender/shader/instance.inc.glsl"
+#endif
+
 // vertex shader outputs
 #if (DEPTH2COLOR == 1)
     out vec4 vert_pos;
@@ -19,6 +24,9 @@ uniform mat4 p3d_ViewProjectionMatrix;
 void main() {
     vec4 vertex = p3d_Vertex;
     mat4 model_matrix = p3d_ModelMatrix;
+#ifdef INSTANCED
+    model_matrix = model_matrix * get_instance_transform(get_instance_id());
+#endif
 
 #if (DEPTH2COLOR == 1)
     vert_pos = p3d_ViewProjectionMatrix * model_matrix * vertex;
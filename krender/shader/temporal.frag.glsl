@@ -0,0 +1,65 @@
+#version 140
+// version 140, so we can use textureSize
+
+#pragma include "krender/shader/base.inc.frag.glsl"
+
+// custom inputs from the last scene pass
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    uniform sampler2D gbuffer_velocity;
+#endif
+
+// custom inputs from the previous render pass, jittered at reduced resolution
+uniform sampler2D prev_color;
+
+// custom inputs of the temporal pass
+uniform sampler2D temporal_history;
+uniform vec2 temporal_jitter;
+uniform float temporal_blend;
+
+// custom inputs from vertex shader outputs
+in vec2 vert_uv;
+
+// outputs
+out vec4 color;
+
+
+void main() {
+    /*
+      Accumulates the jittered color into the history,
+      the reprojected history is clamped to the neighbourhood of the color,
+      so disoccluded and changed pixels don't leave trails.
+    */
+    vec2 size = vec2(textureSize(prev_color, 0));
+    vec2 uv = vert_uv + temporal_jitter;
+
+    vec4 current = texture(prev_color, uv);
+    vec4 color_min = current;
+    vec4 color_max = current;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            vec4 neighbour = texture(prev_color, uv + vec2(x, y) / size);
+            color_min = min(color_min, neighbour);
+            color_max = max(color_max, neighbour);
+        }
+    }
+
+#if (GBUFFER_VELOCITY_FORMAT != GBUFFER_NONE)
+    vec2 history_uv = vert_uv - texture(gbuffer_velocity, uv).xy;
+#else
+    vec2 history_uv = vert_uv;
+#endif
+    vec4 history = clamp(texture(temporal_history, history_uv), color_min, color_max);
+
+    // the current color counts the most, where a texel of the reduced
+    // resolution lands on this pixel, less in between the texels
+    vec2 texel_offset = fract(uv * size) - 0.5;
+    float weight = max(1.0 - length(texel_offset) * 2.0, 0.0);
+    float blend = temporal_blend * mix(0.25, 1.0, weight);
+
+    // no history yet or outside of the screen
+    bool is_outside = any(lessThan(history_uv, vec2(0.0))) || any(greaterThan(history_uv, vec2(1.0)));
+    if (temporal_blend >= 1.0 || is_outside)
+        blend = 1.0;
+
+    color = mix(history, current, blend);
+}
@@ -1,9 +1,35 @@
 #include <cxxtest/TestSuite.h>
 
+#include "krender/core/cull_bin_krender.h"
+#include "krender/core/instance.h"
 #include "krender/core/render_pipeline.h"
+#include "krender/core/occlusion_culler.h"
+#include "krender/core/resolution_controller.h"
+#include "krender/core/shared_cull.h"
+#include "krender/core/transform_history.h"
+#include "camera.h"
+#include "cardMaker.h"
+#include "clockObject.h"
+#include "cullBinAttrib.h"
+#include "frameBufferProperties.h"
+#include "graphicsEngine.h"
+#include "graphicsPipeSelection.h"
+#include "material.h"
 #include "pandaNode.h"
+#include "perspectiveLens.h"
 #include "nodePath.h"
+#include "shaderAttrib.h"
+#include "texture.h"
+#include "textureAttrib.h"
+#include "texturePeeker.h"
+#include "transparencyAttrib.h"
+#include "virtualFileSystem.h"
+#include "weakPointerTo.h"
+#include "windowProperties.h"
+#include <chrono>
+#include <math.h>
 #include <stdio.h>
+#include <unistd.h>
 
 
 class ChaosTest : public CxxTest::TestSuite {
@@ -11,3 +37,1105 @@ public:
     void test_something(void) {
     }
 };
+
+
+class ResolutionControllerTest : public CxxTest::TestSuite {
+public:
+    void test_scale_goes_down_when_slow(void) {
+        PointerTo<ResolutionController> rc = new ResolutionController(0.016, 0.5, 1, 0.05, 10);
+        rc->set_deterministic(true);
+        for (int i = 0; i < 100; i++) {
+            rc->add_frame_time(0.032);
+            rc->update();
+        }
+        TS_ASSERT_DELTA(rc->get_scale(), 0.5, 0.001);
+    }
+
+    void test_scale_goes_up_when_fast(void) {
+        PointerTo<ResolutionController> rc = new ResolutionController(0.016, 0.5, 1, 0.05, 10);
+        rc->set_deterministic(true);
+        for (int i = 0; i < 100; i++) {
+            rc->add_frame_time(0.032);
+            rc->update();
+        }
+        TS_ASSERT(rc->get_scale() < 1);
+        for (int i = 0; i < 100; i++) {
+            rc->add_frame_time(0.004);
+            rc->update();
+        }
+        TS_ASSERT_DELTA(rc->get_scale(), 1, 0.001);
+    }
+
+    void test_scale_is_stable_near_target(void) {
+        PointerTo<ResolutionController> rc = new ResolutionController(0.016, 0.5, 1, 0.05, 10);
+        rc->set_deterministic(true);
+        for (int i = 0; i < 100; i++) {
+            rc->add_frame_time(i % 2 ? 0.015 : 0.016);
+            TS_ASSERT(!rc->update());
+        }
+        TS_ASSERT_DELTA(rc->get_scale(), 1, 0.001);
+    }
+
+    void test_scale_is_deterministic(void) {
+        PointerTo<ResolutionController> a = new ResolutionController(0.016, 0.5, 1, 0.05, 5);
+        PointerTo<ResolutionController> b = new ResolutionController(0.016, 0.5, 1, 0.05, 5);
+        a->set_deterministic(true);
+        b->set_deterministic(true);
+        for (int i = 0; i < 200; i++) {
+            double frame_time = 0.008 + 0.0002 * ((i * 7) % 100);
+            a->add_frame_time(frame_time);
+            b->add_frame_time(frame_time);
+            TS_ASSERT_EQUALS(a->update(), b->update());
+            TS_ASSERT_EQUALS(a->get_scale(), b->get_scale());
+        }
+    }
+};
+
+
+class TransformHistoryTest : public CxxTest::TestSuite {
+public:
+    LMatrix4 get_delta(NodePath np) {
+        const float* data = (const float*) np.get_shader_input("prev_model_delta").get_ptr()._ptr;
+        return LMatrix4(
+            data[0], data[1], data[2], data[3],
+            data[4], data[5], data[6], data[7],
+            data[8], data[9], data[10], data[11],
+            data[12], data[13], data[14], data[15]);
+    }
+
+    void test_prev_model_matrix(void) {
+        NodePath scene("scene");
+        NodePath np = scene.attach_new_node("model");
+        np.set_pos(1, 0, 0);
+        PointerTo<TransformHistory> history = new TransformHistory();
+        history->add_node(np);
+        history->add_node(np);
+        TS_ASSERT_EQUALS(history->get_num_nodes(), 1u);
+
+        // no motion in the first frame
+        history->update(scene);
+        TS_ASSERT(get_delta(np).almost_equal(LMatrix4::ident_mat()));
+
+        np.set_pos(2, 0, 0);
+        history->update(scene);
+        TS_ASSERT(get_delta(np).almost_equal(LMatrix4::translate_mat(-1, 0, 0)));
+        history->update(scene);
+        TS_ASSERT(get_delta(np).almost_equal(LMatrix4::ident_mat()));
+
+        np.remove_node();
+        history->update(scene);
+        TS_ASSERT_EQUALS(history->get_num_nodes(), 0u);
+    }
+
+    void test_transformed_child(void) {
+        NodePath scene("scene");
+        NodePath parent = scene.attach_new_node("model");
+        NodePath child = parent.attach_new_node("geom");
+        parent.set_pos(1, 0, 0);
+        parent.set_h(90);
+        child.set_pos(0, 3, 0);
+        child.set_scale(2);
+        PointerTo<TransformHistory> history = new TransformHistory();
+        history->add_node(parent);
+        history->update(scene);
+
+        // the delta of the parent moves the child to its previous matrix
+        LMatrix4 prev_child_mat = child.get_mat(scene);
+        parent.set_pos(4, 5, 6);
+        parent.set_h(30);
+        history->update(scene);
+        TS_ASSERT(!get_delta(parent).almost_equal(LMatrix4::ident_mat()));
+        TS_ASSERT((child.get_mat(scene) * get_delta(parent)).almost_equal(prev_child_mat, 0.0001));
+
+        // a still parent has no motion, whatever the child transform is
+        history->update(scene);
+        TS_ASSERT((child.get_mat(scene) * get_delta(parent)).almost_equal(child.get_mat(scene), 0.0001));
+    }
+};
+
+
+class InstanceNodeTest : public CxxTest::TestSuite {
+public:
+    void test_upload_dirty_ranges_once_per_frame(void) {
+        ClockObject* clock = ClockObject::get_global_clock();
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 100);
+        size_t instance_size = node->get_stride() * FLOAT_SIZE;
+
+        // everything is copied first, into both frames
+        clock->tick();
+        TS_ASSERT(node->upload());
+        TS_ASSERT_EQUALS(node->get_uploaded_bytes(), 100 * (2 * instance_size + sizeof(int)));
+        TS_ASSERT(!node->upload());
+
+        // the swapped texture catches up once
+        clock->tick();
+        TS_ASSERT(node->upload());
+        TS_ASSERT_EQUALS(node->get_uploaded_bytes(), 100 * instance_size);
+
+        // nothing changed
+        clock->tick();
+        TS_ASSERT(node->upload());
+        TS_ASSERT_EQUALS(node->get_uploaded_bytes(), (size_t) 0);
+
+        // instances 10..12
+        node->set_transform(10, LMatrix4::ident_mat());
+        node->set_time(12, 1);
+        clock->tick();
+        TS_ASSERT(node->upload());
+        TS_ASSERT_EQUALS(node->get_uploaded_bytes(), 3 * instance_size);
+        clock->tick();
+        TS_ASSERT(node->upload());
+        TS_ASSERT_EQUALS(node->get_uploaded_bytes(), 3 * instance_size);
+        clock->tick();
+        TS_ASSERT(node->upload());
+        TS_ASSERT_EQUALS(node->get_uploaded_bytes(), (size_t) 0);
+        TS_ASSERT_EQUALS(
+            node->get_total_uploaded_bytes(),
+            100 * (3 * instance_size + sizeof(int)) + 6 * instance_size);
+    }
+
+    void test_transform_history(void) {
+        ClockObject* clock = ClockObject::get_global_clock();
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 10);
+        LMatrix4 a = LMatrix4::translate_mat(1, 0, 0);
+        LMatrix4 b = LMatrix4::translate_mat(2, 0, 0);
+
+        node->set_transform(3, a);
+        clock->tick();
+        node->upload();
+        node->set_transform(3, b);
+        TS_ASSERT(node->get_transform(3).almost_equal(b));
+        TS_ASSERT(node->get_prev_transform(3).almost_equal(a));
+        clock->tick();
+        node->upload();
+
+        // without changes both frames are the same
+        clock->tick();
+        node->upload();
+        TS_ASSERT(node->get_transform(3).almost_equal(b));
+        TS_ASSERT(node->get_prev_transform(3).almost_equal(b));
+
+        // a teleport without motion
+        node->set_transform(3, a);
+        node->set_prev_transform(3, a);
+        TS_ASSERT(node->get_prev_transform(3).almost_equal(a));
+        clock->tick();
+        node->upload();
+        TS_ASSERT(node->get_prev_transform(3).almost_equal(a));
+        TS_ASSERT(node->get_transform(3).almost_equal(a));
+    }
+
+    void test_bound_node_is_released(void) {
+        ClockObject* clock = ClockObject::get_global_clock();
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 10);
+        NodePath other("other");
+        node->update_shader_inputs();
+        node->update_shader_inputs(other);
+        TS_ASSERT(other.get_shader_input("instance_index_tex").get_texture() != nullptr);
+
+        // rebinding after the swap doesn't keep a path to the node itself
+        clock->tick();
+        node->set_transform(3, LMatrix4::translate_mat(1, 0, 0));
+        node->update_shader_inputs();
+        TS_ASSERT_EQUALS(node->get_ref_count(), 1);
+
+        WeakPointerTo<InstanceNode> weak = node;
+        node = nullptr;
+        TS_ASSERT(weak.was_deleted());
+    }
+
+    void test_channel_layout(void) {
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 20);
+        node->set_transform(5, LMatrix4::translate_mat(1, 2, 3));
+
+        // transform, time and 3 spare floats
+        TS_ASSERT_EQUALS(node->get_stride(), 20u);
+        TS_ASSERT_EQUALS(node->get_channel_offset(IC_TIME), 16u);
+
+        // fits into the spare floats
+        int frame = node->add_channel("frame", 2);
+        TS_ASSERT_EQUALS(node->get_channel_offset(frame), 17u);
+        TS_ASSERT_EQUALS(node->get_stride(), 20u);
+
+        // starts a new texel and keeps the data
+        int color = node->add_channel("color", 4);
+        TS_ASSERT_EQUALS(node->get_channel_offset(color), 20u);
+        TS_ASSERT_EQUALS(node->get_stride(), 24u);
+        TS_ASSERT(node->get_transform(5).almost_equal(LMatrix4::translate_mat(1, 2, 3)));
+        TS_ASSERT_EQUALS(node->get_channel(std::string("color")), color);
+
+        node->set_channel(7, color, LVecBase4(1, 0.5, 0.25, 1));
+        TS_ASSERT(node->get_channel_value(7, color).almost_equal(LVecBase4(1, 0.5, 0.25, 1)));
+
+        std::string glsl = node->get_glsl();
+        TS_ASSERT(glsl.find("vec2 get_instance_frame(int id)") != std::string::npos);
+        TS_ASSERT(glsl.find("id * instance_stride + 4).yz") != std::string::npos);
+        TS_ASSERT(glsl.find("vec4 get_instance_color(int id)") != std::string::npos);
+        TS_ASSERT(glsl.find("vec4 get_instance_prev_color(int id)") != std::string::npos);
+        TS_ASSERT(glsl.find("texelFetch(instance_data_tex, id * instance_stride + 5).xyzw") != std::string::npos);
+    }
+
+    void test_capacity_grows_and_shrinks(void) {
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 10);
+        NodePath root(node);
+        NodePath child = root.attach_new_node("child");
+        node->setup();
+        TS_ASSERT_EQUALS(node->get_capacity(), (unsigned int) MIN_INSTANCE_CAPACITY);
+
+        node->set_num_instances(50000);
+        TS_ASSERT_EQUALS(node->get_num_instances(), 50000u);
+        TS_ASSERT_EQUALS(node->get_capacity(), 50000u);
+        TS_ASSERT_EQUALS(child.get_instance_count(), 50000);
+
+        // amortized
+        node->set_num_instances(50001);
+        TS_ASSERT_EQUALS(node->get_capacity(), 100000u);
+
+        node->set_num_instances(100);
+        TS_ASSERT_EQUALS(node->get_capacity(), 200u);
+        TS_ASSERT_EQUALS(child.get_instance_count(), 100);
+    }
+
+    void test_set_transforms_from_pos_quat_scale(void) {
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 4);
+        LQuaternion quat;
+        quat.set_hpr(LVecBase3(30, 45, 60));
+        quat.normalize();
+
+        float pos[] = {1, 2, 3};
+        float q[] = {(float) quat.get_r(), (float) quat.get_i(), (float) quat.get_j(), (float) quat.get_k()};
+        float scale[] = {2, 3, 4};
+        node->set_transforms(pos, q, scale, 1, 2);
+
+        LMatrix4 rot;
+        quat.extract_to_matrix(rot);
+        LMatrix4 expected = LMatrix4::scale_mat(2, 3, 4) * rot * LMatrix4::translate_mat(1, 2, 3);
+
+        TS_ASSERT(node->get_transform(2).almost_equal(expected, 0.0001));
+        TS_ASSERT(node->get_transform(1).almost_equal(LMatrix4::ident_mat()));
+
+        float data[16];
+        for (int i = 0; i < 16; i++)
+            data[i] = (float) expected.get_data()[i];
+        node->set_transforms(data, 1, 3);
+        TS_ASSERT(node->get_transform(3).almost_equal(expected, 0.0001));
+    }
+
+    void test_frustum_culling(void) {
+        NodePath scene("scene");
+        PointerTo<Camera> camera_node = new Camera("camera", new PerspectiveLens());
+        NodePath camera = scene.attach_new_node(camera_node);
+
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 4);
+        NodePath root = scene.attach_new_node(node);
+        NodePath child = root.attach_new_node("child");
+        node->setup();
+        node->set_instance_bounds(LPoint3(0), 1);
+        node->set_transform(0, LMatrix4::translate_mat(0, 10, 0));
+        node->set_transform(1, LMatrix4::translate_mat(0, -10, 0));
+        node->set_transform(2, LMatrix4::translate_mat(100, 10, 0));
+        node->set_transform(3, LMatrix4::translate_mat(0, 20, 0));
+
+        node->add_cull_camera(camera);
+        node->cull();
+        TS_ASSERT_EQUALS(node->get_num_visible(), 2u);
+        TS_ASSERT_EQUALS(node->get_visible_instance(0), 0u);
+        TS_ASSERT_EQUALS(node->get_visible_instance(1), 3u);
+        TS_ASSERT_EQUALS(child.get_instance_count(), 2);
+
+        node->clear_cull_cameras();
+        node->cull();
+        TS_ASSERT_EQUALS(node->get_num_visible(), 4u);
+        TS_ASSERT_EQUALS(child.get_instance_count(), 4);
+    }
+
+    void test_all_instances_culled(void) {
+        NodePath scene("scene");
+        PointerTo<Camera> camera_node = new Camera("camera", new PerspectiveLens());
+        NodePath camera = scene.attach_new_node(camera_node);
+
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 2);
+        NodePath root = scene.attach_new_node(node);
+        NodePath child = root.attach_new_node("child");
+        node->setup();
+        node->set_instance_bounds(LPoint3(0), 1);
+        node->set_transform(0, LMatrix4::translate_mat(0, -10, 0));
+        node->set_transform(1, LMatrix4::translate_mat(0, -20, 0));
+
+        // an instance count of 0 would draw the child once without instancing
+        node->add_cull_camera(camera);
+        node->cull();
+        TS_ASSERT_EQUALS(node->get_num_visible(), 0u);
+        TS_ASSERT(child.is_hidden());
+
+        node->set_transform(1, LMatrix4::translate_mat(0, 20, 0));
+        node->cull();
+        TS_ASSERT_EQUALS(node->get_num_visible(), 1u);
+        TS_ASSERT(!child.is_hidden());
+        TS_ASSERT_EQUALS(child.get_instance_count(), 1);
+    }
+
+    void test_lod_sorting(void) {
+        NodePath scene("scene");
+        NodePath camera = scene.attach_new_node(new Camera("camera", new PerspectiveLens()));
+
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 6);
+        NodePath root = scene.attach_new_node(node);
+        NodePath high = root.attach_new_node("high");
+        NodePath low = root.attach_new_node("low");
+        node->setup();
+        node->set_instance_bounds(LPoint3(0), 1);
+        for (int i = 0; i < 6; i++)
+            node->set_transform(i, LMatrix4::translate_mat(0, 10 + i * 20, 0));
+
+        // 10, 30 | 50, 70, 90 | 110 is too far
+        node->add_lod(high, 40);
+        node->add_lod(low, 100);
+        node->set_lod_camera(camera);
+        node->cull();
+        TS_ASSERT_EQUALS(node->get_num_visible(), 5u);
+        TS_ASSERT_EQUALS(node->get_num_lod_instances(0), 2u);
+        TS_ASSERT_EQUALS(node->get_num_lod_instances(1), 3u);
+        TS_ASSERT_EQUALS(high.get_instance_count(), 2);
+        TS_ASSERT_EQUALS(low.get_instance_count(), 3);
+        TS_ASSERT_EQUALS(node->get_visible_instance(0), 0u);
+        TS_ASSERT_EQUALS(node->get_visible_instance(2), 2u);
+        TS_ASSERT_EQUALS(node->get_visible_instance(4), 4u);
+
+        // the instance at 50 is drawn by both LODs while fading
+        node->set_lod_fade(10);
+        node->cull();
+        camera.set_y(20);
+        node->cull();
+        TS_ASSERT_EQUALS(node->get_num_lod_instances(0), 3u);
+        TS_ASSERT_EQUALS(node->get_num_lod_instances(1), 4u);
+        TS_ASSERT_EQUALS(node->get_visible_instance(2), 2u);
+        TS_ASSERT(node->get_channel_value(2, node->get_channel("lod")).almost_equal(
+            LVecBase4(ClockObject::get_global_clock()->get_frame_time(), 1, 0, 0)));
+
+        node->set_lod_fade(0);
+        node->cull();
+        TS_ASSERT_EQUALS(node->get_num_lod_instances(1), 3u);
+        TS_ASSERT(node->get_glsl().find("float get_instance_lod_fade(int id)") != std::string::npos);
+    }
+
+    void test_lod_final_children(void) {
+        NodePath scene("scene");
+        NodePath camera = scene.attach_new_node(new Camera("camera", new PerspectiveLens()));
+
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 3);
+        NodePath root = scene.attach_new_node(node);
+        NodePath high = root.attach_new_node("high");
+        NodePath high_geom = high.attach_new_node("geom");
+        NodePath low = root.attach_new_node("low");
+        NodePath low_geom = low.attach_new_node("geom");
+        node->setup();
+        node->set_instance_bounds(LPoint3(0), 1);
+        for (int i = 0; i < 3; i++)
+            node->set_transform(i, LMatrix4::translate_mat(0, 10 + i * 20, 0));
+
+        // the final nodes found on setup follow the counts of their LOD
+        node->add_lod(high, 20);
+        node->add_lod(low, 100);
+        node->set_lod_camera(camera);
+        node->cull();
+        TS_ASSERT_EQUALS(high_geom.get_instance_count(), 1);
+        TS_ASSERT_EQUALS(low_geom.get_instance_count(), 2);
+
+        camera.set_y(-10);
+        node->cull();
+        TS_ASSERT(high.is_hidden());
+        TS_ASSERT_EQUALS(low_geom.get_instance_count(), 3);
+    }
+
+    void test_instanced_shader_variant(void) {
+        NodePath scene("scene");
+        PointerTo<InstanceNode> node = new InstanceNode("instances", 4);
+        NodePath np = scene.attach_new_node(node);
+        scene.set_shader(Shader::load(
+            Shader::SL_GLSL,
+            "krender/shader/default.vert.glsl",
+            "krender/shader/default.frag.glsl"), 100);
+        node->setup();
+
+        std::string source = VirtualFileSystem::get_global_ptr()->read_file(
+            Filename(".krender_instanced.default.vert.glsl"), true);
+        TS_ASSERT_EQUALS(source.find("#version 140\n#define INSTANCED 1\n"), (size_t) 0);
+        TS_ASSERT_EQUALS(source.find("#version 130"), std::string::npos);
+
+        // same priority, so it replaces the inherited one
+        TS_ASSERT_EQUALS(np.get_tag(INSTANCE_TAG), INSTANCE_TAG_STATE);
+        TS_ASSERT(np.get_shader() != nullptr);
+        TS_ASSERT_EQUALS(
+            np.get_shader()->get_filename(Shader::ST_vertex).get_fullpath(),
+            ".krender_instanced.default.vert.glsl");
+        TS_ASSERT_EQUALS(np.get_net_state()->get_override(ShaderAttrib::get_class_slot()), 100);
+    }
+
+    void test_benchmark_compose(void) {
+        const unsigned int count = 100000;
+        PointerTo<InstanceNode> node = new InstanceNode("instances", count);
+
+        // structure of arrays
+        pvector<float> pos(count * 3), quat(count * 4), scale(count * 3);
+        for (unsigned int i = 0; i < count; i++) {
+            LQuaternion q;
+            q.set_hpr(LVecBase3(i % 360, (i * 7) % 360, (i * 13) % 360));
+            for (int c = 0; c < 3; c++) {
+                pos[c * count + i] = (float) (i % 100) + c;
+                scale[c * count + i] = 1 + (i % 3) * 0.5f;
+            }
+            for (int c = 0; c < 4; c++)
+                quat[c * count + i] = (float) q[c];
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < count; i++) {
+            LQuaternion q(quat[i], quat[count + i], quat[count * 2 + i], quat[count * 3 + i]);
+            LMatrix4 rot;
+            q.extract_to_matrix(rot);
+            node->set_transform(i,
+                LMatrix4::scale_mat(scale[i], scale[count + i], scale[count * 2 + i]) * rot *
+                LMatrix4::translate_mat(pos[i], pos[count + i], pos[count * 2 + i]));
+        }
+        double scalar_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        LMatrix4 expected = node->get_transform(count - 1);
+
+        start = std::chrono::steady_clock::now();
+        node->set_transforms_soa(&pos[0], &quat[0], &scale[0], count, 0);
+        double compose_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        printf("\ninstance compose: %.3f ms LMatrix4, %.3f ms SIMD\n",
+            scalar_time * 1000, compose_time * 1000);
+        TS_ASSERT(node->get_transform(count - 1).almost_equal(expected, 0.0001));
+    }
+};
+
+
+class OcclusionCullerTest : public CxxTest::TestSuite {
+public:
+    NodePath make_card(NodePath parent, const char* name, float size, float y) {
+        CardMaker cm(name);
+        cm.set_frame(-size, size, -size, size);
+        NodePath card = parent.attach_new_node(cm.generate());
+        card.set_y(y);
+        return card;
+    }
+
+    void test_occludee_behind_wall_is_culled(void) {
+        NodePath scene("scene");
+        PointerTo<Camera> camera_node = new Camera("camera", new PerspectiveLens());
+        NodePath camera = scene.attach_new_node(camera_node);
+
+        NodePath wall = make_card(scene, "wall", 10, 10);
+        NodePath hidden = make_card(scene, "hidden", 1, 20);
+        NodePath visible = make_card(scene, "visible", 1, 5);
+
+        PointerTo<OcclusionCuller> culler = new OcclusionCuller(64, 32, 2);
+        culler->add_occluder(wall);
+        culler->add_occludee(hidden);
+        culler->add_occludee(visible);
+        culler->cull(camera, scene, DrawMask::bit(0));
+
+        TS_ASSERT(culler->is_occluded(hidden));
+        TS_ASSERT(!culler->is_occluded(visible));
+        TS_ASSERT(hidden.is_hidden(DrawMask::bit(0)));
+        TS_ASSERT(!visible.is_hidden(DrawMask::bit(0)));
+        TS_ASSERT_EQUALS(culler->get_num_tested(), 2u);
+        TS_ASSERT_EQUALS(culler->get_num_culled(), 1u);
+        TS_ASSERT_DELTA(culler->get_cull_rate(), 0.5, 0.001);
+        TS_ASSERT(culler->get_cull_time() >= 0);
+        TS_ASSERT(culler->get_depth(32, 16) < 1);
+
+        // moved out of the wall shadow, shown back
+        hidden.set_x(100);
+        camera.look_at(hidden);
+        culler->cull(camera, scene, DrawMask::bit(0));
+        TS_ASSERT(!culler->is_occluded(hidden));
+        TS_ASSERT(!hidden.is_hidden(DrawMask::bit(0)));
+    }
+
+    void test_partially_visible_occludee(void) {
+        NodePath scene("scene");
+        PointerTo<Camera> camera_node = new Camera("camera", new PerspectiveLens());
+        NodePath camera = scene.attach_new_node(camera_node);
+
+        NodePath wall = make_card(scene, "wall", 1, 10);
+        NodePath occludee = make_card(scene, "occludee", 4, 20);
+
+        PointerTo<OcclusionCuller> culler = new OcclusionCuller(64, 32, 1);
+        culler->add_occluder(wall);
+        culler->add_occludee(occludee);
+        culler->cull(camera, scene, DrawMask::bit(0));
+
+        TS_ASSERT(!culler->is_occluded(occludee));
+    }
+
+    void test_cull_depth(void) {
+        NodePath scene("scene");
+        PointerTo<Camera> camera_node = new Camera("camera", new PerspectiveLens());
+        NodePath camera = scene.attach_new_node(camera_node);
+        Lens* lens = camera_node->get_lens();
+        LMatrix4 view_proj_mat = scene.get_mat(camera) * lens->get_projection_mat();
+
+        // depth of a wall at y = 10, as read back from a Hi-Z pass
+        LVecBase4 clip = view_proj_mat.xform(LVecBase4(0, 10, 0, 1));
+        float wall_depth = clip[2] / clip[3] * 0.5 + 0.5;
+        PointerTo<Texture> depth = new Texture("depth");
+        depth->setup_2d_texture(16, 8, Texture::T_float, Texture::F_r32);
+        PTA_uchar image = depth->modify_ram_image();
+        for (int i = 0; i < 16 * 8; i++) {
+            ((float*) image.p())[i] = wall_depth;
+        }
+
+        NodePath hidden = make_card(scene, "hidden", 1, 20);
+        NodePath visible = make_card(scene, "visible", 1, 5);
+
+        PointerTo<OcclusionCuller> culler = new OcclusionCuller(64, 32, 1);
+        culler->add_occludee(hidden);
+        culler->add_occludee(visible);
+        culler->cull_depth(scene, DrawMask::bit(0), depth, view_proj_mat);
+
+        TS_ASSERT(culler->is_occluded(hidden));
+        TS_ASSERT(!culler->is_occluded(visible));
+        TS_ASSERT(culler->is_box_occluded(LPoint3(-1, 30, -1), LPoint3(1, 31, 1)));
+        TS_ASSERT(!culler->is_box_occluded(LPoint3(-1, 3, -1), LPoint3(1, 4, 1)));
+        TS_ASSERT_DELTA(culler->get_depth(8, 4), wall_depth, 0.0001);
+    }
+
+    void test_benchmark(void) {
+        NodePath scene("scene");
+        PointerTo<Camera> camera_node = new Camera("camera", new PerspectiveLens());
+        NodePath camera = scene.attach_new_node(camera_node);
+
+        PointerTo<OcclusionCuller> culler = new OcclusionCuller(256, 128);
+        for (int i = 0; i < 64; i++) {
+            NodePath wall = make_card(scene, "wall", 2, 10 + i);
+            wall.set_x((i % 8) * 2 - 8);
+            culler->add_occluder(wall);
+        }
+        for (int i = 0; i < 1000; i++) {
+            NodePath occludee = make_card(scene, "occludee", 0.5, 80 + (i % 10));
+            occludee.set_x((i % 40) - 20);
+            culler->add_occludee(occludee);
+        }
+
+        double total = 0;
+        for (int i = 0; i < 10; i++) {
+            culler->cull(camera, scene, DrawMask::bit(0));
+            total += culler->get_cull_time();
+        }
+        printf("\nocclusion cull: %.3f ms, %u/%u culled\n",
+            total / 10 * 1000, culler->get_num_culled(), culler->get_num_tested());
+        TS_ASSERT_EQUALS(culler->get_num_tested(), 1000u);
+    }
+};
+
+
+class CullBinKRenderTest : public CxxTest::TestSuite {
+public:
+    CullBinKRender::ObjectData make_data(
+            const Shader* shader, const RenderAttrib* textures,
+            const Material* material, PN_stdfloat dist) {
+        CullBinKRender::ObjectData data;
+        data._object = nullptr;
+        data._shader = shader;
+        data._textures = (const TextureAttrib*) textures;
+        data._material = material;
+        data._dist = dist;
+        return data;
+    }
+
+    void test_sort_order(void) {
+        PointerTo<Shader> shader_a = Shader::make(Shader::SL_GLSL, "void main() {}", "void main() {}");
+        PointerTo<Shader> shader_b = Shader::make(Shader::SL_GLSL, "void main() { }", "void main() {}");
+        CPT(RenderAttrib) textures_a = TextureAttrib::make(new Texture("a"));
+        CPT(RenderAttrib) textures_b = TextureAttrib::make(new Texture("b"));
+        PointerTo<Material> material = new Material("material");
+
+        pvector<CullBinKRender::ObjectData> objects;
+        objects.push_back(make_data(shader_a, textures_a, material, 5));
+        objects.push_back(make_data(shader_b, textures_a, material, 1));
+        objects.push_back(make_data(shader_a, textures_b, material, 3));
+        objects.push_back(make_data(shader_a, textures_a, material, 2));
+        objects.push_back(make_data(shader_b, textures_a, nullptr, 4));
+        objects.push_back(make_data(shader_b, textures_a, material, 6));
+        TS_ASSERT_EQUALS(CullBinKRender::count_state_changes(objects), 7u);
+
+        std::sort(objects.begin(), objects.end());
+        for (unsigned int i = 1; i < objects.size(); i++) {
+            const CullBinKRender::ObjectData &prev = objects[i - 1];
+            const CullBinKRender::ObjectData &cur = objects[i];
+            TS_ASSERT(!(cur < prev));
+            // front to back only within the same states
+            if (prev._shader == cur._shader && prev._textures == cur._textures && prev._material == cur._material)
+                TS_ASSERT_LESS_THAN(prev._dist, cur._dist);
+        }
+
+        // objects of a shader are drawn in one run
+        for (unsigned int i = 1; i < objects.size(); i++) {
+            if (objects[i]._shader != objects[i - 1]._shader)
+                for (unsigned int j = 0; j < i; j++)
+                    TS_ASSERT_DIFFERS(objects[j]._shader, objects[i]._shader);
+        }
+        TS_ASSERT_LESS_THAN_EQUALS(CullBinKRender::count_state_changes(objects), 5u);
+    }
+
+    void test_state_changes(void) {
+        PointerTo<Shader> shader = Shader::make(Shader::SL_GLSL, "void main() {}", "void main() {}");
+        CPT(RenderAttrib) textures = TextureAttrib::make(new Texture("a"));
+        PointerTo<Material> material = new Material("material");
+
+        pvector<CullBinKRender::ObjectData> objects;
+        TS_ASSERT_EQUALS(CullBinKRender::count_state_changes(objects), 0u);
+        objects.push_back(make_data(shader, textures, material, 1));
+        objects.push_back(make_data(shader, textures, material, 2));
+        TS_ASSERT_EQUALS(CullBinKRender::count_state_changes(objects), 0u);
+
+        // each of the three states counts on its own
+        objects.push_back(make_data(nullptr, nullptr, nullptr, 3));
+        TS_ASSERT_EQUALS(CullBinKRender::count_state_changes(objects), 3u);
+        objects.push_back(make_data(nullptr, textures, nullptr, 4));
+        TS_ASSERT_EQUALS(CullBinKRender::count_state_changes(objects), 4u);
+    }
+};
+
+
+class SharedCullTest : public CxxTest::TestSuite {
+public:
+    void test_pass_mask(void) {
+        DrawMask scene_mask = DrawMask::bit(1);
+        DrawMask depth_mask = DrawMask::bit(2);
+        PointerTo<SharedCull> shared_cull = new SharedCull();
+        PointerTo<SharedCullTraverser> scene = new SharedCullTraverser(shared_cull, scene_mask);
+        PointerTo<SharedCullTraverser> depth = new SharedCullTraverser(shared_cull, depth_mask);
+
+        // node shown to all cameras
+        DrawMask all = DrawMask::all_on();
+        TS_ASSERT(scene->is_visible(all));
+        TS_ASSERT(depth->is_visible(all));
+
+        // node hidden from the depth pass
+        DrawMask no_depth = all & ~depth_mask;
+        TS_ASSERT(scene->is_visible(no_depth));
+        TS_ASSERT(!depth->is_visible(no_depth));
+
+        // node hidden with hide(), the overall bit is off
+        DrawMask hidden = all & ~PandaNode::get_overall_bit();
+        TS_ASSERT(!scene->is_visible(hidden));
+        TS_ASSERT(!depth->is_visible(hidden));
+    }
+
+    void test_records(void) {
+        PointerTo<SharedCull> shared_cull = new SharedCull();
+        shared_cull->set_frame(3);
+        shared_cull->add_record(new CullableObject(), DrawMask::bit(1));
+        shared_cull->add_record(new CullableObject(), DrawMask::bit(2));
+        TS_ASSERT_EQUALS(shared_cull->get_frame(), 3);
+        TS_ASSERT_EQUALS(shared_cull->get_num_records(), 2u);
+        TS_ASSERT_EQUALS(shared_cull->get_record(1).draw_mask, DrawMask::bit(2));
+
+        shared_cull->clear();
+        TS_ASSERT_EQUALS(shared_cull->get_num_records(), 0u);
+    }
+
+    void test_opaque(void) {
+        CullableObject object;
+        object._state = RenderState::make_empty();
+        TS_ASSERT(SharedCullTraverser::is_opaque(object));
+
+        object._state = RenderState::make(TransparencyAttrib::make(TransparencyAttrib::M_alpha));
+        TS_ASSERT(!SharedCullTraverser::is_opaque(object));
+
+        object._state = RenderState::make(TransparencyAttrib::make(TransparencyAttrib::M_none));
+        TS_ASSERT(SharedCullTraverser::is_opaque(object));
+
+        // the default bins of Panda3D
+        object._state = RenderState::make(CullBinAttrib::make("transparent", 0));
+        TS_ASSERT(!SharedCullTraverser::is_opaque(object));
+        object._state = RenderState::make(CullBinAttrib::make("fixed", 0));
+        TS_ASSERT(!SharedCullTraverser::is_opaque(object));
+        object._state = RenderState::make(CullBinAttrib::make("opaque", 0));
+        TS_ASSERT(SharedCullTraverser::is_opaque(object));
+    }
+};
+
+
+class RenderPipelineTest : public CxxTest::TestSuite {
+public:
+    // window of each test, the tests needing it are skipped without a display
+    PointerTo<GraphicsEngine> _engine;
+    GraphicsWindow* _win;
+
+    void setUp() {
+        _engine = nullptr;
+        _win = nullptr;
+        PointerTo<GraphicsPipe> pipe = GraphicsPipeSelection::get_global_ptr()->make_default_pipe();
+        if (pipe == nullptr)
+            return;
+
+        _engine = new GraphicsEngine(pipe);
+        FrameBufferProperties fbp;
+        fbp.set_rgb_color(true);
+        fbp.set_depth_bits(24);
+        GraphicsOutput* output = _engine->make_output(
+            pipe, "pipeline_test", 0, fbp, WindowProperties::size(320, 240),
+            GraphicsPipe::BF_require_window);
+        if (output == nullptr)
+            return;
+        _engine->open_windows();
+        _win = DCAST(GraphicsWindow, output);
+    }
+
+    void tearDown() {
+        if (_engine != nullptr)
+            _engine->remove_all_windows();
+        _win = nullptr;
+        _engine = nullptr;
+    }
+
+    // FBO of a pass, named after the pass
+    GraphicsOutput* find_fbo(const std::string &name) {
+        for (int i = 0; i < _engine->get_num_windows(); i++) {
+            if (_engine->get_window(i)->get_name() == name)
+                return _engine->get_window(i);
+        }
+        return nullptr;
+    }
+
+    long get_rss_kb() {
+        long pages = 0;
+        FILE* f = fopen("/proc/self/statm", "r");
+        if (f == NULL)
+            return 0;
+        if (fscanf(f, "%*ld %ld", &pages) != 1)
+            pages = 0;
+        fclose(f);
+        return pages * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+
+    void make_pipeline(NodePath camera, NodePath camera2d) {
+        PointerTo<RenderPipeline> pipeline = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+        pipeline->add_render_pass((char*) "base", SCENE_PASS);
+        pipeline->add_render_pass((char*) "depth", DEPTH_PASS);
+        pipeline->add_pyramid_pass((char*) "glow", (char*) "base_emissive");
+        pipeline->add_render_pass((char*) "post", POST_PASS);
+        pipeline->add_render_pass((char*) "final", POST_PASS);
+        pipeline->remove_render_pass((char*) "post");
+        pipeline->rebuild();
+        TS_ASSERT(pipeline->get_pass_handle((char*) "post") < 0);
+        TS_ASSERT(pipeline->get_pass_handle((char*) "final") >= 0);
+        _engine->render_frame();
+    }
+
+    void test_create_and_destroy_pipelines(void) {
+        if (_win == nullptr)
+            TS_SKIP("no window");
+
+        NodePath camera(new Camera("camera", new PerspectiveLens()));
+        NodePath camera2d(new Camera("camera2d"));
+
+        // warm up caches of the shaders and the GSG
+        for (int i = 0; i < 5; i++) {
+            make_pipeline(camera, camera2d);
+        }
+        _engine->render_frame();
+        long rss = get_rss_kb();
+
+        for (int i = 0; i < 50; i++) {
+            make_pipeline(camera, camera2d);
+        }
+        _engine->render_frame();
+        long growth = get_rss_kb() - rss;
+        TS_ASSERT(growth < 4096);
+    }
+
+    void test_remove_pass_in_the_middle(void) {
+        if (_win == nullptr)
+            TS_SKIP("no window");
+
+        NodePath camera(new Camera("camera", new PerspectiveLens()));
+        NodePath camera2d(new Camera("camera2d"));
+        PointerTo<RenderPipeline> pipeline = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+        Shader* shader = Shader::load(
+            Shader::SL_GLSL,
+            Filename("krender/shader/post.vert.glsl"),
+            Filename("krender/shader/bloom.frag.glsl"));
+        pipeline->add_render_pass((char*) "base", SCENE_PASS);
+        pipeline->add_render_pass((char*) "lit", LIGHTING_PASS);
+        pipeline->add_render_pass((char*) "final", POST_PASS, shader);
+        TS_ASSERT_EQUALS(pipeline->get_source_card((char*) "final"), pipeline->get_result_card((char*) "lit"));
+
+        // the post pass captures the card of the pass before the removed one
+        pipeline->remove_render_pass((char*) "lit");
+        NodePath card = pipeline->get_source_card((char*) "final");
+        TS_ASSERT_EQUALS(card, pipeline->get_result_card((char*) "base"));
+        TS_ASSERT_EQUALS(card.get_shader(), shader);
+        _engine->render_frame();
+    }
+
+    void test_post_fusion(void) {
+        if (_win == nullptr)
+            TS_SKIP("no window");
+
+        NodePath camera(new Camera("camera", new PerspectiveLens()));
+        NodePath camera2d(new Camera("camera2d"));
+        PointerTo<RenderPipeline> pipeline = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+        pipeline->add_render_pass((char*) "base", SCENE_PASS);
+        pipeline->set_post_fusion(true);
+        pipeline->add_post_stage((char*) "dof", (char*) "krender/shader/dof.inc.frag.glsl");
+        pipeline->add_post_stage((char*) "bloom", (char*) "krender/shader/bloom.inc.frag.glsl");
+        pipeline->add_render_pass((char*) "final", POST_PASS);
+        NodePath dof_card = pipeline->get_source_card((char*) "dof");
+        dof_card.set_shader_input("dof_focus_near", 15.0);
+        dof_card.set_shader_input("dof_blur_near", 10.0);
+        dof_card.set_shader_input("dof_focus_far", 20.0);
+        dof_card.set_shader_input("dof_blur_far", 25.0);
+
+        // pointwise stages share one pass, custom shaders don't
+        TS_ASSERT_EQUALS(pipeline->get_pass_handle((char*) "bloom"), pipeline->get_pass_handle((char*) "dof"));
+        TS_ASSERT_EQUALS(pipeline->get_fusion_report(), "dof: dof + bloom (fused)\nfinal: custom shader\n");
+        _engine->render_frame();
+
+        // a rebuild keeps the fusion of the stages added before
+        pipeline->set_post_fusion(false);
+        pipeline->rebuild();
+        TS_ASSERT_EQUALS(pipeline->get_fusion_report(), "dof: dof + bloom (fused)\nfinal: custom shader\n");
+
+        // stages stay apart without fusion
+        pipeline = new RenderPipeline(_win, NodePath("render2d"), camera, camera2d);
+        pipeline->add_render_pass((char*) "base", SCENE_PASS);
+        pipeline->add_post_stage((char*) "dof", (char*) "krender/shader/dof.inc.frag.glsl");
+        pipeline->add_post_stage((char*) "bloom", (char*) "krender/shader/bloom.inc.frag.glsl");
+        TS_ASSERT_DIFFERS(pipeline->get_pass_handle((char*) "bloom"), pipeline->get_pass_handle((char*) "dof"));
+        TS_ASSERT_EQUALS(pipeline->get_fusion_report(), "dof: dof\nbloom: bloom\n");
+    }
+
+    void test_compute_pass(void) {
+        if (_win == nullptr)
+            TS_SKIP("no window");
+        if (!_win->get_gsg()->get_supports_compute_shaders())
+            TS_SKIP("no compute shaders");
+
+        NodePath camera(new Camera("camera", new PerspectiveLens()));
+        NodePath camera2d(new Camera("camera2d"));
+        PointerTo<RenderPipeline> pipeline = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+        PointerTo<Shader> shader = Shader::make_compute(Shader::SL_GLSL,
+            "#version 430\n"
+            "layout (local_size_x = 8, local_size_y = 8) in;\n"
+            "layout (rgba16f) uniform writeonly image2D output_image;\n"
+            "void main() {\n"
+            "    imageStore(output_image, ivec2(gl_GlobalInvocationID.xy), vec4(0.25, 0.5, 0.75, 1.0));\n"
+            "}\n");
+        pipeline->add_render_pass((char*) "base", SCENE_PASS);
+        pipeline->add_render_pass((char*) "compute", COMPUTE_PASS, shader, BitMask32(0), 0.25, 0.25);
+        pipeline->add_render_pass((char*) "final", POST_PASS);
+        PointerTo<Texture> output = pipeline->get_output((char*) "compute", COLOR_OUTPUT);
+        TS_ASSERT(output != nullptr);
+        TS_ASSERT_EQUALS(output->get_x_size(), 80);
+        TS_ASSERT_EQUALS(output->get_y_size(), 60);
+
+        // the dispatch covers the whole image, also the last partial work group
+        pipeline->update();
+        _engine->render_frame();
+        TS_ASSERT(_engine->extract_texture_data(output, _win->get_gsg()));
+        PointerTo<TexturePeeker> peeker = output->peek();
+        TS_ASSERT(peeker != nullptr);
+        LColor color;
+        peeker->fetch_pixel(color, 79, 59);
+        TS_ASSERT(color.almost_equal(LColor(0.25, 0.5, 0.75, 1.0), 0.01));
+        peeker->fetch_pixel(color, 0, 0);
+        TS_ASSERT(color.almost_equal(LColor(0.25, 0.5, 0.75, 1.0), 0.01));
+    }
+
+    void test_pass_enabled_and_interval(void) {
+        if (_win == nullptr)
+            TS_SKIP("no window");
+
+        NodePath camera(new Camera("camera", new PerspectiveLens()));
+        NodePath camera2d(new Camera("camera2d"));
+        PointerTo<RenderPipeline> pipeline = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+        pipeline->add_render_pass((char*) "base", SCENE_PASS);
+        pipeline->add_render_pass((char*) "post", POST_PASS);
+        pipeline->add_render_pass((char*) "final", POST_PASS);
+        GraphicsOutput* post_fbo = find_fbo("post");
+        GraphicsOutput* final_fbo = find_fbo("final");
+        TS_ASSERT(post_fbo != nullptr && final_fbo != nullptr);
+        NodePath final_card = pipeline->get_source_card((char*) "final");
+        TS_ASSERT_EQUALS(
+            final_card.get_shader_input("prev_color").get_texture(), pipeline->get_texture((char*) "post", 0));
+
+        // disabled pass is skipped, the next one reads the color before it
+        pipeline->set_pass_enabled((char*) "post", false);
+        TS_ASSERT(!pipeline->is_pass_enabled((char*) "post"));
+        pipeline->update();
+        TS_ASSERT(!post_fbo->is_active());
+        TS_ASSERT(final_fbo->is_active());
+        TS_ASSERT_EQUALS(
+            final_card.get_shader_input("prev_color").get_texture(), pipeline->get_texture((char*) "base", 0));
+        _engine->render_frame();
+
+        pipeline->set_pass_enabled((char*) "post", true);
+        pipeline->update();
+        TS_ASSERT(post_fbo->is_active());
+        TS_ASSERT_EQUALS(
+            final_card.get_shader_input("prev_color").get_texture(), pipeline->get_texture((char*) "post", 0));
+
+        // rendered in every other frame, starting with the next one
+        pipeline->set_pass_update_interval((char*) "post", 2);
+        TS_ASSERT_EQUALS(pipeline->get_pass_update_interval((char*) "post"), 2u);
+        for (int i = 0; i < 4; i++) {
+            pipeline->update();
+            TS_ASSERT_EQUALS(post_fbo->is_active(), i % 2 == 0);
+            TS_ASSERT(final_fbo->is_active());
+            _engine->render_frame();
+        }
+
+        // both are kept by a rebuild
+        pipeline->set_pass_enabled((char*) "final", false);
+        pipeline->rebuild();
+        TS_ASSERT(!pipeline->is_pass_enabled((char*) "final"));
+        TS_ASSERT_EQUALS(pipeline->get_pass_update_interval((char*) "post"), 2u);
+        pipeline->update();
+        TS_ASSERT(!find_fbo("final")->is_active());
+    }
+
+    void test_pass_registry_after_removal(void) {
+        if (_win == nullptr)
+            TS_SKIP("no window");
+
+        NodePath camera(new Camera("camera", new PerspectiveLens()));
+        NodePath camera2d(new Camera("camera2d"));
+        PointerTo<RenderPipeline> pipeline = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+        pipeline->add_render_pass((char*) "base", SCENE_PASS);
+        pipeline->add_render_pass((char*) "post", POST_PASS);
+        pipeline->add_render_pass((char*) "final", POST_PASS);
+        int base_handle = pipeline->get_pass_handle((char*) "base");
+        int post_handle = pipeline->get_pass_handle((char*) "post");
+        int final_handle = pipeline->get_pass_handle((char*) "final");
+        // the scene textures and the color of the pass before
+        TS_ASSERT_EQUALS(pipeline->get_num_pass_inputs(final_handle), 2u);
+        TS_ASSERT_EQUALS(pipeline->get_pass_input(final_handle, 0), base_handle);
+        TS_ASSERT_EQUALS(pipeline->get_pass_input(final_handle, 1), post_handle);
+
+        // handles of the other passes stay valid, the removed one is gone
+        pipeline->remove_render_pass((char*) "post");
+        TS_ASSERT(pipeline->get_pass_handle((char*) "post") < 0);
+        TS_ASSERT(pipeline->get_pass_name(post_handle) == NULL);
+        TS_ASSERT(pipeline->get_output(post_handle, COLOR_OUTPUT) == nullptr);
+        TS_ASSERT(pipeline->get_output((char*) "post", COLOR_OUTPUT) == nullptr);
+        TS_ASSERT_EQUALS(pipeline->get_pass_handle((char*) "base"), base_handle);
+        TS_ASSERT_EQUALS(pipeline->get_pass_handle((char*) "final"), final_handle);
+        TS_ASSERT_EQUALS(std::string(pipeline->get_pass_name(final_handle)), "final");
+        TS_ASSERT_EQUALS(pipeline->get_pass_type(final_handle), POST_PASS);
+
+        // outputs are looked up by handle and name alike
+        TS_ASSERT_EQUALS(pipeline->get_output(base_handle, COLOR_OUTPUT), pipeline->get_texture((char*) "base", 0));
+        TS_ASSERT_EQUALS(pipeline->get_output((char*) "base", DEPTH_OUTPUT), pipeline->get_output(base_handle, DEPTH_OUTPUT));
+        TS_ASSERT(pipeline->get_output(base_handle, DEPTH_OUTPUT) != nullptr);
+        TS_ASSERT_EQUALS(pipeline->get_output(final_handle, COLOR_OUTPUT), pipeline->get_texture((char*) "final", 0));
+        TS_ASSERT_EQUALS(pipeline->get_num_pass_inputs(final_handle), 1u);
+        TS_ASSERT_EQUALS(pipeline->get_pass_input(final_handle, 0), base_handle);
+
+        // a pass added again gets a new handle
+        pipeline->add_render_pass((char*) "post", POST_PASS);
+        TS_ASSERT(pipeline->get_pass_handle((char*) "post") >= 0);
+        TS_ASSERT_DIFFERS(pipeline->get_pass_handle((char*) "post"), post_handle);
+        _engine->render_frame();
+    }
+
+    void test_gbuffer_layout_per_pipeline(void) {
+        if (_win == nullptr)
+            TS_SKIP("no window");
+
+        NodePath camera(new Camera("camera", new PerspectiveLens()));
+        NodePath camera2d(new Camera("camera2d"));
+        PointerTo<RenderPipeline> first = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+        PointerTo<RenderPipeline> second = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+
+        // one half float aux target promotes the others
+        GBufferLayout layout;
+        layout.set_normal_format(GBUFFER_RGBA16F);
+        TS_ASSERT_EQUALS(layout.get_emissive_format(), GBUFFER_RGBA16F);
+        second->set_gbuffer_layout(layout);
+        TS_ASSERT_DIFFERS(first->get_gbuffer_include(), second->get_gbuffer_include());
+
+        VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+        std::string first_defines = vfs->read_file(first->get_gbuffer_include(), true);
+        std::string second_defines = vfs->read_file(second->get_gbuffer_include(), true);
+        TS_ASSERT(first_defines.find("#define GBUFFER_NORMAL_FORMAT 2\n") != std::string::npos);
+        TS_ASSERT(second_defines.find("#define GBUFFER_NORMAL_FORMAT 4\n") != std::string::npos);
+        TS_ASSERT(second_defines.find("#define GBUFFER_EMISSIVE_FORMAT 4\n") != std::string::npos);
+
+        // formats of the attachments match the defines
+        first->add_render_pass((char*) "base", SCENE_PASS);
+        second->add_render_pass((char*) "base", SCENE_PASS);
+        _engine->render_frame();
+        Texture::Format color_format = first->get_texture((char*) "base", 0)->get_format();
+        for (unsigned int i = 2; i < 5; i++) {
+            TS_ASSERT_EQUALS(first->get_texture((char*) "base", i)->get_format(), color_format);
+            TS_ASSERT_EQUALS(second->get_texture((char*) "base", i)->get_format(), Texture::F_rgba16);
+        }
+
+        // the default layout is rewritten by each pipeline
+        std::string defaults = vfs->read_file(GBUFFER_INC_GLSL, true);
+        TS_ASSERT_EQUALS(defaults, GBufferLayout().get_defines());
+
+        std::string include = second->get_gbuffer_include();
+        second = nullptr;
+        TS_ASSERT(!vfs->exists(include));
+    }
+
+    void test_temporal_upsampling(void) {
+        GBufferLayout layout;
+        TS_ASSERT_EQUALS(layout.get_velocity_format(), GBUFFER_NONE);
+        layout.set_velocity_format(GBUFFER_RGBA8);
+        TS_ASSERT_EQUALS(layout.get_velocity_format(), GBUFFER_NONE);
+        layout.set_velocity_format(GBUFFER_RGBA16F);
+        TS_ASSERT_EQUALS(layout.get_num_aux_textures(), 4);
+        TS_ASSERT_EQUALS(layout.get_normal_format(), GBUFFER_RGBA16F);
+        TS_ASSERT(layout.get_defines().find("#define GBUFFER_VELOCITY_FORMAT 4\n") != std::string::npos);
+
+        if (_win == nullptr)
+            TS_SKIP("no window");
+
+        PerspectiveLens* lens = new PerspectiveLens();
+        NodePath camera(new Camera("camera", lens));
+        NodePath camera2d(new Camera("camera2d"));
+
+        PointerTo<RenderPipeline> pipeline = new RenderPipeline(
+            _win, NodePath("render2d"), camera, camera2d);
+        pipeline->set_gbuffer_layout(layout);
+        pipeline->add_render_pass((char*) "base", SCENE_PASS, nullptr, BitMask32(0), 0.5, 0.5);
+        pipeline->add_render_pass((char*) "lighting", LIGHTING_PASS, nullptr, BitMask32(0), 0.5, 0.5);
+        pipeline->add_render_pass((char*) "temporal", TEMPORAL_PASS);
+        TS_ASSERT(pipeline->get_output((char*) "base", VELOCITY_OUTPUT) != nullptr);
+
+        // the scene is jittered by less than a pixel of the reduced resolution
+        LVecBase2 film_offset = lens->get_film_offset();
+        pipeline->update();
+        LVecBase2 jitter = lens->get_film_offset() - film_offset;
+        TS_ASSERT(jitter != LVecBase2(0, 0));
+        TS_ASSERT(fabs(jitter[0]) <= lens->get_film_size()[0] / 160 * 0.5);
+        TS_ASSERT(fabs(jitter[1]) <= lens->get_film_size()[1] / 120 * 0.5);
+        _engine->render_frame();
+
+        // the upsampled output stays at the window size with a resolution controller
+        pipeline->set_resolution_controller(new ResolutionController(1.0 / 60.0, 0.5, 0.5));
+        pipeline->update();
+        _engine->render_frame();
+        TS_ASSERT_EQUALS(pipeline->get_texture((char*) "lighting", 0)->get_x_size(), 80);
+        TS_ASSERT_EQUALS(pipeline->get_texture((char*) "temporal", 0)->get_x_size(), 320);
+
+        pipeline->remove_render_pass((char*) "temporal");
+        TS_ASSERT_EQUALS(lens->get_film_offset(), film_offset);
+    }
+};
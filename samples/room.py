@@ -5,14 +5,19 @@ import sys
 # PROJECT_PATH = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
 # sys.path.insert(0, os.path.join(PROJECT_PATH, 'dist'))
 
-from krender.core import RenderPipeline, POST_PASS, SCENE_PASS
+from krender.core import (
+    GBufferLayout, OcclusionCuller, RenderPipeline, ResolutionController,
+    GBUFFER_NONE, LIGHTING_PASS, POST_PASS, SCENE_PASS)
 
 from direct.gui.DirectGui import OnscreenImage
 from direct.showbase.ShowBase import ShowBase
 
 from panda3d.core import (
     get_model_path, load_prc_file_data, BitMask32, ClockObject, LColor,
-    Material, NodePath, PointLight, Shader, Texture, Vec2)
+    Material, NodePath, PointLight, Texture, Vec2)
+
+# light G-buffer in a separate pass instead of lighting the scene per fragment
+DEFERRED = True
 
 
 class Sample(ShowBase):
@@ -40,36 +45,56 @@ class Sample(ShowBase):
         self._render_pipeline = RenderPipeline(
             self.win, self.render2d, self.cam, self.cam2d,
             has_srgb=has_srgb, has_alpha=False, has_pcf=True, shadow_size=512)
+        if DEFERRED:
+            # compact G-buffer: 8-bit targets, no selector and 24-bit depth,
+            # the lighting pass tells the background by the far depth
+            layout = GBufferLayout()
+            layout.set_selector_format(GBUFFER_NONE)
+            layout.set_depth_bits(24)
+            self._render_pipeline.set_gbuffer_layout(layout)
         self._render_pipeline.add_render_pass('base', SCENE_PASS, mask=BitMask32(1 << 2))
-
-        # add depth of field render pass
-        self._render_pipeline.add_render_pass('dof', POST_PASS)
+        self._render_pipeline.set_depth_prepass('base')
+        # cull once for the depth prepass and the scene pass
+        self._render_pipeline.set_shared_cull(True)
+        # farthest depth pyramid, culls occludees in the next frame
+        self._render_pipeline.add_hiz_pass('hiz', 'base_depth')
+        if DEFERRED:
+            self._render_pipeline.add_render_pass('lit', LIGHTING_PASS)
+
+        # merge post processing stages into a single full-screen pass
+        self._render_pipeline.set_post_fusion(True)
+
+        # add blur pyramids of the scene color and emission,
+        # which are sampled by the post stages instead of brute-force blurs
+        self._render_pipeline.add_pyramid_pass('focus', 'prev_color', num_levels=3)
+        self._render_pipeline.add_pyramid_pass('glow', 'base_emissive', num_levels=4)
+        # glow changes slowly, render its pyramid every other frame
+        self._render_pipeline.set_pass_update_interval('glow', 2)
+
+        # add depth of field post stage
+        self._render_pipeline.add_post_stage(
+            'dof', 'krender/shader/dof.inc.frag.glsl')
         dof_card = self._render_pipeline.get_source_card('dof')
-        win_w = self.win.get_size().get_x()
-        win_h = self.win.get_size().get_y()
-        # dof_card.set_shader_input('win_size', Vec2(win_w, win_h))
-        dof_card.set_shader_input('win_size', self.win.get_size())
         dof_card.set_shader_input('dof_focus_near', 15.0)
         dof_card.set_shader_input('dof_blur_near', 15.0 - 5.0)
         dof_card.set_shader_input('dof_focus_far', 20.0)
         dof_card.set_shader_input('dof_blur_far', 20.0 + 5.0)
-        dof_card.set_shader(Shader.load(
-            Shader.SL_GLSL,
-            'krender/shader/dof.vert.glsl',
-            'krender/shader/dof.frag.glsl'), 100)
 
-        # add bloom render pass
-        self._render_pipeline.add_render_pass('bloom', POST_PASS, Shader.load(
-            Shader.SL_GLSL,
-            'krender/shader/bloom.vert.glsl',
-            'krender/shader/bloom.frag.glsl'))
+        # add bloom post stage, fused into the depth of field pass
+        self._render_pipeline.add_post_stage(
+            'bloom', 'krender/shader/bloom.inc.frag.glsl')
+
+        # lower resolution of the scene when frame takes longer than 1/60 s,
+        # the last post pass upscales it to the window size
+        self._render_pipeline.set_resolution_controller(
+            ResolutionController(1 / 60, 0.5, 1))
 
         # prepare scene with default shaders
         scene = self._render_pipeline.get_scene()
         # scene.set_shader_input('win_size', self.win.get_size())
-        scene.set_shader(Shader.load(
-            Shader.SL_GLSL,
+        scene.set_shader(self._render_pipeline.load_shader(
             'krender/shader/default.vert.glsl',
+            'krender/shader/gbuffer.frag.glsl' if DEFERRED else
             'krender/shader/default.frag.glsl'), 100)
 
         # show last pass on screen
@@ -85,6 +110,8 @@ class Sample(ShowBase):
         room = self.loader.load_model('room_industrial.egg.pz')
         room.reparent_to(scene)
         room.set_scale(0.5)
+        # the room is a single mesh, its walls and machines hide what is behind them
+        room.set_tag('occluder', '1')
 
         # load monkey and make it emissive
         monkey = self.loader.load_model('monkey.egg.pz')
@@ -101,6 +128,13 @@ class Sample(ShowBase):
         self._entity = self.loader.load_model('crate.egg.pz')
         self._entity.reparent_to(scene)
 
+        # hide crate when it is behind the depth of the previous frame,
+        # without the Hi-Z pass behind the nodes tagged as "occluder"
+        self._entity.set_tag('occludee', '1')
+        occlusion_culler = OcclusionCuller()
+        occlusion_culler.collect(scene)
+        self._render_pipeline.set_occlusion_culler(occlusion_culler)
+
         # force textures to use sRGB
         for t in scene.find_all_textures():
             if t.get_format() == Texture.F_rgb:
@@ -135,6 +169,7 @@ class Sample(ShowBase):
         self.accept('f3', self.toggleWireframe)
         self.accept('f4', self.bufferViewer.toggleEnable)
         self.accept('f5', self._render_pipeline.invalidate_shadows)
+        self.accept('f6', lambda: print(self._render_pipeline.get_fusion_report()))
 
         # entity movement keys
         self._movement = {}